@@ -0,0 +1,186 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "strfuncs.h"
+
+#include "managesieve-arg.h"
+#include "managesieve-quote.h"
+#include "managesieve-response.h"
+
+/*
+ * Parsing
+ */
+
+/* response-oknobye = ("OK" / "NO" / "BYE") [SP "(" resp-code ")"]
+                      [SP string] CRLF
+ */
+
+static const char *managesieve_response_parse_atom(const char **_p)
+{
+	const char *p = *_p, *start = p;
+
+	while (*p != '\0' && !IS_ATOM_SPECIAL((unsigned char)*p))
+		p++;
+	*_p = p;
+	return t_strdup_until(start, p);
+}
+
+static int
+managesieve_response_parse_quoted(const char **_p, const char **value_r)
+{
+	const char *p = *_p;
+	string_t *value;
+
+	i_assert(*p == '"');
+
+	value = t_str_new(128);
+	for (p++; *p != '"'; p++) {
+		if (*p == '\0')
+			return -1;
+		if (*p == '\\') {
+			p++;
+			if (!IS_QUOTED_SPECIAL(*p))
+				return -1;
+		}
+		str_append_c(value, *p);
+	}
+
+	*_p = p + 1;
+	*value_r = str_c(value);
+	return 0;
+}
+
+static int
+managesieve_response_parse_string(const char **_p, const char **value_r,
+				  const char **error_r)
+{
+	if (**_p == '{') {
+		*error_r = "Literal strings are not supported";
+		return -1;
+	}
+	if (**_p != '"') {
+		*error_r = "Expected string";
+		return -1;
+	}
+	if (managesieve_response_parse_quoted(_p, value_r) < 0) {
+		*error_r = "Invalid quoted string";
+		return -1;
+	}
+	return 0;
+}
+
+int managesieve_response_parse(const char *line,
+			       struct managesieve_response *resp_r,
+			       const char **error_r)
+{
+	const char *p = line, *word;
+
+	i_zero(resp_r);
+	*error_r = NULL;
+
+	word = managesieve_response_parse_atom(&p);
+	if (strcasecmp(word, "OK") == 0)
+		resp_r->type = MANAGESIEVE_RESPONSE_TYPE_OK;
+	else if (strcasecmp(word, "NO") == 0)
+		resp_r->type = MANAGESIEVE_RESPONSE_TYPE_NO;
+	else if (strcasecmp(word, "BYE") == 0)
+		resp_r->type = MANAGESIEVE_RESPONSE_TYPE_BYE;
+	else {
+		*error_r = "Invalid response type";
+		return -1;
+	}
+
+	if (*p == '\0')
+		return 0;
+	if (*p++ != ' ') {
+		*error_r = "Missing space after response type";
+		return -1;
+	}
+
+	/* Response code */
+	if (*p == '(') {
+		p++;
+		word = managesieve_response_parse_atom(&p);
+		if (*word == '\0') {
+			*error_r = "Empty response code";
+			return -1;
+		}
+		resp_r->code = t_str_ucase(word);
+
+		if (*p == ' ') {
+			p++;
+			if (*p == '"' || *p == '{') {
+				if (managesieve_response_parse_string(
+					&p, &resp_r->code_arg, error_r) < 0)
+					return -1;
+			} else {
+				word = managesieve_response_parse_atom(&p);
+				if (*word == '\0') {
+					*error_r = "Invalid response code argument";
+					return -1;
+				}
+				resp_r->code_arg = word;
+			}
+		}
+
+		if (*p++ != ')') {
+			*error_r = "Response code is not terminated";
+			return -1;
+		}
+		if (*p == '\0')
+			return 0;
+		if (*p++ != ' ') {
+			*error_r = "Missing space after response code";
+			return -1;
+		}
+	}
+
+	/* Human-readable text */
+	if (managesieve_response_parse_string(&p, &resp_r->text, error_r) < 0)
+		return -1;
+	if (*p != '\0') {
+		*error_r = "Unexpected data after response text";
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Composing
+ */
+
+void managesieve_response_append(string_t *str,
+				 const struct managesieve_response *resp)
+{
+	switch (resp->type) {
+	case MANAGESIEVE_RESPONSE_TYPE_OK:
+		str_append(str, "OK");
+		break;
+	case MANAGESIEVE_RESPONSE_TYPE_NO:
+		str_append(str, "NO");
+		break;
+	case MANAGESIEVE_RESPONSE_TYPE_BYE:
+		str_append(str, "BYE");
+		break;
+	case MANAGESIEVE_RESPONSE_TYPE_NONE:
+		i_unreached();
+	}
+
+	if (resp->code != NULL) {
+		str_append(str, " (");
+		str_append(str, resp->code);
+		if (resp->code_arg != NULL) {
+			str_append_c(str, ' ');
+			managesieve_quote_append_string(str, resp->code_arg,
+							FALSE);
+		}
+		str_append_c(str, ')');
+	}
+
+	if (resp->text != NULL) {
+		str_append_c(str, ' ');
+		managesieve_quote_append_string(str, resp->text, FALSE);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef MANAGESIEVE_RESPONSE_H
+#define MANAGESIEVE_RESPONSE_H
+
+/*
+ * Responses of a ManageSieve server
+ */
+
+enum managesieve_response_type {
+	MANAGESIEVE_RESPONSE_TYPE_NONE = 0,
+	MANAGESIEVE_RESPONSE_TYPE_OK,
+	MANAGESIEVE_RESPONSE_TYPE_NO,
+	MANAGESIEVE_RESPONSE_TYPE_BYE
+};
+
+struct managesieve_response {
+	enum managesieve_response_type type;
+
+	/* Response code atom (e.g. "TRYLATER"), or NULL if there is none */
+	const char *code;
+	/* String argument of the response code, or NULL if there is none */
+	const char *code_arg;
+
+	/* Human-readable text, or NULL if there is none */
+	const char *text;
+};
+
+/* Parse a response line (without CRLF) into resp_r. Literals are not
+   supported, since the line is parsed on its own. Returns -1 if the line is
+   not a valid response, in which case error_r is set. All values are
+   allocated from the data stack. */
+int managesieve_response_parse(const char *line,
+			       struct managesieve_response *resp_r,
+			       const char **error_r);
+
+/* Append the response to str in its wire form (without CRLF) */
+void managesieve_response_append(string_t *str,
+				 const struct managesieve_response *resp);
+
+#endif
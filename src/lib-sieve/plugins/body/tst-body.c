@@ -41,6 +41,7 @@ const struct sieve_command_def body_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.message_data = SIEVE_COMMAND_MESSAGE_BODY,
 	.registered = tst_body_registered,
 	.validate = tst_body_validate,
 	.generate = tst_body_generate
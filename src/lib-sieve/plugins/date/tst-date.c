@@ -49,6 +49,7 @@ const struct sieve_command_def date_test = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.message_data = SIEVE_COMMAND_MESSAGE_HEADERS,
 	.registered = tst_date_registered,
 	.validate = tst_date_validate,
 	.generate = tst_date_generate
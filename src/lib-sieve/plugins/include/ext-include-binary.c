@@ -2,6 +2,10 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "hash.h"
+#include "md5.h"
 #include "str.h"
 
 #include "sieve-common.h"
@@ -64,6 +68,8 @@ struct ext_include_binary_context {
 	struct sieve_variable_scope_binary *global_vars;
 
 	bool outdated:1;
+	/* Dependencies were not re-opened; trusted from the cache */
+	bool cached:1;
 };
 
 static struct ext_include_binary_context *ext_include_binary_create_context
@@ -197,6 +203,178 @@ struct sieve_variable_scope_binary *ext_include_binary_get_global_scope
 	return binctx->global_vars;
 }
 
+/*
+ * Dependency fingerprint
+ */
+
+/* Combined fingerprint of the include closure: the identity of each included
+   script and the content of those that are present. */
+static int
+ext_include_binary_fingerprint(struct ext_include_binary_context *binctx,
+			       unsigned char digest_r[MD5_RESULTLEN])
+{
+	struct ext_include_script_info *const *scripts;
+	struct md5_context md5ctx;
+	unsigned int script_count, i;
+	int ret = 0;
+
+	md5_init(&md5ctx);
+
+	scripts = array_get(&binctx->include_index, &script_count);
+	for ( i = 0; i < script_count && ret == 0; i++ ) {
+		struct ext_include_script_info *incscript = scripts[i];
+		const char *name = sieve_script_name(incscript->script);
+		unsigned char location = incscript->location;
+		unsigned char flags = incscript->flags;
+		struct istream *input;
+		const unsigned char *data;
+		size_t size;
+
+		md5_update(&md5ctx, &location, 1);
+		md5_update(&md5ctx, name, strlen(name) + 1);
+		md5_update(&md5ctx, &flags, 1);
+
+		if ( incscript->block == NULL )
+			continue;
+
+		if ( sieve_script_get_stream(incscript->script, &input, NULL) < 0 ) {
+			ret = -1;
+			break;
+		}
+
+		i_stream_seek(input, 0);
+		while ( i_stream_read_more(input, &data, &size) > 0 ) {
+			md5_update(&md5ctx, data, size);
+			i_stream_skip(input, size);
+		}
+		if ( input->stream_errno != 0 )
+			ret = -1;
+		i_stream_seek(input, 0);
+	}
+
+	md5_final(&md5ctx, digest_r);
+	return ret;
+}
+
+/*
+ * Dependency validation cache
+ */
+
+/* Records, per process, which binaries recently had their include
+   dependencies verified. This deliberately outlives the Sieve instance, which
+   is usually created anew for each delivery. */
+
+struct ext_include_binary_cache_entry {
+	char *path;
+
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	unsigned char fingerprint[MD5_RESULTLEN];
+
+	time_t checked;
+};
+
+static HASH_TABLE(const char *, struct ext_include_binary_cache_entry *)
+	ext_include_binary_cache;
+
+static void ext_include_binary_cache_clear(void)
+{
+	struct hash_iterate_context *hctx;
+	const char *path;
+	struct ext_include_binary_cache_entry *entry;
+
+	hctx = hash_table_iterate_init(ext_include_binary_cache);
+	while ( hash_table_iterate
+		(hctx, ext_include_binary_cache, &path, &entry) ) {
+		i_free(entry->path);
+		i_free(entry);
+	}
+	hash_table_iterate_deinit(&hctx);
+	hash_table_clear(ext_include_binary_cache, FALSE);
+}
+
+static void ext_include_binary_cache_deinit(void)
+{
+	if ( !hash_table_is_created(ext_include_binary_cache) )
+		return;
+
+	ext_include_binary_cache_clear();
+	hash_table_destroy(&ext_include_binary_cache);
+}
+
+static bool ext_include_binary_cache_is_fresh
+(const struct sieve_extension *ext, struct sieve_binary *sbin,
+	const unsigned char fingerprint[MD5_RESULTLEN])
+{
+	struct ext_include_context *ext_ctx = ext_include_get_context(ext);
+	struct ext_include_binary_cache_entry *entry;
+	const struct stat *st;
+	const char *path;
+
+	if ( ext_ctx->binary_recheck_interval == 0 ||
+		!hash_table_is_created(ext_include_binary_cache) )
+		return FALSE;
+
+	path = sieve_binary_path(sbin);
+	if ( path == NULL )
+		return FALSE;
+	entry = hash_table_lookup(ext_include_binary_cache, path);
+	if ( entry == NULL )
+		return FALSE;
+
+	st = sieve_binary_stat(sbin);
+	if ( entry->ino != st->st_ino || entry->mtime != st->st_mtime ||
+		entry->size != st->st_size ||
+		memcmp(entry->fingerprint, fingerprint, MD5_RESULTLEN) != 0 )
+		return FALSE;
+
+	return ( entry->checked <= ioloop_time &&
+		(ioloop_time - entry->checked) <
+			(time_t)ext_ctx->binary_recheck_interval );
+}
+
+static void ext_include_binary_cache_update
+(const struct sieve_extension *ext, struct sieve_binary *sbin,
+	const unsigned char fingerprint[MD5_RESULTLEN])
+{
+	struct ext_include_context *ext_ctx = ext_include_get_context(ext);
+	struct ext_include_binary_cache_entry *entry;
+	const struct stat *st;
+	const char *path;
+
+	if ( ext_ctx->binary_recheck_interval == 0 )
+		return;
+	path = sieve_binary_path(sbin);
+	if ( path == NULL )
+		return;
+
+	if ( !hash_table_is_created(ext_include_binary_cache) ) {
+		hash_table_create(&ext_include_binary_cache, default_pool, 0,
+			str_hash, strcmp);
+		lib_atexit(ext_include_binary_cache_deinit);
+	}
+
+	entry = hash_table_lookup(ext_include_binary_cache, path);
+	if ( entry == NULL ) {
+		/* Keep the cache bounded */
+		if ( hash_table_count(ext_include_binary_cache) >=
+			EXT_INCLUDE_BINARY_CACHE_MAX_ENTRIES )
+			ext_include_binary_cache_clear();
+
+		entry = i_new(struct ext_include_binary_cache_entry, 1);
+		entry->path = i_strdup(path);
+		hash_table_insert(ext_include_binary_cache, entry->path, entry);
+	}
+
+	st = sieve_binary_stat(sbin);
+	entry->ino = st->st_ino;
+	entry->mtime = st->st_mtime;
+	entry->size = st->st_size;
+	memcpy(entry->fingerprint, fingerprint, MD5_RESULTLEN);
+	entry->checked = ioloop_time;
+}
+
 /*
  * Binary extension
  */
@@ -210,17 +388,44 @@ static bool ext_include_binary_pre_save
 		(struct ext_include_binary_context *) context;
 	struct ext_include_script_info *const *scripts;
 	struct sieve_binary_block *sblock = binctx->dependency_block;
+	unsigned char fingerprint[MD5_RESULTLEN];
 	unsigned int script_count, i;
+	string_t *fprint;
 	bool result = TRUE;
 
+	/* The global variables of a loaded binary are read from the block
+	   that is about to be rewritten */
+	if ( binctx->global_vars != NULL &&
+		sieve_variable_scope_binary_get(binctx->global_vars) == NULL )
+		return FALSE;
+
 	sieve_binary_block_clear(sblock);
 
 	scripts = array_get(&binctx->include_index, &script_count);
 
+	/* Dependencies taken from the cache were never opened */
+	for ( i = 0; i < script_count; i++ ) {
+		struct ext_include_script_info *incscript = scripts[i];
+
+		if ( incscript->block != NULL &&
+			!sieve_script_is_open(incscript->script) &&
+			sieve_script_open(incscript->script, error_r) < 0 )
+			return FALSE;
+	}
+
+	if ( ext_include_binary_fingerprint(binctx, fingerprint) < 0 ) {
+		/* Never matches; dependencies are then checked as before */
+		memset(fingerprint, 0, sizeof(fingerprint));
+	}
+
 	sieve_binary_emit_unsigned(sblock, script_count);
+	fprint = t_str_new(sizeof(fingerprint));
+	str_append_data(fprint, fingerprint, sizeof(fingerprint));
+	sieve_binary_emit_string(sblock, fprint);
 
 	for ( i = 0; i < script_count; i++ ) {
 		struct ext_include_script_info *incscript = scripts[i];
+		sieve_size_t mdata_end;
 
 		if ( incscript->block != NULL ) {
 			sieve_binary_emit_unsigned
@@ -231,7 +436,11 @@ static bool ext_include_binary_pre_save
 		sieve_binary_emit_byte(sblock, incscript->location);
 		sieve_binary_emit_cstring(sblock, sieve_script_name(incscript->script));
 		sieve_binary_emit_byte(sblock, incscript->flags);
+
+		/* Metadata is preceded by its size, so that it can be skipped */
+		mdata_end = sieve_binary_emit_offset(sblock, 0);
 		sieve_script_binary_write_metadata(incscript->script, sblock);
+		sieve_binary_resolve_offset(sblock, mdata_end);
 	}
 
 	result = ext_include_variables_save(sblock, binctx->global_vars, error_r);
@@ -248,11 +457,15 @@ static bool ext_include_binary_open
 	struct ext_include_binary_context *binctx =
 		(struct ext_include_binary_context *) context;
 	struct sieve_binary_block *sblock;
+	unsigned char fingerprint[MD5_RESULTLEN];
 	unsigned int depcount, i, block_id;
 	sieve_size_t offset;
+	string_t *fprint;
+	bool cached;
 
 	sblock = sieve_binary_extension_get_block(sbin, ext);
 	block_id = sieve_binary_block_get_id(sblock);
+	binctx->dependency_block = sblock;
 
 	offset = 0;
 
@@ -264,6 +477,25 @@ static bool ext_include_binary_open
 		return FALSE;
 	}
 
+	if ( !sieve_binary_read_string(sblock, &offset, &fprint) ||
+		str_len(fprint) != sizeof(fingerprint) ) {
+		e_error(svinst->event,
+			"include: failed to read dependency fingerprint "
+			"from dependency block %d of binary %s", block_id,
+			sieve_binary_path(sbin));
+		return FALSE;
+	}
+	memcpy(fingerprint, str_data(fprint), sizeof(fingerprint));
+
+	/* Skip opening all dependencies when they were verified recently */
+	cached = ext_include_binary_cache_is_fresh(ext, sbin, fingerprint);
+	if ( cached && svinst->debug ) {
+		e_debug(svinst->event, "include: "
+			"dependencies of binary %s were verified recently",
+			sieve_binary_path(sbin));
+	}
+	binctx->cached = cached;
+
 	/* Check include limit */
 	if ( depcount > ext_ctx->max_includes ) {
 		e_error(svinst->event,
@@ -281,6 +513,8 @@ static bool ext_include_binary_open
 		struct sieve_storage *storage;
 		struct sieve_script *script;
 		enum sieve_error error;
+		sieve_size_t mdata_start;
+		sieve_offset_t mdata_size;
 		int ret;
 
 		if (
@@ -315,6 +549,16 @@ static bool ext_include_binary_open
 			return FALSE;
 		}
 
+		mdata_start = offset;
+		if ( !sieve_binary_read_offset(sblock, &offset, &mdata_size) ) {
+			/* Binary is corrupt, recompile */
+			e_error(svinst->event,
+				"include: failed to read script metadata size "
+				"from dependency block %d of binary %s",
+				block_id, sieve_binary_path(sbin));
+			return FALSE;
+		}
+
 		/* Can we find the script dependency ? */
 		storage = ext_include_get_script_storage
 			(ext, location, str_c(script_name), &error);
@@ -331,6 +575,18 @@ static bool ext_include_binary_open
 			/* No, recompile */
 			return FALSE;
 		}
+
+		if ( cached ) {
+			/* Verified recently; skip the metadata */
+			offset = mdata_start + mdata_size;
+
+			(void)ext_include_binary_script_include
+				(binctx, location, flags, script, inc_block);
+
+			sieve_script_unref(&script);
+			continue;
+		}
+
 		if ( sieve_script_open(script, &error) < 0 ) {
 			if ( error != SIEVE_ERROR_NOT_FOUND ) {
 				/* No, recompile */
@@ -388,6 +644,29 @@ static bool ext_include_binary_open
 		(ext, sblock, &offset, &binctx->global_vars) )
 		return FALSE;
 
+	if ( !cached && binctx->outdated ) {
+		unsigned char current[MD5_RESULTLEN];
+
+		/* Metadata (e.g. a modification time) changed; the binary is
+		   still usable when the content of the closure is the same */
+		if ( ext_include_binary_fingerprint(binctx, current) == 0 &&
+			memcmp(current, fingerprint, sizeof(current)) == 0 ) {
+			if ( svinst->debug ) {
+				e_debug(svinst->event, "include: "
+					"content of scripts included in binary %s "
+					"is unchanged", sieve_binary_path(sbin));
+			}
+			binctx->outdated = FALSE;
+
+			/* Store the new metadata upon the next save, so that
+			   the closure is not hashed again by every process */
+			sieve_binary_set_resave(sbin);
+		}
+	}
+
+	if ( !cached && !binctx->outdated )
+		ext_include_binary_cache_update(ext, sbin, fingerprint);
+
 	return TRUE;
 }
 
@@ -77,6 +77,7 @@ bool ext_include_load(const struct sieve_extension *ext, void **context)
 	struct ext_include_context *ctx;
 	const char *location;
 	unsigned long long int uint_setting;
+	sieve_number_t period;
 
 	if (*context != NULL)
 		ext_include_unload(ext);
@@ -107,6 +108,14 @@ bool ext_include_load(const struct sieve_extension *ext, void **context)
 		svinst, "sieve_include_max_includes", &uint_setting))
 		ctx->max_includes = (unsigned int) uint_setting;
 
+	ctx->binary_recheck_interval =
+		EXT_INCLUDE_DEFAULT_BINARY_RECHECK_INTERVAL;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_binary_recheck_interval", &period)) {
+		ctx->binary_recheck_interval = (period > UINT_MAX ?
+			UINT_MAX : (unsigned int)period);
+	}
+
 	/* Extension dependencies */
 	ctx->var_ext = sieve_ext_variables_get_extension(ext->svinst);
 
@@ -162,7 +171,8 @@ ext_include_get_script_storage(const struct sieve_extension *ext,
 		}
 		if (ctx->global_storage == NULL) {
 			ctx->global_storage = sieve_storage_create(
-				svinst, ctx->global_location, 0, error_r);
+				svinst, ctx->global_location,
+				SIEVE_STORAGE_FLAG_GLOBAL, error_r);
 		}
 		return ctx->global_storage;
 	default:
@@ -109,6 +109,7 @@ struct ext_include_context {
 
 	unsigned int max_nesting_depth;
 	unsigned int max_includes;
+	unsigned int binary_recheck_interval;
 };
 
 static inline struct ext_include_context *
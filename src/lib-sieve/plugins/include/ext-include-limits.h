@@ -6,4 +6,7 @@
 #define EXT_INCLUDE_DEFAULT_MAX_NESTING_DEPTH 10
 #define EXT_INCLUDE_DEFAULT_MAX_INCLUDES      255
 
+#define EXT_INCLUDE_DEFAULT_BINARY_RECHECK_INTERVAL 0
+#define EXT_INCLUDE_BINARY_CACHE_MAX_ENTRIES  1024
+
 #endif
@@ -43,6 +43,7 @@ const struct sieve_command_def cmd_extracttext = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.message_data = SIEVE_COMMAND_MESSAGE_BODY,
 	.registered = cmd_extracttext_registered,
 	.validate = cmd_extracttext_validate,
 	.generate = cmd_extracttext_generate
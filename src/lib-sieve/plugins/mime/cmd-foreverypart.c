@@ -42,6 +42,7 @@ const struct sieve_command_def cmd_foreverypart = {
 	.subtests = 0,
 	.block_allowed = TRUE,
 	.block_required = TRUE,
+	.message_data = SIEVE_COMMAND_MESSAGE_BODY,
 	.registered = cmd_foreverypart_registered,
 	.pre_validate = cmd_foreverypart_pre_validate,
 	.validate = cmd_foreverypart_validate,
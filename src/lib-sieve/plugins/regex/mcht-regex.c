@@ -50,6 +50,7 @@ static void mcht_regex_match_deinit(struct sieve_match_context *mctx);
 
 const struct sieve_match_type_def regex_match_type = {
 	SIEVE_OBJECT("regex", &regex_match_type_operand, 0),
+	.regex_keys = TRUE,
 	.validate_context = mcht_regex_validate_context,
 	.match_init = mcht_regex_match_init,
 	.match_keys = mcht_regex_match_keys,
@@ -351,6 +352,13 @@ static int mcht_regex_match_keys
 		i = 0;
 		match = 0;
 		while ( match == 0 && i < count ) {
+			int ret;
+
+			if ( (ret=sieve_runtime_check_resources(renv)) <= 0 ) {
+				mctx->exec_status = ret;
+				return -1;
+			}
+
 			if ( rkeys[i].status > 0 ) {
 				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
 
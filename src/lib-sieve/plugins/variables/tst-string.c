@@ -28,6 +28,9 @@ static bool tst_string_registered
 		struct sieve_command_registration *cmd_reg);
 static bool tst_string_validate
 	(struct sieve_validator *valdtr, struct sieve_command *tst);
+static bool tst_string_validate_const
+	(struct sieve_validator *valdtr, struct sieve_command *tst,
+		int *const_current, int const_next);
 static bool tst_string_generate
 	(const struct sieve_codegen_env *cgenv, struct sieve_command *ctx);
 
@@ -40,6 +43,7 @@ const struct sieve_command_def tst_string = {
 	.block_required = FALSE,
 	.registered = tst_string_registered,
 	.validate = tst_string_validate,
+	.validate_const = tst_string_validate_const,
 	.generate = tst_string_generate
 };
 
@@ -121,6 +125,118 @@ static bool tst_string_validate
 		(valdtr, tst, arg, &mcht_default, &cmp_default);
 }
 
+static bool tst_string_arg_is_literal
+(struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *stritem;
+
+	switch ( sieve_ast_argument_type(arg) ) {
+	case SAAT_STRING:
+		return ( arg->argument != NULL && sieve_argument_is_string_literal(arg) );
+	case SAAT_STRING_LIST:
+		stritem = sieve_ast_strlist_first(arg);
+		while ( stritem != NULL ) {
+			if ( stritem->argument == NULL ||
+				!sieve_argument_is_string_literal(stritem) )
+				return FALSE;
+			stritem = sieve_ast_strlist_next(stritem);
+		}
+		return TRUE;
+	default:
+		break;
+	}
+	return FALSE;
+}
+
+static bool tst_string_match_is
+(const struct sieve_comparator *cmp, const string_t *value,
+	struct sieve_ast_argument *key_arg)
+{
+	struct sieve_ast_argument *key = key_arg;
+	const string_t *key_str;
+
+	if ( sieve_ast_argument_type(key_arg) == SAAT_STRING_LIST )
+		key = sieve_ast_strlist_first(key_arg);
+
+	/* Mirrors the :is match-type implementation */
+	while ( key != NULL ) {
+		key_str = sieve_ast_argument_str(key);
+
+		if ( str_len(value) == 0 ) {
+			if ( str_len(key_str) == 0 )
+				return TRUE;
+		} else if ( cmp->def->compare(cmp,
+			str_c(value), str_len(value),
+			str_c(key_str), str_len(key_str)) == 0 ) {
+			return TRUE;
+		}
+
+		if ( key == key_arg )
+			break;
+		key = sieve_ast_strlist_next(key);
+	}
+	return FALSE;
+}
+
+static bool tst_string_validate_const
+(struct sieve_validator *valdtr ATTR_UNUSED, struct sieve_command *tst,
+	int *const_current, int const_next ATTR_UNUSED)
+{
+	const struct sieve_comparator cmp_default =
+		SIEVE_COMPARATOR_DEFAULT(i_octet_comparator);
+	struct sieve_ast_argument *arg = sieve_command_first_argument(tst);
+	struct sieve_ast_argument *source, *key_list, *value;
+	const struct sieve_comparator *cmp = NULL;
+	bool match = FALSE;
+
+	*const_current = -1;
+
+	/* Only the :is match type is folded; other match types may produce
+	 * match values.
+	 */
+	while ( arg != NULL && arg != tst->first_positional ) {
+		if ( sieve_argument_is_comparator(arg) )
+			cmp = sieve_comparator_tag_get(arg);
+		else if ( sieve_argument_is_match_type(arg) ) {
+			const struct sieve_match_type_context *mtctx =
+				(const struct sieve_match_type_context *)arg->argument->data;
+
+			if ( mtctx == NULL || mtctx->match_type == NULL ||
+				!sieve_match_type_is(mtctx->match_type, is_match_type) )
+				return TRUE;
+		} else {
+			return TRUE;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+	if ( cmp == NULL )
+		cmp = &cmp_default;
+	if ( cmp->def == NULL || cmp->def->compare == NULL )
+		return TRUE;
+
+	/* Both the source and the key list must be literal strings */
+	source = tst->first_positional;
+	key_list = sieve_ast_argument_next(source);
+	if ( !tst_string_arg_is_literal(source) ||
+		!tst_string_arg_is_literal(key_list) )
+		return TRUE;
+
+	value = source;
+	if ( sieve_ast_argument_type(source) == SAAT_STRING_LIST )
+		value = sieve_ast_strlist_first(source);
+	while ( value != NULL && !match ) {
+		match = tst_string_match_is
+			(cmp, sieve_ast_argument_str(value), key_list);
+
+		if ( value == source )
+			break;
+		value = sieve_ast_strlist_next(value);
+	}
+
+	*const_current = ( match ? 1 : 0 );
+	return TRUE;
+}
+
 /*
  * Test generation
  */
@@ -528,6 +528,50 @@ have_equal_keywords(struct mail *mail, struct mail_keywords *new_kw)
 	return TRUE;
 }
 
+static int
+act_store_save(const struct sieve_action_exec_env *aenv,
+	       struct act_store_transaction *trans,
+	       struct mailbox_transaction_context *mail_trans)
+{
+	const struct sieve_action *action = aenv->action;
+	const struct sieve_execute_env *eenv = aenv->exec_env;
+	struct mail *mail = (action->mail != NULL ?
+			     action->mail : eenv->msgdata->mail);
+	struct mailbox *box = mailbox_transaction_get_mailbox(mail_trans);
+	struct mail_save_context *save_ctx;
+	struct mail_keywords *keywords = NULL;
+	int status = SIEVE_EXEC_OK;
+
+	/* Store the message */
+	save_ctx = mailbox_save_alloc(mail_trans);
+
+	/* Apply keywords and flags that side-effects may have added */
+	if (trans->flags_altered) {
+		keywords = act_store_keywords_create(aenv, &trans->keywords,
+						     box, FALSE);
+
+		if (trans->flags != 0 || keywords != NULL) {
+			eenv->exec_status->significant_action_executed = TRUE;
+			mailbox_save_set_flags(save_ctx, trans->flags, keywords);
+		}
+	} else {
+		mailbox_save_copy_flags(save_ctx, mail);
+	}
+
+	if (mailbox_save_using_mail(&save_ctx, mail) < 0) {
+		sieve_act_store_get_storage_error(aenv, trans);
+		status = (trans->error_code == MAIL_ERROR_TEMP ?
+			  SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
+	} else {
+		eenv->exec_status->significant_action_executed = TRUE;
+	}
+
+	/* Deallocate keywords */
+ 	if (keywords != NULL)
+ 		mailbox_keywords_unref(&keywords);
+	return status;
+}
+
 static int
 act_store_execute(const struct sieve_action_exec_env *aenv, void *tr_context)
 {
@@ -537,11 +581,9 @@ act_store_execute(const struct sieve_action_exec_env *aenv, void *tr_context)
 		(struct act_store_transaction *)tr_context;
 	struct mail *mail = (action->mail != NULL ?
 			     action->mail : eenv->msgdata->mail);
-	struct mail_save_context *save_ctx;
 	struct mail_keywords *keywords = NULL;
 	struct mailbox *box;
 	bool backends_equal = FALSE;
-	int status = SIEVE_EXEC_OK;
 
 	/* Verify transaction */
 	if (trans == NULL)
@@ -631,38 +673,43 @@ act_store_execute(const struct sieve_action_exec_env *aenv, void *tr_context)
 		   SIEVE_SCRIPT_DEFAULT_MAILBOX(eenv->scriptenv)) == 0)
 		eenv->exec_status->tried_default_save = TRUE;
 
+	/* When the caller batches stores, the message is saved upon commit
+	   into a transaction provided by the caller */
+	if (eenv->scriptenv->store_get_transaction != NULL) {
+		trans->batched = TRUE;
+		return SIEVE_EXEC_OK;
+	}
+
 	/* Start mail transaction */
 	trans->mail_trans = mailbox_transaction_begin(
 		box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
 
-	/* Store the message */
-	save_ctx = mailbox_save_alloc(trans->mail_trans);
-
-	/* Apply keywords and flags that side-effects may have added */
-	if (trans->flags_altered) {
-		keywords = act_store_keywords_create(aenv, &trans->keywords,
-						     box, FALSE);
+	return act_store_save(aenv, trans, trans->mail_trans);
+}
 
-		if (trans->flags != 0 || keywords != NULL) {
-			eenv->exec_status->significant_action_executed = TRUE;
-			mailbox_save_set_flags(save_ctx, trans->flags, keywords);
-		}
-	} else {
-		mailbox_save_copy_flags(save_ctx, mail);
+static bool
+act_store_commit_batched(const struct sieve_action_exec_env *aenv,
+			 struct act_store_transaction *trans)
+{
+	const struct sieve_script_env *senv = aenv->exec_env->scriptenv;
+	struct mailbox_transaction_context *mail_trans;
+
+	mail_trans = senv->store_get_transaction(senv, trans->box);
+	if (mail_trans != NULL) {
+		/* Committed later by the caller */
+		trans->pending = TRUE;
+		return (act_store_save(aenv, trans, mail_trans) ==
+			SIEVE_EXEC_OK);
 	}
 
-	if (mailbox_save_using_mail(&save_ctx, mail) < 0) {
-		sieve_act_store_get_storage_error(aenv, trans);
-		status = (trans->error_code == MAIL_ERROR_TEMP ?
-			  SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
-	} else {
-		eenv->exec_status->significant_action_executed = TRUE;
+	/* Caller cannot provide a transaction; store it right away */
+	trans->mail_trans = mailbox_transaction_begin(
+		trans->box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	if (act_store_save(aenv, trans, trans->mail_trans) != SIEVE_EXEC_OK) {
+		mailbox_transaction_rollback(&trans->mail_trans);
+		return FALSE;
 	}
-
-	/* Deallocate keywords */
- 	if (keywords != NULL)
- 		mailbox_keywords_unref(&keywords);
-	return status;
+	return (mailbox_transaction_commit(&trans->mail_trans) == 0);
 }
 
 static void
@@ -728,8 +775,11 @@ act_store_log_status(struct act_store_transaction *trans,
 			sieve_action_create_finish_event(aenv)->
 			add_str("fileinto_mailbox_name", mailbox_name)->
 			add_str("fileinto_mailbox", mailbox_identifier);
+		/* The caller reports when committing its transaction fails */
 		sieve_result_event_log(aenv, e->event(),
-				       "stored mail into mailbox %s",
+				       (trans->pending ?
+					"queued mail for storing into mailbox %s" :
+					"stored mail into mailbox %s"),
 				       mailbox_identifier);
 	}
 }
@@ -769,7 +819,10 @@ act_store_commit(const struct sieve_action_exec_env *aenv, void *tr_context,
 	eenv->exec_status->last_storage = mailbox_get_storage(trans->box);
 
 	/* Commit mailbox transaction */
-	status = (mailbox_transaction_commit(&trans->mail_trans) == 0);
+	if (trans->batched)
+		status = act_store_commit_batched(aenv, trans);
+	else
+		status = (mailbox_transaction_commit(&trans->mail_trans) == 0);
 
 	/* Note the fact that the message was stored at least once */
 	if (status)
@@ -69,6 +69,11 @@ struct sieve_action_def {
 		       void *tr_context);
 	int (*commit)(const struct sieve_action_exec_env *aenv,
 		      void *tr_context, bool *keep);
+	/* Waits for the completion of work that commit() started without
+	   finishing it. Called once all actions are committed, so that such
+	   work can proceed concurrently for several actions. */
+	int (*commit_wait)(const struct sieve_action_exec_env *aenv,
+			   void *tr_context, bool *keep);
 	void (*rollback)(const struct sieve_action_exec_env *aenv,
 			 void *tr_context, bool success);
 	void (*finish)(const struct sieve_action_exec_env *aenv, bool last,
@@ -225,6 +230,9 @@ struct act_store_transaction {
 	bool flags_altered:1;
 	bool disabled:1;
 	bool redundant:1;
+	bool batched:1;
+	/* Saved into a transaction that the caller commits later */
+	bool pending:1;
 };
 
 int sieve_act_store_add_to_result(const struct sieve_runtime_env *renv,
@@ -455,6 +455,12 @@ struct sieve_ast_node *sieve_ast_node_detach
 	return sieve_ast_list_detach(first, 1);
 }
 
+bool sieve_ast_test_append
+(struct sieve_ast_node *node, struct sieve_ast_node *test)
+{
+	return sieve_ast_node_add_test(node, test);
+}
+
 const char *sieve_ast_type_name
 (enum sieve_ast_type ast_type)
 {
@@ -844,7 +850,7 @@ struct sieve_ast_argument *sieve_ast_stringlist_join
 			if ( !_sieve_ast_stringlist_add_item(items, list) )
 				return NULL;
 
-			return list;
+			return items;
 
 		default:
 			i_unreached();
@@ -215,6 +215,8 @@ struct sieve_ast_node *sieve_ast_command_create
 
 struct sieve_ast_node *sieve_ast_node_detach
 	(struct sieve_ast_node *first);
+bool sieve_ast_test_append
+	(struct sieve_ast_node *node, struct sieve_ast_node *test);
 
 const char *sieve_ast_type_name(enum sieve_ast_type ast_type);
 
@@ -139,6 +139,50 @@ bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 	if (!success)
 		return FALSE;
 
+	/* Dump cost estimate */
+
+	T_BEGIN {
+		const struct sieve_binary_cost *cost =
+			sieve_binary_get_cost(sbin);
+
+		sieve_binary_dump_sectionf(denv, "Cost estimate");
+		sieve_binary_dumpf(denv, "tests: %u\n", cost->tests);
+		sieve_binary_dumpf(denv, "keys: %u\n", cost->keys);
+		sieve_binary_dumpf(denv, "regexes: %u\n", cost->regexes);
+		sieve_binary_dumpf(denv, "body tests: %u\n", cost->body_tests);
+		sieve_binary_dumpf(denv, "total: %u\n",
+				   sieve_binary_cost_estimate(cost));
+	} T_END;
+
+	/* Dump message data used by the script */
+
+	T_BEGIN {
+		enum sieve_binary_message_data data;
+		const char *const *headers;
+		unsigned int hdr_count, i;
+		string_t *hdr_list;
+
+		data = sieve_binary_get_message_data(sbin, &headers,
+						     &hdr_count);
+		hdr_list = t_str_new(128);
+		for (i = 0; i < hdr_count; i++) {
+			if (i > 0)
+				str_append(hdr_list, ", ");
+			str_append(hdr_list, headers[i]);
+		}
+
+		sieve_binary_dump_sectionf(denv, "Message data (block: %d)",
+					   SBIN_SYSBLOCK_MESSAGE_DATA);
+		sieve_binary_dumpf(denv, "size: %s\n",
+			((data & SIEVE_BINARY_MESSAGE_DATA_SIZE) != 0 ?
+			 "yes" : "no"));
+		sieve_binary_dumpf(denv, "body: %s\n",
+			((data & SIEVE_BINARY_MESSAGE_DATA_BODY) != 0 ?
+			 "yes" : "no"));
+		sieve_binary_dumpf(denv, "headers: %s\n",
+			(hdr_count == 0 ? "(none)" : str_c(hdr_list)));
+	} T_END;
+
 	/* Dump list of used extensions */
 
 	count = sieve_binary_extensions_count(sbin);
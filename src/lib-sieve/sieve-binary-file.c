@@ -11,8 +11,10 @@
 #include "ostream.h"
 #include "eacces-error.h"
 #include "safe-mkstemp.h"
+#include "md5.h"
 
 #include "sieve-common.h"
+#include "sieve-limits.h"
 #include "sieve-error.h"
 #include "sieve-extensions.h"
 #include "sieve-code.h"
@@ -46,6 +48,12 @@ struct sieve_binary_header {
 	uint16_t version_major;
 	uint16_t version_minor;
 	uint32_t blocks;
+
+	/* Static cost estimate */
+	uint32_t cost_tests;
+	uint32_t cost_keys;
+	uint32_t cost_regexes;
+	uint32_t cost_body_tests;
 };
 
 struct sieve_binary_block_index {
@@ -201,8 +209,9 @@ static bool
 sieve_binary_save_to_stream(struct sieve_binary *sbin, struct ostream *stream)
 {
 	struct sieve_binary_header header;
-	struct sieve_binary_block *ext_block;
-	unsigned int ext_count, blk_count, i;
+	struct sieve_binary_block *ext_block, *msg_block;
+	const char *const *headers;
+	unsigned int ext_count, blk_count, hdr_count, i;
 	uoff_t block_index;
 
 	blk_count = sieve_binary_block_count(sbin);
@@ -213,6 +222,10 @@ sieve_binary_save_to_stream(struct sieve_binary *sbin, struct ostream *stream)
 	header.version_major = SIEVE_BINARY_VERSION_MAJOR;
 	header.version_minor = SIEVE_BINARY_VERSION_MINOR;
 	header.blocks = blk_count;
+	header.cost_tests = sbin->cost.tests;
+	header.cost_keys = sbin->cost.keys;
+	header.cost_regexes = sbin->cost.regexes;
+	header.cost_body_tests = sbin->cost.body_tests;
 
 	if (!_save_aligned(sbin, stream, &header, sizeof(header), NULL)) {
 		e_error(sbin->event, "save: failed to save header");
@@ -247,6 +260,18 @@ sieve_binary_save_to_stream(struct sieve_binary *sbin, struct ostream *stream)
 		sieve_binary_emit_unsigned(ext_block, (*ext)->block_id);
 	}
 
+	/* Create block listing the message data used by the script */
+
+	msg_block = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MESSAGE_DATA);
+	i_assert(msg_block != NULL);
+	sieve_binary_block_clear(msg_block);
+
+	headers = array_get(&sbin->message_headers, &hdr_count);
+	sieve_binary_emit_unsigned(msg_block, sbin->message_data);
+	sieve_binary_emit_unsigned(msg_block, hdr_count);
+	for (i = 0; i < hdr_count; i++)
+		sieve_binary_emit_cstring(msg_block, headers[i]);
+
 	/* Save all blocks into the binary */
 
 	for (i = 0; i < blk_count; i++) {
@@ -278,7 +303,8 @@ sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 		*error_r = SIEVE_ERROR_NONE;
 
 	/* Check whether saving is necessary */
-	if (!update && sbin->path != NULL && strcmp(sbin->path, path) == 0) {
+	if (!update && !sbin->resave &&
+	    sbin->path != NULL && strcmp(sbin->path, path) == 0) {
 		e_debug(sbin->event, "save: "
 			"not saving binary, because it is already stored");
 		return 0;
@@ -362,6 +388,7 @@ sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 				"unlink(%s) failed: %m", str_c(temp_path));
 		}
 	} else {
+		sbin->resave = FALSE;
 		if (sbin->path == NULL)
 			sbin->path = p_strdup(sbin->pool, path);
 
@@ -404,6 +431,282 @@ int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 }
 
 
+/*
+ * Shared binary store
+ */
+
+/* Binaries of global scripts (sieve_before, sieve_after, sieve_global, ...)
+   are opened for every delivery of every user. Their content is kept in
+   memory once per process, addressed by the MD5 digest of the content, so
+   that identical binaries stored at several paths are held only once. Each
+   path entry records the identity of the file it was read from, which is
+   verified against the opened file every time it is used.
+
+   Content that is in use by an open binary is never evicted. Only content
+   that no binary refers to is dropped to make room for new content; when
+   the live content leaves no room, the new binary is not added to the store
+   and it is read from the file as usual. */
+
+struct sieve_binary_shared_data {
+	/* References from path entries and open binaries */
+	int refcount;
+	/* Number of open binaries using this content */
+	unsigned int open_count;
+
+	unsigned char digest[MD5_RESULTLEN];
+	size_t size;
+	unsigned char *data;
+};
+
+struct sieve_binary_shared_file {
+	char *path;
+
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+
+	struct sieve_binary_shared_data *data;
+};
+
+static HASH_TABLE(const char *, struct sieve_binary_shared_file *)
+	sieve_binary_shared_files;
+static ARRAY(struct sieve_binary_shared_data *) sieve_binary_shared_datas;
+/* Size of all content held by the store */
+static size_t sieve_binary_shared_size = 0;
+/* Size of the content currently used by open binaries */
+static size_t sieve_binary_shared_live_size = 0;
+
+static void
+sieve_binary_shared_data_unref(struct sieve_binary_shared_data **_data)
+{
+	struct sieve_binary_shared_data *data = *_data;
+	struct sieve_binary_shared_data *const *datas;
+	unsigned int i, count;
+
+	*_data = NULL;
+
+	i_assert(data->refcount > 0);
+	if (--data->refcount > 0)
+		return;
+
+	datas = array_get(&sieve_binary_shared_datas, &count);
+	for (i = 0; i < count; i++) {
+		if (datas[i] == data) {
+			array_delete(&sieve_binary_shared_datas, i, 1);
+			break;
+		}
+	}
+
+	i_assert(sieve_binary_shared_size >= data->size);
+	sieve_binary_shared_size -= data->size;
+	i_free(data->data);
+	i_free(data);
+}
+
+static void
+sieve_binary_shared_data_open(struct sieve_binary_shared_data *data)
+{
+	if (data->open_count++ == 0)
+		sieve_binary_shared_live_size += data->size;
+	data->refcount++;
+}
+
+static void
+sieve_binary_shared_data_close(struct sieve_binary_shared_data **_data)
+{
+	struct sieve_binary_shared_data *data = *_data;
+
+	i_assert(data->open_count > 0);
+	if (--data->open_count == 0) {
+		i_assert(sieve_binary_shared_live_size >= data->size);
+		sieve_binary_shared_live_size -= data->size;
+	}
+	sieve_binary_shared_data_unref(_data);
+}
+
+static void
+sieve_binary_shared_file_free(struct sieve_binary_shared_file *sfile)
+{
+	sieve_binary_shared_data_unref(&sfile->data);
+	i_free(sfile->path);
+	i_free(sfile);
+}
+
+static void sieve_binary_shared_clear(void)
+{
+	struct hash_iterate_context *iter;
+	const char *path;
+	struct sieve_binary_shared_file *sfile;
+
+	iter = hash_table_iterate_init(sieve_binary_shared_files);
+	while (hash_table_iterate(iter, sieve_binary_shared_files,
+				  &path, &sfile))
+		sieve_binary_shared_file_free(sfile);
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_clear(sieve_binary_shared_files, FALSE);
+}
+
+/* Drops path entries of content that is not used by any open binary until
+   the given amount of new content fits in the store. Returns FALSE when it
+   does not fit even then. */
+static bool sieve_binary_shared_evict(size_t size, size_t max_size)
+{
+	struct hash_iterate_context *iter;
+	const char *path;
+	struct sieve_binary_shared_file *sfile;
+
+	if (sieve_binary_shared_live_size + size > max_size)
+		return FALSE;
+
+	iter = hash_table_iterate_init(sieve_binary_shared_files);
+	while (sieve_binary_shared_size + size > max_size &&
+	       hash_table_iterate(iter, sieve_binary_shared_files,
+				  &path, &sfile)) {
+		if (sfile->data->open_count > 0)
+			continue;
+		hash_table_remove(sieve_binary_shared_files, path);
+		sieve_binary_shared_file_free(sfile);
+	}
+	hash_table_iterate_deinit(&iter);
+
+	return (sieve_binary_shared_size + size <= max_size);
+}
+
+static void sieve_binary_shared_deinit(void)
+{
+	sieve_binary_shared_clear();
+	hash_table_destroy(&sieve_binary_shared_files);
+	array_free(&sieve_binary_shared_datas);
+}
+
+static struct sieve_binary_shared_data *
+sieve_binary_shared_data_get(const unsigned char *content, size_t size,
+			     size_t max_size)
+{
+	struct sieve_binary_shared_data *const *datap, *data;
+	unsigned char digest[MD5_RESULTLEN];
+
+	md5_get_digest(content, size, digest);
+
+	array_foreach(&sieve_binary_shared_datas, datap) {
+		if ((*datap)->size == size &&
+		    memcmp((*datap)->digest, digest, sizeof(digest)) == 0) {
+			(*datap)->refcount++;
+			return *datap;
+		}
+	}
+
+	if (sieve_binary_shared_size + size > max_size &&
+	    !sieve_binary_shared_evict(size, max_size))
+		return NULL;
+
+	data = i_new(struct sieve_binary_shared_data, 1);
+	data->refcount = 1;
+	memcpy(data->digest, digest, sizeof(digest));
+	data->size = size;
+	data->data = i_malloc(size);
+	memcpy(data->data, content, size);
+
+	array_append(&sieve_binary_shared_datas, &data, 1);
+	sieve_binary_shared_size += size;
+	return data;
+}
+
+static bool
+sieve_binary_shared_file_matches(const struct sieve_binary_shared_file *sfile,
+				 const struct stat *st)
+{
+	return (sfile->dev == st->st_dev && sfile->ino == st->st_ino &&
+		sfile->size == st->st_size && sfile->mtime == st->st_mtime);
+}
+
+static bool
+sieve_binary_shared_read(struct sieve_binary_file *file,
+			 unsigned char *content, size_t size)
+{
+	struct sieve_binary *sbin = file->sbin;
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < size) {
+		ret = pread(file->fd, content + pos, size - pos, pos);
+		if (ret <= 0) {
+			if (ret == 0) {
+				e_error(sbin->event, "read: "
+					"binary is truncated "
+					"(more data expected)");
+			} else {
+				e_error(sbin->event, "read: "
+					"failed to read from binary: %m");
+			}
+			return FALSE;
+		}
+		pos += ret;
+	}
+	return TRUE;
+}
+
+/* Returns the shared content for the opened file, reading it into the store
+   when it is not present yet. Returns NULL when the binary is not eligible for
+   the store, when there is no room for it or when reading failed; the caller
+   then falls back to reading the file lazily. */
+static struct sieve_binary_shared_data *
+sieve_binary_shared_get(struct sieve_binary_file *file, size_t max_size)
+{
+	struct sieve_binary_shared_file *sfile;
+	struct sieve_binary_shared_data *data;
+	unsigned char *content;
+	size_t size;
+
+	if (file->st.st_size <= 0 || (uoff_t)file->st.st_size > max_size)
+		return NULL;
+	size = (size_t)file->st.st_size;
+
+	if (!hash_table_is_created(sieve_binary_shared_files)) {
+		hash_table_create(&sieve_binary_shared_files, default_pool, 0,
+				  str_hash, strcmp);
+		i_array_init(&sieve_binary_shared_datas, 32);
+		lib_atexit(sieve_binary_shared_deinit);
+	}
+
+	sfile = hash_table_lookup(sieve_binary_shared_files, file->path);
+	if (sfile != NULL && sieve_binary_shared_file_matches(sfile, &file->st)) {
+		sieve_binary_shared_data_open(sfile->data);
+		return sfile->data;
+	}
+
+	content = i_malloc(size);
+	if (!sieve_binary_shared_read(file, content, size)) {
+		i_free(content);
+		return NULL;
+	}
+
+	if (sfile != NULL) {
+		/* Outdated */
+		hash_table_remove(sieve_binary_shared_files, sfile->path);
+		sieve_binary_shared_file_free(sfile);
+	}
+
+	data = sieve_binary_shared_data_get(content, size, max_size);
+	i_free(content);
+	if (data == NULL)
+		return NULL;
+
+	sfile = i_new(struct sieve_binary_shared_file, 1);
+	sfile->path = i_strdup(file->path);
+	sfile->dev = file->st.st_dev;
+	sfile->ino = file->st.st_ino;
+	sfile->size = file->st.st_size;
+	sfile->mtime = file->st.st_mtime;
+	sfile->data = data;
+	hash_table_insert(sieve_binary_shared_files, sfile->path, sfile);
+
+	sieve_binary_shared_data_open(data);
+	return data;
+}
+
 /*
  * Binary file management
  */
@@ -483,6 +786,8 @@ void sieve_binary_file_close(struct sieve_binary_file **_file)
 				"failed to close: close() failed: %m");
 		}
 	}
+	if (file->shared != NULL)
+		sieve_binary_shared_data_close(&file->shared);
 
 	pool_unref(&file->pool);
 }
@@ -585,6 +890,73 @@ _file_lazy_open(struct sieve_binary *sbin, const char *path,
 	return file;
 }
 
+/* File open from the shared store (all data is already in memory) */
+
+static const void *
+_file_shared_load_data(struct sieve_binary_file *file,
+		       off_t *offset, size_t size)
+{
+	struct sieve_binary_shared_data *data = file->shared;
+	const void *ptr;
+
+	*offset = SIEVE_BINARY_ALIGN(*offset);
+
+	if ((uoff_t)*offset > data->size || size > data->size - *offset) {
+		e_error(file->sbin->event, "read: "
+			"binary is truncated (more data expected)");
+		return NULL;
+	}
+
+	ptr = CONST_PTR_OFFSET(data->data, *offset);
+	*offset += size;
+	return ptr;
+}
+
+static buffer_t *
+_file_shared_load_buffer(struct sieve_binary_file *file,
+			 off_t *offset, size_t size)
+{
+	const void *data;
+	buffer_t *buffer;
+
+	data = _file_shared_load_data(file, offset, size);
+	if (data == NULL)
+		return NULL;
+
+	/* Blocks may be modified when the binary is updated, so they are not
+	   allowed to refer to the shared content directly */
+	buffer = buffer_create_dynamic(file->pool, size);
+	buffer_append(buffer, data, size);
+	return buffer;
+}
+
+static struct sieve_binary_file *
+_file_shared_open(struct sieve_binary *sbin, const char *path,
+		  enum sieve_error *error_r)
+{
+	struct sieve_binary_file *file;
+
+	if ((file = _file_lazy_open(sbin, path, error_r)) == NULL)
+		return NULL;
+
+	file->shared = sieve_binary_shared_get(
+		file, sbin->svinst->shared_binary_cache_size);
+	if (file->shared == NULL) {
+		/* Not eligible; continue reading lazily */
+		return file;
+	}
+
+	if (close(file->fd) < 0) {
+		e_error(sbin->event, "close: "
+			"failed to close: close() failed: %m");
+	}
+	file->fd = -1;
+
+	file->load_data = _file_shared_load_data;
+	file->load_buffer = _file_shared_load_buffer;
+	return file;
+}
+
 /*
  * Load binary from a file
  */
@@ -706,12 +1078,32 @@ static int _read_extensions(struct sieve_binary_block *sblock)
 	return result;
 }
 
+static bool _read_message_data(struct sieve_binary_block *sblock)
+{
+	struct sieve_binary *sbin = sblock->sbin;
+	sieve_size_t offset = 0;
+	unsigned int data, i, count;
+	string_t *name;
+
+	if (!sieve_binary_read_unsigned(sblock, &offset, &data) ||
+	    !sieve_binary_read_unsigned(sblock, &offset, &count))
+		return FALSE;
+
+	sbin->message_data = data;
+	for (i = 0; i < count; i++) {
+		if (!sieve_binary_read_string(sblock, &offset, &name))
+			return FALSE;
+		sieve_binary_add_message_header(sbin, str_c(name));
+	}
+	return TRUE;
+}
+
 static bool _sieve_binary_open(struct sieve_binary *sbin)
 {
 	bool result = TRUE;
 	off_t offset = 0;
 	const struct sieve_binary_header *header;
-	struct sieve_binary_block *ext_block;
+	struct sieve_binary_block *ext_block, *msg_block;
 	unsigned int i, blk_count;
 	int ret;
 
@@ -757,6 +1149,11 @@ static bool _sieve_binary_open(struct sieve_binary *sbin)
 		/* Valid */
 		} else {
 			blk_count = header->blocks;
+
+			sbin->cost.tests = header->cost_tests;
+			sbin->cost.keys = header->cost_keys;
+			sbin->cost.regexes = header->cost_regexes;
+			sbin->cost.body_tests = header->cost_body_tests;
 		}
 	} T_END;
 
@@ -791,6 +1188,21 @@ static bool _sieve_binary_open(struct sieve_binary *sbin)
 		}
 	} T_END;
 
+	if (!result)
+		return FALSE;
+
+	/* Load the list of message data used by the script */
+
+	T_BEGIN {
+		msg_block = sieve_binary_block_get(
+			sbin, SBIN_SYSBLOCK_MESSAGE_DATA);
+		if (msg_block == NULL || !_read_message_data(msg_block)) {
+			e_error(sbin->event, "open: binary is corrupt: "
+				"failed to load message data block");
+			result = FALSE;
+		}
+	} T_END;
+
 	return result;
 }
 
@@ -809,7 +1221,12 @@ sieve_binary_open(struct sieve_instance *svinst, const char *path,
 	sbin = sieve_binary_create(svinst, script);
 	sbin->path = p_strdup(sbin->pool, path);
 
-	if ((file = _file_lazy_open(sbin, path, error_r)) == NULL) {
+	if (script != NULL && sieve_script_is_global(script) &&
+	    svinst->shared_binary_cache_size > 0)
+		file = _file_shared_open(sbin, path, error_r);
+	else
+		file = _file_lazy_open(sbin, path, error_r);
+	if (file == NULL) {
 		sieve_binary_unref(&sbin);
 		return NULL;
 	}
@@ -20,6 +20,9 @@ struct sieve_binary_file {
 	int fd;
 	off_t offset;
 
+	/* Binary content held in the shared per-process store */
+	struct sieve_binary_shared_data *shared;
+
 	const void *(*load_data)(struct sieve_binary_file *file,
 				 off_t *offset, size_t size);
 	buffer_t *(*load_buffer)(struct sieve_binary_file *file,
@@ -101,8 +104,18 @@ struct sieve_binary {
 	/* Attributes of a loaded binary */
 	const char *path;
 
+	/* Static cost estimate */
+	struct sieve_binary_cost cost;
+
+	/* Message data used by the script */
+	enum sieve_binary_message_data message_data;
+	ARRAY_TYPE(const_string) message_headers;
+
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
+
+	/* Loaded binary is still valid, but its stored metadata is outdated */
+	bool resave:1;
 };
 
 void sieve_binary_update_event(struct sieve_binary *sbin, const char *new_path)
@@ -12,6 +12,7 @@
 #include "eacces-error.h"
 #include "safe-mkstemp.h"
 
+#include "sieve-limits.h"
 #include "sieve-error.h"
 #include "sieve-extensions.h"
 #include "sieve-code.h"
@@ -82,6 +83,7 @@ sieve_binary_create(struct sieve_instance *svinst, struct sieve_script *script)
 	p_array_init(&sbin->extension_index, pool, ext_count);
 
 	p_array_init(&sbin->blocks, pool, 16);
+	p_array_init(&sbin->message_headers, pool, 8);
 
 	/* Pre-load core language features implemented as 'extensions' */
 	ext_preloaded = sieve_extensions_get_preloaded(svinst, &ext_count);
@@ -187,6 +189,11 @@ bool sieve_binary_loaded(struct sieve_binary *sbin)
 	return (sbin->file != NULL);
 }
 
+void sieve_binary_set_resave(struct sieve_binary *sbin)
+{
+	sbin->resave = TRUE;
+}
+
 const char *sieve_binary_source(struct sieve_binary *sbin)
 {
 	if (sbin->script != NULL && (sbin->path == NULL || sbin->file == NULL))
@@ -224,6 +231,69 @@ const char *sieve_binary_script_location(struct sieve_binary *sbin)
 		NULL : sieve_script_location(sbin->script));
 }
 
+/*
+ * Static cost estimate
+ */
+
+void sieve_binary_cost_add(struct sieve_binary *sbin,
+			   const struct sieve_binary_cost *cost)
+{
+	sbin->cost.tests += cost->tests;
+	sbin->cost.keys += cost->keys;
+	sbin->cost.regexes += cost->regexes;
+	sbin->cost.body_tests += cost->body_tests;
+}
+
+const struct sieve_binary_cost *
+sieve_binary_get_cost(struct sieve_binary *sbin)
+{
+	return &sbin->cost;
+}
+
+unsigned int sieve_binary_cost_estimate(const struct sieve_binary_cost *cost)
+{
+	uint64_t estimate;
+
+	estimate = (uint64_t)cost->tests * SIEVE_COST_TEST +
+		(uint64_t)cost->keys * SIEVE_COST_KEY +
+		(uint64_t)cost->regexes * SIEVE_COST_REGEX +
+		(uint64_t)cost->body_tests * SIEVE_COST_BODY;
+	return (estimate > UINT_MAX ? UINT_MAX : (unsigned int)estimate);
+}
+
+/*
+ * Message data used by the script
+ */
+
+void sieve_binary_add_message_data(struct sieve_binary *sbin,
+				   enum sieve_binary_message_data data)
+{
+	sbin->message_data |= data;
+}
+
+void sieve_binary_add_message_header(struct sieve_binary *sbin,
+				     const char *field_name)
+{
+	const char *const *namep;
+
+	array_foreach(&sbin->message_headers, namep) {
+		if (strcasecmp(*namep, field_name) == 0)
+			return;
+	}
+
+	field_name = p_strdup(sbin->pool, field_name);
+	array_append(&sbin->message_headers, &field_name, 1);
+}
+
+enum sieve_binary_message_data
+sieve_binary_get_message_data(struct sieve_binary *sbin,
+			      const char *const **headers_r,
+			      unsigned int *count_r)
+{
+	*headers_r = array_get(&sbin->message_headers, count_r);
+	return sbin->message_data;
+}
+
 /*
  * Utility
  */
@@ -10,7 +10,7 @@
  */
 
 #define SIEVE_BINARY_VERSION_MAJOR     1
-#define SIEVE_BINARY_VERSION_MINOR     4
+#define SIEVE_BINARY_VERSION_MINOR     7
 
 /*
  * Binary object
@@ -41,6 +41,58 @@ const char *sieve_binary_source(struct sieve_binary *sbin);
 bool sieve_binary_loaded(struct sieve_binary *sbin);
 bool sieve_binary_saved(struct sieve_binary *sbin);
 
+/* Make the next save rewrite the loaded binary, even when it is not
+   updated explicitly */
+void sieve_binary_set_resave(struct sieve_binary *sbin);
+
+/*
+ * Static cost estimate
+ */
+
+struct sieve_binary_cost {
+	/* Number of tests */
+	unsigned int tests;
+	/* Number of keys in the key lists of match tests and commands */
+	unsigned int keys;
+	/* Number of keys matched as regular expressions */
+	unsigned int regexes;
+	/* Number of commands that need to extract message body content */
+	unsigned int body_tests;
+};
+
+void sieve_binary_cost_add(struct sieve_binary *sbin,
+			   const struct sieve_binary_cost *cost);
+const struct sieve_binary_cost *
+sieve_binary_get_cost(struct sieve_binary *sbin);
+
+unsigned int sieve_binary_cost_estimate(const struct sieve_binary_cost *cost);
+
+/*
+ * Message data used by the script
+ */
+
+enum sieve_binary_message_data {
+	/* The size of the message */
+	SIEVE_BINARY_MESSAGE_DATA_SIZE = BIT(0),
+	/* The message body */
+	SIEVE_BINARY_MESSAGE_DATA_BODY = BIT(1),
+};
+
+/* Recorded by the generator for the commands it encounters (included
+   scripts add to it) */
+void sieve_binary_add_message_data(struct sieve_binary *sbin,
+				   enum sieve_binary_message_data data);
+void sieve_binary_add_message_header(struct sieve_binary *sbin,
+				     const char *field_name);
+
+/* Returns the message data the script uses. The names of the header fields
+   it is known to read are returned in headers_r. Names that are only known
+   at runtime are not included. */
+enum sieve_binary_message_data
+sieve_binary_get_message_data(struct sieve_binary *sbin,
+			      const char *const **headers_r,
+			      unsigned int *count_r);
+
 /*
  * Utility
  */
@@ -78,6 +130,7 @@ enum sieve_binary_system_block {
 	SBIN_SYSBLOCK_SCRIPT_DATA,
 	SBIN_SYSBLOCK_EXTENSIONS,
 	SBIN_SYSBLOCK_MAIN_PROGRAM,
+	SBIN_SYSBLOCK_MESSAGE_DATA,
 	SBIN_SYSBLOCK_LAST
 };
 
@@ -120,6 +120,17 @@ enum sieve_command_type {
 	SCT_HYBRID
 };
 
+/* Message data accessed by a command. The generator records this in the
+   binary, so that the data can be prefetched before the script runs. */
+enum sieve_command_message_data {
+	/* The first positional argument lists header field names */
+	SIEVE_COMMAND_MESSAGE_HEADERS = BIT(0),
+	/* The message size is read */
+	SIEVE_COMMAND_MESSAGE_SIZE = BIT(1),
+	/* The message body is parsed */
+	SIEVE_COMMAND_MESSAGE_BODY = BIT(2),
+};
+
 struct sieve_command_def {
 	const char *identifier;
 	enum sieve_command_type type;
@@ -130,6 +141,8 @@ struct sieve_command_def {
 	bool block_allowed;
 	bool block_required;
 
+	enum sieve_command_message_data message_data;
+
 	bool (*registered)
 		(struct sieve_validator *valdtr, const struct sieve_extension *ext,
 			struct sieve_command_registration *cmd_reg);
@@ -164,6 +177,11 @@ struct sieve_command {
 	/* First positional argument, found during argument validation */
 	struct sieve_ast_argument *first_positional;
 
+	/* Key list and match type of a match test, found during match type
+	   validation (used for the cost estimate) */
+	struct sieve_ast_argument *key_list;
+	const struct sieve_match_type *match_type;
+
 	/* The child ast node that unconditionally exits this command's block */
 	struct sieve_command *block_exit_command;
 
@@ -207,6 +207,14 @@ struct sieve_instance {
 	const struct smtp_address *user_email, *user_email_implicit;
 	struct sieve_address_source redirect_from;
 	unsigned int redirect_duplicate_period;
+	bool runtime_profile;
+	unsigned int max_operations;
+	unsigned int max_cpu_time;
+	unsigned int max_real_time;
+	bool resource_limit_keep;
+	unsigned int max_script_cost;
+	unsigned int script_cost_warning;
+	size_t shared_binary_cache_size;
 };
 
 /*
@@ -10,6 +10,7 @@
 #include "sieve-commands.h"
 #include "sieve-code.h"
 #include "sieve-binary.h"
+#include "sieve-match-types.h"
 
 #include "sieve-generator.h"
 
@@ -332,6 +333,42 @@ bool sieve_generate_argument_parameters(const struct sieve_codegen_env *cgenv,
 	return TRUE;
 }
 
+/* Records the message data used by the command in the binary */
+static void
+sieve_generate_message_data(const struct sieve_codegen_env *cgenv,
+			    struct sieve_command *cmd)
+{
+	enum sieve_command_message_data data = cmd->def->message_data;
+	struct sieve_ast_argument *arg = cmd->first_positional, *item;
+
+	if ((data & SIEVE_COMMAND_MESSAGE_SIZE) != 0) {
+		sieve_binary_add_message_data(cgenv->sbin,
+					      SIEVE_BINARY_MESSAGE_DATA_SIZE);
+	}
+	if ((data & SIEVE_COMMAND_MESSAGE_BODY) != 0) {
+		sieve_binary_add_message_data(cgenv->sbin,
+					      SIEVE_BINARY_MESSAGE_DATA_BODY);
+	}
+	if ((data & SIEVE_COMMAND_MESSAGE_HEADERS) == 0 || arg == NULL)
+		return;
+
+	if (sieve_ast_argument_type(arg) == SAAT_STRING_LIST)
+		item = sieve_ast_strlist_first(arg);
+	else
+		item = arg;
+	for (; item != NULL; item = sieve_ast_strlist_next(item)) {
+		/* Names built from variables are only known at runtime */
+		if (item->argument != NULL &&
+		    sieve_argument_is_string_literal(item) &&
+		    *sieve_ast_argument_strc(item) != '\0') {
+			sieve_binary_add_message_header(
+				cgenv->sbin, sieve_ast_argument_strc(item));
+		}
+		if (item == arg)
+			break;
+	}
+}
+
 bool sieve_generate_test(const struct sieve_codegen_env *cgenv,
 			 struct sieve_ast_node *tst_node,
 			 struct sieve_jumplist *jlist, bool jump_true)
@@ -344,6 +381,8 @@ bool sieve_generate_test(const struct sieve_codegen_env *cgenv,
 	test = tst_node->command;
 	tst_def = test->def;
 
+	sieve_generate_message_data(cgenv, test);
+
 	if (tst_def->control_generate != NULL) {
 		sieve_generate_debug_from_ast_node(cgenv, tst_node);
 
@@ -389,6 +428,8 @@ sieve_generate_command(const struct sieve_codegen_env *cgenv,
 	command = cmd_node->command;
 	cmd_def = command->def;
 
+	sieve_generate_message_data(cgenv, command);
+
 	if (cmd_def->generate != NULL) {
 		sieve_generate_debug_from_ast_node(cgenv, cmd_node);
 
@@ -415,6 +456,62 @@ bool sieve_generate_block(const struct sieve_codegen_env *cgenv,
 	return result;
 }
 
+/*
+ * Cost estimate
+ */
+
+static unsigned int
+sieve_generator_cost_count_keys(struct sieve_ast_argument *arg)
+{
+	if (arg == NULL)
+		return 0;
+
+	switch (sieve_ast_argument_type(arg)) {
+	case SAAT_STRING:
+		return 1;
+	case SAAT_STRING_LIST:
+		return sieve_ast_strlist_count(arg);
+	default:
+		break;
+	}
+	return 0;
+}
+
+static void
+sieve_generator_cost_estimate(struct sieve_ast_node *node,
+			      struct sieve_binary_cost *cost)
+{
+	struct sieve_command *cmd = node->command;
+	struct sieve_ast_node *child;
+
+	if (node->type == SAT_TEST)
+		cost->tests++;
+
+	if (cmd != NULL && cmd->def != NULL) {
+		const struct sieve_match_type *mcht = cmd->match_type;
+		unsigned int keys;
+
+		if ((cmd->def->message_data & SIEVE_COMMAND_MESSAGE_BODY) != 0)
+			cost->body_tests++;
+
+		keys = sieve_generator_cost_count_keys(cmd->key_list);
+		cost->keys += keys;
+		if (mcht != NULL && mcht->def != NULL && mcht->def->regex_keys)
+			cost->regexes += keys;
+	}
+
+	if (node->tests != NULL) {
+		child = sieve_ast_test_first(node);
+		for (; child != NULL; child = sieve_ast_test_next(child))
+			sieve_generator_cost_estimate(child, cost);
+	}
+	if (node->commands != NULL) {
+		child = sieve_ast_command_first(node);
+		for (; child != NULL; child = sieve_ast_command_next(child))
+			sieve_generator_cost_estimate(child, cost);
+	}
+}
+
 struct sieve_binary *
 sieve_generator_run(struct sieve_generator *gentr,
 		    struct sieve_binary_block **sblock_r)
@@ -474,6 +571,17 @@ sieve_generator_run(struct sieve_generator *gentr,
 			result = FALSE;
 	}
 
+	/* Estimate execution cost */
+
+	if (result) {
+		struct sieve_binary_cost cost;
+
+		i_zero(&cost);
+		sieve_generator_cost_estimate(
+			sieve_ast_root(gentr->genenv.ast), &cost);
+		sieve_binary_cost_add(sbin, &cost);
+	}
+
 	/* Generate code */
 
 	if (result) {
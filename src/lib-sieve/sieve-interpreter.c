@@ -22,6 +22,7 @@
 #include "sieve-result.h"
 #include "sieve-comparators.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-runtime-profile.h"
 
 #include "sieve-interpreter.h"
 
@@ -58,6 +59,27 @@ struct sieve_interpreter_loop {
 	void *context;
 };
 
+/*
+ * Resource usage
+ */
+
+/* Number of operations or match iterations between CPU time checks */
+#define SIEVE_RESOURCE_CHECK_INTERVAL 256
+
+struct sieve_interpreter_resources {
+	unsigned int max_operations;
+	uint64_t max_cpu_nsecs;
+	uint64_t max_real_nsecs;
+
+	unsigned int operations;
+	unsigned int checks;
+	uint64_t cpu_start_nsecs;
+	uint64_t real_start_nsecs;
+
+	/* Execution status once a limit is exceeded */
+	int status;
+};
+
 /*
  * Interpreter
  */
@@ -83,6 +105,14 @@ struct sieve_interpreter {
 	struct sieve_runtime_env runenv;
 	struct sieve_runtime_trace trace;
 
+	/* Runtime profile */
+	struct sieve_runtime_profile *profile;
+	/* Time spent in nested interpreters (e.g. include) */
+	uint64_t child_nsecs, child_cpu_nsecs;
+
+	/* Resource limits (shared with parent interpreter) */
+	struct sieve_interpreter_resources *resources;
+
 	/* Current operation */
 	struct sieve_operation oprtn;
 
@@ -137,6 +167,8 @@ _sieve_interpreter_create(struct sieve_binary *sbin,
 		      sieve_binary_script_location(sbin));
 	event_add_str(interp->runenv.event, "binary_path",
 		      sieve_binary_path(sbin));
+	event_add_int(interp->runenv.event, "script_cost",
+		      sieve_binary_cost_estimate(sieve_binary_get_cost(sbin)));
 
 	svinst = sieve_binary_svinst(sbin);
 
@@ -147,6 +179,23 @@ _sieve_interpreter_create(struct sieve_binary *sbin,
 		interp->runenv.trace = &interp->trace;
 	}
 
+	if (svinst->runtime_profile || senv->profile != NULL)
+		interp->profile = sieve_runtime_profile_create();
+
+	if (parent != NULL)
+		interp->resources = parent->resources;
+	else if (svinst->max_operations > 0 || svinst->max_cpu_time > 0 ||
+		 svinst->max_real_time > 0) {
+		interp->resources = p_new(pool,
+			struct sieve_interpreter_resources, 1);
+		interp->resources->max_operations = svinst->max_operations;
+		interp->resources->max_cpu_nsecs =
+			(uint64_t)svinst->max_cpu_time * 1000000000ULL;
+		interp->resources->max_real_nsecs =
+			(uint64_t)svinst->max_real_time * 1000000000ULL;
+		interp->resources->status = SIEVE_EXEC_OK;
+	}
+
 	if (script == NULL)
 		interp->runenv.script = sieve_binary_script(sbin);
 	else
@@ -319,6 +368,7 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 		}
 	}
 
+	sieve_runtime_profile_free(&interp->profile);
 	sieve_binary_debug_reader_deinit(&interp->dreader);
 	sieve_binary_unref(&renv->sbin);
 	sieve_error_handler_unref(&renv->ehandler);
@@ -874,16 +924,134 @@ bool sieve_interpreter_get_test_result(struct sieve_interpreter *interp)
 	return interp->test_result;
 }
 
+/*
+ * Resource limits
+ */
+
+static int
+sieve_interpreter_resources_exceeded(struct sieve_interpreter *interp,
+				     const char *limit)
+{
+	struct sieve_interpreter_resources *res = interp->resources;
+	struct sieve_instance *svinst = interp->runenv.exec_env->svinst;
+
+	if (res->status != SIEVE_EXEC_OK)
+		return res->status;
+
+	sieve_runtime_error(&interp->runenv, NULL,
+			    "execution exceeded the %s", limit);
+	res->status = (svinst->resource_limit_keep ?
+		       SIEVE_EXEC_FAILURE : SIEVE_EXEC_TEMP_FAILURE);
+	return res->status;
+}
+
+static int sieve_interpreter_resources_check(struct sieve_interpreter *interp)
+{
+	struct sieve_interpreter_resources *res = interp->resources;
+	uint64_t cpu_nsecs, real_nsecs;
+
+	res->checks = 0;
+	if (res->max_cpu_nsecs > 0) {
+		cpu_nsecs = sieve_runtime_profile_clock(
+			CLOCK_PROCESS_CPUTIME_ID);
+		if (cpu_nsecs > res->cpu_start_nsecs &&
+		    (cpu_nsecs - res->cpu_start_nsecs) > res->max_cpu_nsecs) {
+			return sieve_interpreter_resources_exceeded(interp,
+				t_strdup_printf("CPU time limit (%llu seconds)",
+					(unsigned long long)
+					(res->max_cpu_nsecs / 1000000000ULL)));
+		}
+	}
+	if (res->max_real_nsecs > 0) {
+		real_nsecs = sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+		if (real_nsecs > res->real_start_nsecs &&
+		    (real_nsecs - res->real_start_nsecs) > res->max_real_nsecs) {
+			return sieve_interpreter_resources_exceeded(interp,
+				t_strdup_printf("time limit (%llu seconds)",
+					(unsigned long long)
+					(res->max_real_nsecs / 1000000000ULL)));
+		}
+	}
+	return SIEVE_EXEC_OK;
+}
+
+static inline int
+sieve_interpreter_resources_count_operation(struct sieve_interpreter *interp)
+{
+	struct sieve_interpreter_resources *res = interp->resources;
+
+	if (res->status != SIEVE_EXEC_OK)
+		return res->status;
+	if (res->max_operations > 0 &&
+	    ++res->operations > res->max_operations) {
+		return sieve_interpreter_resources_exceeded(interp,
+			t_strdup_printf("operation limit (%u operations)",
+					res->max_operations));
+	}
+	if (++res->checks >= SIEVE_RESOURCE_CHECK_INTERVAL)
+		return sieve_interpreter_resources_check(interp);
+	return SIEVE_EXEC_OK;
+}
+
+int sieve_runtime_check_resources(const struct sieve_runtime_env *renv)
+{
+	struct sieve_interpreter *interp = renv->interp;
+	struct sieve_interpreter_resources *res = interp->resources;
+
+	if (res == NULL)
+		return SIEVE_EXEC_OK;
+	if (res->status != SIEVE_EXEC_OK)
+		return res->status;
+	if (++res->checks >= SIEVE_RESOURCE_CHECK_INTERVAL)
+		return sieve_interpreter_resources_check(interp);
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Code execute
  */
 
-static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
+static void
+sieve_interpreter_profile_operation(struct sieve_interpreter *interp,
+				    uint64_t start_nsecs,
+				    uint64_t child_start_nsecs)
+{
+	const struct sieve_runtime_env *renv = &interp->runenv;
+	uint64_t end_nsecs = sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+	uint64_t nsecs, child_nsecs;
+	const char *script_name;
+
+	script_name = (renv->script != NULL ?
+		       sieve_script_name(renv->script) :
+		       sieve_binary_path(renv->sbin));
+
+	/* Elapsed time is exclusive: the time spent in nested interpreters
+	   (e.g. include) is recorded by their own profile, which is merged
+	   into the script environment's profile separately. */
+	nsecs = (end_nsecs > start_nsecs ? end_nsecs - start_nsecs : 0);
+	child_nsecs = interp->child_nsecs - child_start_nsecs;
+	nsecs = (nsecs > child_nsecs ? nsecs - child_nsecs : 0);
+
+	sieve_runtime_profile_add(interp->profile, script_name, &interp->oprtn,
+				  sieve_runtime_get_command_location(renv),
+				  nsecs);
+}
+
+static inline int
+sieve_interpreter_operation_execute(struct sieve_interpreter *interp,
+				    const bool instrumented)
 {
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
-
-	sieve_runtime_trace_toplevel(&interp->runenv);
+	bool profile = (instrumented && interp->profile != NULL);
+	uint64_t start_nsecs = 0, child_start_nsecs = 0;
+
+	if (instrumented)
+		sieve_runtime_trace_toplevel(&interp->runenv);
+	if (profile) {
+		start_nsecs = sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+		child_start_nsecs = interp->child_nsecs;
+	}
 
 	/* Read the operation */
 	if (sieve_operation_read(interp->runenv.sblock, address, oprtn)) {
@@ -899,45 +1067,146 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 				result = op->execute(&(interp->runenv),
 						     address);
 			} T_END;
-		} else {
+		} else if (instrumented) {
 			sieve_runtime_trace(&interp->runenv,
 					    SIEVE_TRLVL_COMMANDS,
 					    "OP: %s (NOOP)",
 					    sieve_operation_mnemonic(oprtn));
 		}
 
+		if (profile)
+			sieve_interpreter_profile_operation(
+				interp, start_nsecs, child_start_nsecs);
 		return result;
 	}
 
 	/* Binary corrupt */
-	sieve_runtime_trace_error(&interp->runenv,
-				  "Encountered invalid operation");
+	if (instrumented) {
+		sieve_runtime_trace_error(&interp->runenv,
+					  "Encountered invalid operation");
+	}
 	return SIEVE_EXEC_BIN_CORRUPT;
 }
 
-int sieve_interpreter_continue(struct sieve_interpreter *interp,
-			       bool *interrupted)
+static inline int
+sieve_interpreter_execute_loop(struct sieve_interpreter *interp,
+			       const bool instrumented)
 {
 	const struct sieve_runtime_env *renv = &interp->runenv;
 	sieve_size_t *address = &(interp->runenv.pc);
+	sieve_size_t code_size = sieve_binary_block_get_size(renv->sblock);
 	int ret = SIEVE_EXEC_OK;
 
+	while (ret == SIEVE_EXEC_OK && !interp->interrupted &&
+	       *address < code_size) {
+		if (interp->loop_limit != 0 && *address > interp->loop_limit) {
+			if (instrumented) {
+				sieve_runtime_trace_error(
+					renv, "program crossed loop boundary");
+			}
+			ret = SIEVE_EXEC_BIN_CORRUPT;
+			break;
+		}
+
+		ret = sieve_interpreter_operation_execute(interp, instrumented);
+
+		if (interp->resources != NULL && ret == SIEVE_EXEC_OK)
+			ret = sieve_interpreter_resources_count_operation(interp);
+	}
+	return ret;
+}
+
+/* The code loop is instantiated twice: once with tracing and profiling
+   compiled in and once without. Normal deliveries have neither a trace log
+   nor a profile and thus never pay for checking these for each executed
+   operation. */
+
+static int
+sieve_interpreter_execute_instrumented(struct sieve_interpreter *interp)
+{
+	return sieve_interpreter_execute_loop(interp, TRUE);
+}
+
+static int sieve_interpreter_execute_fast(struct sieve_interpreter *interp)
+{
+	return sieve_interpreter_execute_loop(interp, FALSE);
+}
+
+static void
+sieve_interpreter_profile_finish(struct sieve_interpreter *interp,
+				 struct event_passthrough *e)
+{
+	const struct sieve_script_env *senv = interp->runenv.exec_env->scriptenv;
+	struct sieve_runtime_profile_totals totals;
+	const char *script_name;
+	unsigned int line;
+	uint64_t nsecs;
+
+	sieve_runtime_profile_get_totals(interp->profile, &totals);
+	e->add_int("operations", totals.operations);
+	e->add_int("running_nsecs", totals.nsecs);
+	e->add_int("cpu_nsecs", totals.cpu_nsecs);
+	if (sieve_runtime_profile_get_hottest_line(interp->profile,
+						   &script_name, &line,
+						   &nsecs)) {
+		e->add_int("hottest_line", line);
+		e->add_int("hottest_line_nsecs", nsecs);
+	}
+
+	if (senv->profile != NULL)
+		sieve_runtime_profile_merge(senv->profile, interp->profile);
+}
+
+int sieve_interpreter_continue(struct sieve_interpreter *interp,
+			       bool *interrupted)
+{
+	const struct sieve_runtime_env *renv = &interp->runenv;
+	uint64_t start_nsecs = 0, cpu_start_nsecs = 0, child_cpu_start_nsecs = 0;
+	int ret;
+
 	sieve_result_ref(renv->result);
 	interp->interrupted = FALSE;
 
 	if (interrupted != NULL)
 		*interrupted = FALSE;
 
-	while (ret == SIEVE_EXEC_OK && !interp->interrupted &&
-	       *address < sieve_binary_block_get_size(renv->sblock)) {
-		if (interp->loop_limit != 0 && *address > interp->loop_limit) {
-			sieve_runtime_trace_error(
-				renv, "program crossed loop boundary");
-			ret = SIEVE_EXEC_BIN_CORRUPT;
-			break;
+	if (interp->profile != NULL) {
+		start_nsecs = sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+		cpu_start_nsecs =
+			sieve_runtime_profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+		child_cpu_start_nsecs = interp->child_cpu_nsecs;
+	}
+
+	if (renv->trace == NULL && interp->profile == NULL)
+		ret = sieve_interpreter_execute_fast(interp);
+	else
+		ret = sieve_interpreter_execute_instrumented(interp);
+
+	if (interp->profile != NULL) {
+		uint64_t end_nsecs =
+			sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+		uint64_t cpu_end_nsecs =
+			sieve_runtime_profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+		uint64_t cpu_nsecs, child_cpu_nsecs;
+
+		cpu_nsecs = (cpu_end_nsecs > cpu_start_nsecs ?
+			     cpu_end_nsecs - cpu_start_nsecs : 0);
+
+		/* Report the time spent here to the parent, so that it is not
+		   counted twice once both profiles are merged */
+		if (interp->parent != NULL) {
+			interp->parent->child_nsecs +=
+				(end_nsecs > start_nsecs ?
+				 end_nsecs - start_nsecs : 0);
+			interp->parent->child_cpu_nsecs += cpu_nsecs;
 		}
 
-		ret = sieve_interpreter_operation_execute(interp);
+		child_cpu_nsecs = interp->child_cpu_nsecs -
+			child_cpu_start_nsecs;
+		if (cpu_nsecs > child_cpu_nsecs) {
+			sieve_runtime_profile_add_cpu_time(
+				interp->profile, cpu_nsecs - child_cpu_nsecs);
+		}
 	}
 
 	if (ret != SIEVE_EXEC_OK) {
@@ -968,6 +1237,8 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 			/* Not supposed to occur at runtime */
 			i_unreached();
 		}
+		if (interp->profile != NULL)
+			sieve_interpreter_profile_finish(interp, e);
 		e_debug(e->event(), "Finished running script `%s'",
 			sieve_binary_source(interp->runenv.sbin));
 
@@ -993,6 +1264,14 @@ int sieve_interpreter_start(struct sieve_interpreter *interp,
 
 	interp->running = TRUE;
 	interp->runenv.result = result;
+
+	if (interp->resources != NULL &&
+	    interp->resources->cpu_start_nsecs == 0) {
+		interp->resources->cpu_start_nsecs =
+			sieve_runtime_profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+		interp->resources->real_start_nsecs =
+			sieve_runtime_profile_clock(CLOCK_MONOTONIC);
+	}
 	interp->runenv.msgctx = sieve_result_get_message_context(result);
 
 	/* Signal registered extensions that the interpreter is being run */
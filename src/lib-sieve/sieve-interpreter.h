@@ -106,6 +106,14 @@ void sieve_interpreter_set_test_result(struct sieve_interpreter *interp,
 				       bool result);
 bool sieve_interpreter_get_test_result(struct sieve_interpreter *interp);
 
+/*
+ * Resource limits
+ */
+
+/* Checks the configured execution limits from within long-running loops (e.g.
+   matching). Returns SIEVE_EXEC_OK when execution may continue. */
+int sieve_runtime_check_resources(const struct sieve_runtime_env *renv);
+
 /*
  * Source location
  */
@@ -340,6 +340,88 @@ static inline int sieve_lexer_curchar(struct sieve_lexical_scanner *scanner)
 	return scanner->buffer[scanner->buffer_pos];
 }
 
+/* Bulk scanning: these operate on the part of the current character run that
+   is available in the stream buffer. Whatever ends a run is handled by the
+   character-by-character code, so the produced tokens are identical. */
+
+static size_t
+sieve_lexer_span(struct sieve_lexical_scanner *scanner, const char *stops)
+{
+	const unsigned char *data, *end, *p;
+
+	if (scanner->buffer_size == 0)
+		return 0;
+
+	data = scanner->buffer + scanner->buffer_pos;
+	end = scanner->buffer + scanner->buffer_size;
+
+	/* NUL always ends a run */
+	p = memchr(data, '\0', end - data);
+	if (p != NULL)
+		end = p;
+	for (; *stops != '\0' && end > data; stops++) {
+		p = memchr(data, *stops, end - data);
+		if (p != NULL)
+			end = p;
+	}
+	return end - data;
+}
+
+static size_t
+sieve_lexer_whitespace_span(struct sieve_lexical_scanner *scanner)
+{
+	const unsigned char *data;
+	size_t avail, i;
+
+	if (scanner->buffer_size == 0)
+		return 0;
+
+	data = scanner->buffer + scanner->buffer_pos;
+	avail = scanner->buffer_size - scanner->buffer_pos;
+	for (i = 0; i < avail; i++) {
+		if (data[i] != ' ' && data[i] != '\t' &&
+		    data[i] != '\r' && data[i] != '\n')
+			break;
+	}
+	return i;
+}
+
+static void
+sieve_lexer_skip(struct sieve_lexical_scanner *scanner, size_t count)
+{
+	const unsigned char *p, *end;
+
+	i_assert(count > 0 &&
+		 scanner->buffer_pos + count <= scanner->buffer_size);
+
+	/* Count the line breaks; the last character is accounted for by
+	   sieve_lexer_shift() */
+	p = scanner->buffer + scanner->buffer_pos;
+	end = p + count - 1;
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		scanner->current_line++;
+		p++;
+	}
+
+	scanner->buffer_pos += count - 1;
+	sieve_lexer_shift(scanner);
+}
+
+static void
+sieve_lexer_append_run(struct sieve_lexical_scanner *scanner, string_t *str,
+		       size_t count)
+{
+	size_t len = str_len(str);
+
+	/* Matches the per-character limit check: once the limit is exceeded,
+	   nothing more is appended */
+	if (len > SIEVE_MAX_STRING_LEN)
+		return;
+	if (count > SIEVE_MAX_STRING_LEN + 1 - len)
+		count = SIEVE_MAX_STRING_LEN + 1 - len;
+	str_append_data(str, scanner->buffer + scanner->buffer_pos, count);
+}
+
 static inline const char *_char_sanitize(int ch)
 {
 	if (ch > 31 && ch < 127)
@@ -417,8 +499,14 @@ static bool
 sieve_lexer_scan_hash_comment(struct sieve_lexical_scanner *scanner)
 {
 	struct sieve_lexer *lexer = &scanner->lexer;
+	size_t run;
 
 	while (sieve_lexer_curchar(scanner) != '\n') {
+		if ((run = sieve_lexer_span(scanner, "\n")) > 0) {
+			sieve_lexer_skip(scanner, run);
+			continue;
+		}
+
 		switch(sieve_lexer_curchar(scanner)) {
 		case -1:
 			if (!scanner->input->eof) {
@@ -456,6 +544,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 {
 	struct sieve_lexer *lexer = &scanner->lexer;
 	string_t *str;
+	size_t run;
 	int ret;
 
 	/* Read first character */
@@ -529,7 +618,11 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 					lexer->token_type = STT_ERROR;
 					return FALSE;
 				default:
-					sieve_lexer_shift(scanner);
+					run = sieve_lexer_span(scanner, "*\n");
+					if (run > 0)
+						sieve_lexer_skip(scanner, run);
+					else
+						sieve_lexer_shift(scanner);
 				}
 			}
 
@@ -548,13 +641,8 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 	case ' ':
 		sieve_lexer_shift(scanner);
 
-		while (sieve_lexer_curchar(scanner) == '\t' ||
-		       sieve_lexer_curchar(scanner) == '\r' ||
-		       sieve_lexer_curchar(scanner) == '\n' ||
-		       sieve_lexer_curchar(scanner) == ' ') {
-
-			sieve_lexer_shift(scanner);
-		}
+		while ((run = sieve_lexer_whitespace_span(scanner)) > 0)
+			sieve_lexer_skip(scanner, run);
 
 		lexer->token_type = STT_WHITESPACE;
 		return TRUE;
@@ -567,6 +655,13 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 		str = lexer->token_str_value;
 
 		while (sieve_lexer_curchar(scanner) != '"') {
+			run = sieve_lexer_span(scanner, "\"\\\r\n");
+			if (run > 0) {
+				sieve_lexer_append_run(scanner, str, run);
+				sieve_lexer_skip(scanner, run);
+				continue;
+			}
+
 			if (sieve_lexer_curchar(scanner) == '\\')
 				sieve_lexer_shift(scanner);
 
@@ -829,6 +924,12 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 					/* Scan the rest of the line */
 					while (sieve_lexer_curchar(scanner) != '\n' &&
 					       sieve_lexer_curchar(scanner) != '\r') {
+						run = sieve_lexer_span(scanner, "\r\n");
+						if (run > 0) {
+							sieve_lexer_append_run(scanner, str, run);
+							sieve_lexer_skip(scanner, run);
+							continue;
+						}
 
 						switch (sieve_lexer_curchar(scanner)) {
 						case -1:
@@ -9,6 +9,12 @@
 
 #define SIEVE_DEFAULT_MAX_SCRIPT_SIZE  (1 << 20)
 
+/*
+ * Binaries
+ */
+
+#define SIEVE_DEFAULT_SHARED_BINARY_CACHE_SIZE  (4 << 20)
+
 #define SIEVE_MAX_LOOP_DEPTH           4
 
 /*
@@ -32,6 +38,19 @@
 
 #define SIEVE_MAX_MATCH_VALUES         32
 
+/*
+ * Cost estimate
+ */
+
+#define SIEVE_COST_TEST                1
+#define SIEVE_COST_KEY                 1
+#define SIEVE_COST_REGEX               10
+#define SIEVE_COST_BODY                50
+
+#define SIEVE_DEFAULT_MAX_OPERATIONS   0
+#define SIEVE_DEFAULT_MAX_CPU_TIME     0
+#define SIEVE_DEFAULT_MAX_REAL_TIME    0
+
 /*
  * Actions
  */
@@ -497,9 +497,12 @@ bool sieve_match_type_validate
 	 */
 	if ( mcht != NULL && mcht->def != NULL &&
 		mcht->def->validate_context != NULL ) {
-		return mcht->def->validate_context(valdtr, mt_arg, mtctx, key_arg);
+		if ( !mcht->def->validate_context(valdtr, mt_arg, mtctx, key_arg) )
+			return FALSE;
 	}
 
+	cmd->key_list = key_arg;
+	cmd->match_type = mtctx->match_type;
 	return TRUE;
 }
 
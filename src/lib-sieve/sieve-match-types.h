@@ -35,6 +35,9 @@ extern const struct sieve_match_type_def matches_match_type;
 struct sieve_match_type_def {
 	struct sieve_object_def obj_def;
 
+	/* Keys are matched as regular expressions */
+	bool regex_keys;
+
 	bool (*validate)
 		(struct sieve_validator *valdtr, struct sieve_ast_argument **arg,
 			struct sieve_match_type_context *ctx);
@@ -82,10 +82,10 @@ int sieve_match_value
 
 	sieve_stringlist_reset(key_list);
 
-	if ( mctx->trace )
+	if ( mctx->trace ) {
 		sieve_stringlist_set_trace(key_list, TRUE);
-
-	sieve_runtime_trace_descend(renv);
+		sieve_runtime_trace_descend(renv);
+	}
 
 	if ( mcht->def->match_keys != NULL ) {
 		/* Call match-type's own key match handler */
@@ -97,6 +97,12 @@ int sieve_match_value
 		match = 0;
 		while ( match == 0 &&
 			(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+			if ( (ret=sieve_runtime_check_resources(renv)) <= 0 ) {
+				mctx->exec_status = ret;
+				match = -1;
+				break;
+			}
+
 			T_BEGIN {
 				match = mcht->def->match_key
 					(mctx, value, value_size, str_c(key_item), str_len(key_item));
@@ -109,13 +115,14 @@ int sieve_match_value
 			} T_END;
 		}
 
-		if ( ret < 0 ) {
+		if ( match >= 0 && ret < 0 ) {
 			mctx->exec_status = key_list->exec_status;
 			match = -1;
 		}
 	}
 
-	sieve_runtime_trace_ascend(renv);
+	if ( mctx->trace )
+		sieve_runtime_trace_ascend(renv);
 
 	if ( mctx->match_status < 0 || match < 0 )
 		mctx->match_status = -1;
@@ -130,6 +137,7 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 	const struct sieve_match_type *mcht = (*mctx)->match_type;
 	const struct sieve_runtime_env *renv = (*mctx)->runenv;
 	int match = (*mctx)->match_status;
+	bool trace = (*mctx)->trace;
 
 	if ( mcht->def != NULL && mcht->def->match_deinit != NULL )
 		mcht->def->match_deinit(*mctx);
@@ -139,10 +147,13 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 
 	pool_unref(&(*mctx)->pool);
 
-	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
-		"finishing match with result: %s",
-		( match > 0 ? "matched" : ( match < 0 ? "error" : "not matched" ) ));
-	sieve_runtime_trace_ascend(renv);
+	if ( trace ) {
+		sieve_runtime_trace(renv, 0,
+			"finishing match with result: %s",
+			( match > 0 ? "matched" :
+				( match < 0 ? "error" : "not matched" ) ));
+		sieve_runtime_trace_ascend(renv);
+	}
 
 	return match;
 }
@@ -180,12 +191,17 @@ int sieve_match
 		match = 0;
 		while ( match == 0 &&
 			(ret=sieve_stringlist_next_item(value_list, &value_item)) > 0 ) {
+			if ( (ret=sieve_runtime_check_resources(renv)) <= 0 ) {
+				mctx->exec_status = ret;
+				match = -1;
+				break;
+			}
 
 			match = sieve_match_value
 				(mctx, str_c(value_item), str_len(value_item), key_list);
 		}
 
-		if ( ret < 0 ) {
+		if ( match >= 0 && ret < 0 ) {
 			mctx->exec_status = value_list->exec_status;
 			match = -1;
 		}
@@ -32,6 +32,7 @@
 #include "sieve-address.h"
 #include "sieve-address-parts.h"
 #include "sieve-runtime.h"
+#include "sieve-binary.h"
 #include "sieve-runtime-trace.h"
 #include "sieve-match.h"
 #include "sieve-interpreter.h"
@@ -1843,3 +1844,24 @@ static void sieve_mime_header_list_reset
 	sieve_stringlist_reset(hdrlist->field_names);
 	hdrlist->header_name = NULL;
 }
+
+/*
+ * Prefetching
+ */
+
+void sieve_message_get_wanted_data(struct sieve_binary *sbin,
+				   ARRAY_TYPE(const_string) *headers,
+				   enum mail_fetch_field *fields)
+{
+	enum sieve_binary_message_data data;
+	const char *const *names;
+	unsigned int count;
+
+	data = sieve_binary_get_message_data(sbin, &names, &count);
+	array_append(headers, names, count);
+
+	if ((data & SIEVE_BINARY_MESSAGE_DATA_SIZE) != 0)
+		*fields |= MAIL_FETCH_VIRTUAL_SIZE;
+	if ((data & SIEVE_BINARY_MESSAGE_DATA_BODY) != 0)
+		*fields |= MAIL_FETCH_STREAM_BODY;
+}
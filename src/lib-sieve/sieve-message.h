@@ -1,6 +1,8 @@
 #ifndef SIEVE_MESSAGE_H
 #define SIEVE_MESSAGE_H
 
+#include "mail-storage.h"
+
 #include "sieve-common.h"
 #include "sieve-stringlist.h"
 #include "sieve-objects.h"
@@ -277,4 +279,16 @@ struct sieve_header_list *sieve_mime_header_list_create
 	struct sieve_message_part_iter *part_iter,
 	bool mime_decode, bool children);
 
+/*
+ * Prefetching
+ */
+
+/* Determines the message data the script uses, as recorded in the binary
+   when it was compiled. Header names are appended to the headers array and
+   mail fields are added to fields. Names that are only known at runtime are
+   not included. */
+void sieve_message_get_wanted_data(struct sieve_binary *sbin,
+				   ARRAY_TYPE(const_string) *headers,
+				   enum mail_fetch_field *fields);
+
 #endif
@@ -38,6 +38,7 @@ struct sieve_result_action {
 
 	void *tr_context;
 	bool success;
+	bool commit_waiting;
 
 	bool keep;
 
@@ -1239,6 +1240,7 @@ sieve_result_action_commit(struct sieve_result *result,
 		if (cstatus == SIEVE_EXEC_OK) {
 			act->executed = TRUE;
 			result->executed = TRUE;
+			rac->commit_waiting = (act->def->commit_wait != NULL);
 		}
 	}
 
@@ -1343,6 +1345,37 @@ sieve_result_action_commit_or_rollback(struct sieve_result *result,
 	return status;
 }
 
+static void
+sieve_result_transaction_commit_wait(struct sieve_result *result,
+				     struct sieve_result_action *first,
+				     struct sieve_result_action *last,
+				     bool *implicit_keep, int *commit_status)
+{
+	struct sieve_result_action *rac;
+
+	for (rac = first; rac != NULL && rac != last; rac = rac->next) {
+		struct sieve_action *act = &rac->action;
+		bool impl_keep = TRUE;
+		int cstatus;
+
+		if (!rac->commit_waiting)
+			continue;
+		rac->commit_waiting = FALSE;
+
+		sieve_result_prepare_action_env(result, act);
+		cstatus = act->def->commit_wait(&result->action_env,
+						rac->tr_context, &impl_keep);
+		if (cstatus != SIEVE_EXEC_OK) {
+			if (*commit_status == SIEVE_EXEC_OK)
+				*commit_status = cstatus;
+			impl_keep = TRUE;
+		}
+
+		*implicit_keep = *implicit_keep && impl_keep;
+	}
+	sieve_result_finish_action_env(result);
+}
+
 static int
 sieve_result_transaction_commit_or_rollback(struct sieve_result *result,
 					    int status,
@@ -1398,6 +1431,11 @@ sieve_result_transaction_commit_or_rollback(struct sieve_result *result,
 		rac = rac->next;
 	}
 
+	/* Finally wait for actions that completed their commit
+	   asynchronously */
+	sieve_result_transaction_commit_wait(result, first, last,
+					     implicit_keep, &commit_status);
+
 	if (*implicit_keep && keep != NULL) *keep = TRUE;
 
 	if (commit_status == SIEVE_EXEC_OK) {
@@ -0,0 +1,275 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "ostream.h"
+
+#include "sieve-common.h"
+#include "sieve-code.h"
+
+#include "sieve-runtime-profile.h"
+
+/*
+ * Runtime profile
+ */
+
+struct sieve_runtime_profile_op {
+	const struct sieve_operation_def *def;
+
+	uint64_t count;
+	uint64_t nsecs;
+};
+
+struct sieve_runtime_profile_line {
+	const char *script_name;
+	unsigned int line;
+
+	uint64_t count;
+	uint64_t nsecs;
+};
+
+struct sieve_runtime_profile {
+	pool_t pool;
+
+	struct sieve_runtime_profile_totals totals;
+
+	ARRAY(struct sieve_runtime_profile_op) ops;
+	ARRAY(struct sieve_runtime_profile_line) lines;
+
+	HASH_TABLE(const struct sieve_operation_def *, void *) op_index;
+	HASH_TABLE(const char *, void *) line_index;
+};
+
+struct sieve_runtime_profile *sieve_runtime_profile_create(void)
+{
+	struct sieve_runtime_profile *profile;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_runtime_profile", 4096);
+	profile = p_new(pool, struct sieve_runtime_profile, 1);
+	profile->pool = pool;
+
+	p_array_init(&profile->ops, pool, 32);
+	p_array_init(&profile->lines, pool, 64);
+	hash_table_create_direct(&profile->op_index, pool, 0);
+	hash_table_create(&profile->line_index, pool, 0, str_hash, strcmp);
+
+	return profile;
+}
+
+void sieve_runtime_profile_free(struct sieve_runtime_profile **_profile)
+{
+	struct sieve_runtime_profile *profile = *_profile;
+
+	if (profile == NULL)
+		return;
+	*_profile = NULL;
+
+	hash_table_destroy(&profile->op_index);
+	hash_table_destroy(&profile->line_index);
+	pool_unref(&profile->pool);
+}
+
+/* Indexes are stored in the hash tables offset by one, so that the first
+   element is not mistaken for a missing entry. */
+
+static struct sieve_runtime_profile_op *
+sieve_runtime_profile_get_op(struct sieve_runtime_profile *profile,
+			     const struct sieve_operation_def *def)
+{
+	struct sieve_runtime_profile_op *op;
+	unsigned int idx;
+
+	idx = POINTER_CAST_TO(hash_table_lookup(profile->op_index, def),
+			      unsigned int);
+	if (idx > 0)
+		return array_idx_modifiable(&profile->ops, idx - 1);
+
+	op = array_append_space(&profile->ops);
+	op->def = def;
+	hash_table_insert(profile->op_index, def,
+			  POINTER_CAST(array_count(&profile->ops)));
+	return op;
+}
+
+static struct sieve_runtime_profile_line *
+sieve_runtime_profile_get_line(struct sieve_runtime_profile *profile,
+			       const char *script_name, unsigned int line)
+{
+	struct sieve_runtime_profile_line *pline;
+	const char *key;
+	unsigned int idx;
+
+	key = t_strdup_printf("%s:%u", script_name, line);
+	idx = POINTER_CAST_TO(hash_table_lookup(profile->line_index, key),
+			      unsigned int);
+	if (idx > 0)
+		return array_idx_modifiable(&profile->lines, idx - 1);
+
+	pline = array_append_space(&profile->lines);
+	pline->script_name = p_strdup(profile->pool, script_name);
+	pline->line = line;
+	hash_table_insert(profile->line_index, p_strdup(profile->pool, key),
+			  POINTER_CAST(array_count(&profile->lines)));
+	return pline;
+}
+
+void sieve_runtime_profile_add(struct sieve_runtime_profile *profile,
+			       const char *script_name,
+			       const struct sieve_operation *oprtn,
+			       unsigned int line, uint64_t nsecs)
+{
+	struct sieve_runtime_profile_op *op;
+	struct sieve_runtime_profile_line *pline;
+
+	profile->totals.operations++;
+	profile->totals.nsecs += nsecs;
+
+	if (oprtn->def != NULL) {
+		op = sieve_runtime_profile_get_op(profile, oprtn->def);
+		op->count++;
+		op->nsecs += nsecs;
+	}
+
+	if (line > 0) {
+		T_BEGIN {
+			pline = sieve_runtime_profile_get_line(
+				profile, script_name, line);
+			pline->count++;
+			pline->nsecs += nsecs;
+		} T_END;
+	}
+}
+
+void sieve_runtime_profile_add_cpu_time(struct sieve_runtime_profile *profile,
+					uint64_t cpu_nsecs)
+{
+	profile->totals.cpu_nsecs += cpu_nsecs;
+}
+
+void sieve_runtime_profile_merge(struct sieve_runtime_profile *dest,
+				 const struct sieve_runtime_profile *src)
+{
+	const struct sieve_runtime_profile_op *sop;
+	const struct sieve_runtime_profile_line *sline;
+	struct sieve_runtime_profile_op *dop;
+	struct sieve_runtime_profile_line *dline;
+
+	dest->totals.operations += src->totals.operations;
+	dest->totals.nsecs += src->totals.nsecs;
+	dest->totals.cpu_nsecs += src->totals.cpu_nsecs;
+
+	array_foreach(&src->ops, sop) {
+		dop = sieve_runtime_profile_get_op(dest, sop->def);
+		dop->count += sop->count;
+		dop->nsecs += sop->nsecs;
+	}
+	array_foreach(&src->lines, sline) T_BEGIN {
+		dline = sieve_runtime_profile_get_line(
+			dest, sline->script_name, sline->line);
+		dline->count += sline->count;
+		dline->nsecs += sline->nsecs;
+	} T_END;
+}
+
+/*
+ * Results
+ */
+
+void sieve_runtime_profile_get_totals(
+	const struct sieve_runtime_profile *profile,
+	struct sieve_runtime_profile_totals *totals_r)
+{
+	*totals_r = profile->totals;
+}
+
+bool sieve_runtime_profile_get_hottest_line(
+	const struct sieve_runtime_profile *profile,
+	const char **script_name_r, unsigned int *line_r, uint64_t *nsecs_r)
+{
+	const struct sieve_runtime_profile_line *pline, *hottest = NULL;
+
+	array_foreach(&profile->lines, pline) {
+		if (hottest == NULL || pline->nsecs > hottest->nsecs)
+			hottest = pline;
+	}
+	if (hottest == NULL)
+		return FALSE;
+
+	*script_name_r = hottest->script_name;
+	*line_r = hottest->line;
+	*nsecs_r = hottest->nsecs;
+	return TRUE;
+}
+
+static int
+sieve_runtime_profile_op_cmp(const struct sieve_runtime_profile_op *op1,
+			     const struct sieve_runtime_profile_op *op2)
+{
+	if (op1->nsecs != op2->nsecs)
+		return (op1->nsecs < op2->nsecs ? 1 : -1);
+	return strcmp(op1->def->mnemonic, op2->def->mnemonic);
+}
+
+static int
+sieve_runtime_profile_line_cmp(const struct sieve_runtime_profile_line *line1,
+			       const struct sieve_runtime_profile_line *line2)
+{
+	int ret;
+
+	if (line1->nsecs != line2->nsecs)
+		return (line1->nsecs < line2->nsecs ? 1 : -1);
+	if ((ret = strcmp(line1->script_name, line2->script_name)) != 0)
+		return ret;
+	return (line1->line < line2->line ? -1 :
+		(line1->line > line2->line ? 1 : 0));
+}
+
+void sieve_runtime_profile_write(const struct sieve_runtime_profile *profile,
+				 struct ostream *output)
+{
+	ARRAY(struct sieve_runtime_profile_op) ops;
+	ARRAY(struct sieve_runtime_profile_line) lines;
+	const struct sieve_runtime_profile_op *op;
+	const struct sieve_runtime_profile_line *pline;
+	string_t *str;
+
+	T_BEGIN {
+		str = t_str_new(256);
+
+		str_printfa(str, "## Profile: %llu operations, "
+			    "%llu nsecs elapsed, %llu nsecs CPU\n",
+			    (unsigned long long)profile->totals.operations,
+			    (unsigned long long)profile->totals.nsecs,
+			    (unsigned long long)profile->totals.cpu_nsecs);
+
+		t_array_init(&ops, array_count(&profile->ops) + 1);
+		array_append_array(&ops, &profile->ops);
+		array_sort(&ops, sieve_runtime_profile_op_cmp);
+
+		str_append(str, "\n## Operations:\n");
+		array_foreach(&ops, op) {
+			str_printfa(str, "%-24s %10llu %14llu\n",
+				    op->def->mnemonic,
+				    (unsigned long long)op->count,
+				    (unsigned long long)op->nsecs);
+		}
+
+		t_array_init(&lines, array_count(&profile->lines) + 1);
+		array_append_array(&lines, &profile->lines);
+		array_sort(&lines, sieve_runtime_profile_line_cmp);
+
+		str_append(str, "\n## Source lines:\n");
+		array_foreach(&lines, pline) {
+			str_printfa(str, "%s: line %-6u %10llu %14llu\n",
+				    pline->script_name, pline->line,
+				    (unsigned long long)pline->count,
+				    (unsigned long long)pline->nsecs);
+		}
+
+		o_stream_nsend(output, str_data(str), str_len(str));
+	} T_END;
+}
@@ -0,0 +1,62 @@
+#ifndef SIEVE_RUNTIME_PROFILE_H
+#define SIEVE_RUNTIME_PROFILE_H
+
+#include "sieve-common.h"
+
+#include <time.h>
+
+/*
+ * Runtime profile
+ *
+ * - Accumulates execution counts and elapsed time per operation and per
+ *   source line. Times are exclusive: time spent in a nested interpreter
+ *   (e.g. an included script) is only recorded in the nested profile.
+ */
+
+struct sieve_runtime_profile;
+
+struct sieve_runtime_profile_totals {
+	/* Number of executed operations */
+	uint64_t operations;
+	/* Elapsed (wall clock) time spent executing operations */
+	uint64_t nsecs;
+	/* CPU time consumed by the interpreter */
+	uint64_t cpu_nsecs;
+};
+
+struct sieve_runtime_profile *sieve_runtime_profile_create(void);
+void sieve_runtime_profile_free(struct sieve_runtime_profile **_profile);
+
+void sieve_runtime_profile_add(struct sieve_runtime_profile *profile,
+			       const char *script_name,
+			       const struct sieve_operation *oprtn,
+			       unsigned int line, uint64_t nsecs);
+void sieve_runtime_profile_add_cpu_time(struct sieve_runtime_profile *profile,
+					uint64_t cpu_nsecs);
+void sieve_runtime_profile_merge(struct sieve_runtime_profile *dest,
+				 const struct sieve_runtime_profile *src);
+
+void sieve_runtime_profile_get_totals(
+	const struct sieve_runtime_profile *profile,
+	struct sieve_runtime_profile_totals *totals_r);
+bool sieve_runtime_profile_get_hottest_line(
+	const struct sieve_runtime_profile *profile,
+	const char **script_name_r, unsigned int *line_r, uint64_t *nsecs_r);
+
+void sieve_runtime_profile_write(const struct sieve_runtime_profile *profile,
+				 struct ostream *output);
+
+/*
+ * Clock
+ */
+
+static inline uint64_t sieve_runtime_profile_clock(clockid_t clock_id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock_id, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif
@@ -19,13 +19,15 @@ struct sieve_runtime_trace {
 static inline bool sieve_runtime_trace_active
 (const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level)
 {
-	return ( renv->trace != NULL && trace_level <= renv->trace->config.level );
+	return ( unlikely(renv->trace != NULL) &&
+		trace_level <= renv->trace->config.level );
 }
 
 static inline bool sieve_runtime_trace_hasflag
 (const struct sieve_runtime_env *renv, unsigned int flag)
 {
-	return ( renv->trace != NULL && (renv->trace->config.flags & flag) != 0 );
+	return ( unlikely(renv->trace != NULL) &&
+		(renv->trace->config.flags & flag) != 0 );
 }
 
 /* Trace indent */
@@ -33,19 +35,19 @@ static inline bool sieve_runtime_trace_hasflag
 static inline void sieve_runtime_trace_descend
 (const struct sieve_runtime_env *renv)
 {
-	if ( renv->trace != NULL ) renv->trace->indent++;
+	if ( unlikely(renv->trace != NULL) ) renv->trace->indent++;
 }
 
 static inline void sieve_runtime_trace_ascend
 (const struct sieve_runtime_env *renv)
 {
-	if ( renv->trace != NULL ) renv->trace->indent--;
+	if ( unlikely(renv->trace != NULL) ) renv->trace->indent--;
 }
 
 static inline void sieve_runtime_trace_toplevel
 (const struct sieve_runtime_env *renv)
 {
-	if ( renv->trace != NULL ) renv->trace->indent = 0;
+	if ( unlikely(renv->trace != NULL) ) renv->trace->indent = 0;
 }
 
 /* Trace errors */
@@ -72,7 +74,7 @@ static inline void ATTR_FORMAT(2, 3) sieve_runtime_trace_error
 	va_list args;
 
 	va_start(args, fmt);
-	if ( renv->trace != NULL )
+	if ( unlikely(renv->trace != NULL) )
 		_sieve_runtime_trace_error(renv, fmt, args);
 	va_end(args);
 }
@@ -84,7 +86,7 @@ static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace_operand_error
 	va_list args;
 
 	va_start(args, fmt);
-	if ( renv->trace != NULL )
+	if ( unlikely(renv->trace != NULL) )
 		_sieve_runtime_trace_operand_error(renv, oprnd, fmt, args);
 	va_end(args);
 }
@@ -107,7 +109,8 @@ static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace
 
 	va_start(args, fmt);
 
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
+	if ( unlikely(renv->trace != NULL) &&
+		trace_level <= renv->trace->config.level ) {
 		_sieve_runtime_trace(renv, fmt, args);
 	}
 
@@ -130,7 +133,8 @@ static inline void ATTR_FORMAT(4, 5) sieve_runtime_trace_address
 
 	va_start(args, fmt);
 
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
+	if ( unlikely(renv->trace != NULL) &&
+		trace_level <= renv->trace->config.level ) {
 		_sieve_runtime_trace_address(renv, address, fmt, args);
 	}
 
@@ -145,7 +149,8 @@ static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace_here
 
 	va_start(args, fmt);
 
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
+	if ( unlikely(renv->trace != NULL) &&
+		trace_level <= renv->trace->config.level ) {
 		_sieve_runtime_trace_address(renv, renv->pc, fmt, args);
 	}
 
@@ -161,21 +166,21 @@ void _sieve_runtime_trace_sep(const struct sieve_runtime_env *renv);
 static inline void sieve_runtime_trace_begin
 (const struct sieve_runtime_env *renv)
 {
-	if ( renv->trace != NULL )
+	if ( unlikely(renv->trace != NULL) )
 		_sieve_runtime_trace_begin(renv);
 }
 
 static inline void sieve_runtime_trace_end
 (const struct sieve_runtime_env *renv)
 {
-	if ( renv->trace != NULL )
+	if ( unlikely(renv->trace != NULL) )
 		_sieve_runtime_trace_end(renv);
 }
 
 static inline void sieve_runtime_trace_sep
 (const struct sieve_runtime_env *renv)
 {
-	if ( renv->trace != NULL )
+	if ( unlikely(renv->trace != NULL) )
 		_sieve_runtime_trace_sep(renv);
 }
 
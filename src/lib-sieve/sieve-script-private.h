@@ -12,6 +12,9 @@ struct sieve_script_vfuncs {
 	void (*destroy)(struct sieve_script *script);
 
 	int (*open)(struct sieve_script *script, enum sieve_error *error_r);
+	/* Optional: issue the lookups needed by open() without waiting for
+	   them; the subsequent open() waits for the result */
+	void (*open_begin)(struct sieve_script *script);
 
 	int (*get_stream)(struct sieve_script *script,
 			  struct istream **stream_r, enum sieve_error *error_r);
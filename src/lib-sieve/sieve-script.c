@@ -198,6 +198,16 @@ int sieve_script_open(struct sieve_script *script, enum sieve_error *error_r)
 	return 0;
 }
 
+/* Starts opening the script in the background for storages that support
+   it. Scripts from several storages can thus be looked up concurrently; the
+   result is collected by a subsequent sieve_script_open(). */
+void sieve_script_open_begin(struct sieve_script *script)
+{
+	if (script->open || script->v.open_begin == NULL)
+		return;
+	script->v.open_begin(script);
+}
+
 int sieve_script_open_as(struct sieve_script *script, const char *name,
 			 enum sieve_error *error_r)
 {
@@ -299,6 +309,12 @@ bool sieve_script_is_default(const struct sieve_script *script)
 	return script->storage->is_default;
 }
 
+bool sieve_script_is_global(const struct sieve_script *script)
+{
+	return ((script->storage->flags & SIEVE_STORAGE_FLAG_GLOBAL) != 0 ||
+		script->storage->is_default);
+}
+
 /*
  * Stream management
  */
@@ -44,6 +44,7 @@ void sieve_script_unref(struct sieve_script **script);
 
 int sieve_script_open(struct sieve_script *script, enum sieve_error *error_r)
 		      ATTR_NULL(2);
+void sieve_script_open_begin(struct sieve_script *script);
 int sieve_script_open_as(struct sieve_script *script, const char *name,
 			 enum sieve_error *error_r) ATTR_NULL(3);
 
@@ -117,6 +118,7 @@ sieve_script_svinst(const struct sieve_script *script) ATTR_PURE;
 int sieve_script_get_size(struct sieve_script *script, uoff_t *size_r);
 bool sieve_script_is_open(const struct sieve_script *script) ATTR_PURE;
 bool sieve_script_is_default(const struct sieve_script *script) ATTR_PURE;
+bool sieve_script_is_global(const struct sieve_script *script) ATTR_PURE;
 
 const char *
 sieve_file_script_get_dirpath(const struct sieve_script *script) ATTR_PURE;
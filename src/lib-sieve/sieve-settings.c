@@ -225,6 +225,72 @@ void sieve_settings_load
 		svinst->max_redirects = (unsigned int) uint_setting;
 	}
 
+	svinst->max_operations = SIEVE_DEFAULT_MAX_OPERATIONS;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_max_operations", &uint_setting) ) {
+		if (uint_setting > UINT_MAX)
+			svinst->max_operations = UINT_MAX;
+		else
+			svinst->max_operations = (unsigned int) uint_setting;
+	}
+
+	svinst->max_cpu_time = SIEVE_DEFAULT_MAX_CPU_TIME;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_max_cpu_time", &period) ) {
+		if (period > UINT_MAX)
+			svinst->max_cpu_time = UINT_MAX;
+		else
+			svinst->max_cpu_time = (unsigned int)period;
+	}
+
+	svinst->max_real_time = SIEVE_DEFAULT_MAX_REAL_TIME;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_max_real_time", &period) ) {
+		if (period > UINT_MAX)
+			svinst->max_real_time = UINT_MAX;
+		else
+			svinst->max_real_time = (unsigned int)period;
+	}
+
+	svinst->resource_limit_keep = FALSE;
+	str_setting = sieve_setting_get(svinst, "sieve_resource_limit_action");
+	if ( str_setting != NULL && *str_setting != '\0' ) {
+		str_setting = t_str_trim(str_setting, "\t ");
+		if ( strcasecmp(str_setting, "keep") == 0 ) {
+			svinst->resource_limit_keep = TRUE;
+		} else if ( strcasecmp(str_setting, "tempfail") != 0 ) {
+			e_warning(svinst->event,
+				  "Invalid value for setting "
+				  "`sieve_resource_limit_action': %s",
+				  str_setting);
+		}
+	}
+
+	svinst->max_script_cost = 0;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_max_script_cost", &uint_setting) ) {
+		svinst->max_script_cost = (uint_setting > UINT_MAX ?
+			UINT_MAX : (unsigned int) uint_setting);
+	}
+
+	svinst->script_cost_warning = 0;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_script_cost_warning", &uint_setting) ) {
+		svinst->script_cost_warning = (uint_setting > UINT_MAX ?
+			UINT_MAX : (unsigned int) uint_setting);
+	}
+
+	svinst->shared_binary_cache_size =
+		SIEVE_DEFAULT_SHARED_BINARY_CACHE_SIZE;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_shared_binary_cache_size", &size_setting) ) {
+		svinst->shared_binary_cache_size = size_setting;
+	}
+
+	svinst->runtime_profile = FALSE;
+	(void)sieve_setting_get_bool_value
+		(svinst, "sieve_runtime_profile", &svinst->runtime_profile);
+
 	(void)sieve_address_source_parse_from_setting(svinst,
 		svinst->pool, "sieve_redirect_envelope_from",
 		&svinst->redirect_from);
@@ -20,7 +20,10 @@ enum sieve_storage_flags {
 	SIEVE_STORAGE_FLAG_READWRITE         = 0x01,
 	/* This storage is used for synchronization (and not normal ManageSieve)
 	 */
-	SIEVE_STORAGE_FLAG_SYNCHRONIZING     = 0x02
+	SIEVE_STORAGE_FLAG_SYNCHRONIZING     = 0x02,
+	/* Storage holds global scripts shared by all users (e.g. sieve_before,
+	   sieve_after, sieve_global) */
+	SIEVE_STORAGE_FLAG_GLOBAL            = 0x04
 };
 
 struct sieve_storage;
@@ -0,0 +1,120 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "hash.h"
+#include "str-sanitize.h"
+#include "mail-storage-private.h"
+
+#include "sieve-store-batch.h"
+
+struct sieve_store_batch_mailbox {
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+};
+
+struct sieve_store_batch {
+	pool_t pool;
+	HASH_TABLE(const char *, struct sieve_store_batch_mailbox *) mailboxes;
+};
+
+struct sieve_store_batch *sieve_store_batch_create(void)
+{
+	struct sieve_store_batch *batch;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_store_batch", 1024);
+	batch = p_new(pool, struct sieve_store_batch, 1);
+	batch->pool = pool;
+	hash_table_create(&batch->mailboxes, pool, 0, str_hash, strcmp);
+	return batch;
+}
+
+void sieve_store_batch_destroy(struct sieve_store_batch **_batch)
+{
+	struct sieve_store_batch *batch = *_batch;
+	struct hash_iterate_context *iter;
+	struct sieve_store_batch_mailbox *sbox;
+	const char *vname;
+
+	*_batch = NULL;
+	if (batch == NULL)
+		return;
+
+	iter = hash_table_iterate_init(batch->mailboxes);
+	while (hash_table_iterate(iter, batch->mailboxes, &vname, &sbox)) {
+		if (sbox->trans != NULL)
+			mailbox_transaction_rollback(&sbox->trans);
+		mailbox_free(&sbox->box);
+	}
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_destroy(&batch->mailboxes);
+	pool_unref(&batch->pool);
+}
+
+struct mailbox_transaction_context *
+sieve_store_batch_get_transaction(struct sieve_store_batch *batch,
+				  struct mailbox *box)
+{
+	struct sieve_store_batch_mailbox *sbox;
+	const char *vname = mailbox_get_vname(box);
+	struct mailbox *store_box;
+
+	sbox = hash_table_lookup(batch->mailboxes, vname);
+	if (sbox == NULL) {
+		/* Use the flags of the action's mailbox, so that e.g. ACL
+		   post rights and auto-creation apply as they do for
+		   unbatched stores */
+		store_box = mailbox_alloc(mailbox_get_namespace(box)->list,
+					  vname, box->flags);
+		if (mailbox_open(store_box) < 0) {
+			/* Let the action store the message by itself */
+			mailbox_free(&store_box);
+			return NULL;
+		}
+
+		sbox = p_new(batch->pool, struct sieve_store_batch_mailbox, 1);
+		sbox->box = store_box;
+		hash_table_insert(batch->mailboxes,
+				  p_strdup(batch->pool, vname), sbox);
+	}
+
+	if (sbox->trans == NULL) {
+		sbox->trans = mailbox_transaction_begin(
+			sbox->box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+			"sieve_store_batch");
+	}
+	return sbox->trans;
+}
+
+int sieve_store_batch_commit(struct sieve_store_batch *batch,
+			     const char **error_r)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_store_batch_mailbox *sbox;
+	const char *vname;
+	enum mail_error error;
+	int ret = 0;
+
+	*error_r = NULL;
+
+	iter = hash_table_iterate_init(batch->mailboxes);
+	while (hash_table_iterate(iter, batch->mailboxes, &vname, &sbox)) {
+		if (sbox->trans == NULL)
+			continue;
+		if (ret < 0) {
+			mailbox_transaction_rollback(&sbox->trans);
+			continue;
+		}
+		if (mailbox_transaction_commit(&sbox->trans) < 0) {
+			*error_r = t_strdup_printf(
+				"failed to store messages in mailbox %s: %s",
+				str_sanitize(vname, 128),
+				mailbox_get_last_error(sbox->box, &error));
+			ret = -1;
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef SIEVE_STORE_BATCH_H
+#define SIEVE_STORE_BATCH_H
+
+#include "sieve-common.h"
+
+/*
+ * Store batch
+ *
+ * - Keeps one transaction per destination mailbox for callers that batch
+ *   the messages stored by their scripts (see store_get_transaction() in
+ *   struct sieve_script_env).
+ */
+
+struct sieve_store_batch;
+
+struct sieve_store_batch *sieve_store_batch_create(void);
+/* Rolls back all transactions that were not committed */
+void sieve_store_batch_destroy(struct sieve_store_batch **_batch);
+
+/* Returns the transaction for the mailbox the store action opened, or NULL
+   when the mailbox cannot be opened. The mailbox is opened once more with the
+   same flags, since the action's instance does not outlive the result. */
+struct mailbox_transaction_context *
+sieve_store_batch_get_transaction(struct sieve_store_batch *batch,
+				  struct mailbox *box);
+
+/* Commits all transactions. Once one of them fails, the remaining ones are
+   rolled back and -1 is returned with error_r set. */
+int sieve_store_batch_commit(struct sieve_store_batch *batch,
+			     const char **error_r);
+
+#endif
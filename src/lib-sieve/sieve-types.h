@@ -23,6 +23,7 @@ struct sieve_message_data;
 struct sieve_script_env;
 struct sieve_exec_status;
 struct sieve_trace_log;
+struct sieve_runtime_profile;
 
 /*
  * System environment
@@ -239,6 +240,20 @@ struct sieve_script_env {
 	int (*reject_mail)(const struct sieve_script_env *senv,
 		const struct smtp_address *recipient, const char *reason);
 
+	/* Batched storing: when set, messages are saved into the transaction
+	   returned for the target mailbox rather than into a transaction of
+	   their own. The caller commits it, which allows storing many
+	   messages with a single commit. Returning NULL stores the message
+	   right away as usual.
+
+	   The store action cannot know the outcome of that commit, so its
+	   status is provisional: it logs the message as queued and sets
+	   message_saved in the exec status. When committing fails, the
+	   caller must log the failure and must not act on message_saved
+	   (e.g. by discarding the original message). */
+	struct mailbox_transaction_context *(*store_get_transaction)
+		(const struct sieve_script_env *senv, struct mailbox *box);
+
 	/* Interface for amending result messages */
 	const char *
 	(*result_amend_log_message)(const struct sieve_script_env *senv,
@@ -251,6 +266,10 @@ struct sieve_script_env {
 	/* Runtime trace*/
 	struct sieve_trace_log *trace_log;
 	struct sieve_trace_config trace_config;
+
+	/* Runtime profile; when not NULL, the interpreter records the
+	   execution profile of all scripts run in this environment here */
+	struct sieve_runtime_profile *profile;
 };
 
 #define SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) \
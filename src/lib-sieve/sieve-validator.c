@@ -17,6 +17,7 @@
 #include "sieve-validator.h"
 
 #include "sieve-comparators.h"
+#include "sieve-match-types.h"
 #include "sieve-address-parts.h"
 
 /*
@@ -1568,9 +1569,307 @@ sieve_validate_block(struct sieve_validator *valdtr,
 	return result && !fatal;
 }
 
+/*
+ * AST optimization
+ */
+
+/* Cost weights used to order the operands of an anyof test */
+#define SIEVE_OPTIMIZE_COST_SIZE     1
+#define SIEVE_OPTIMIZE_COST_EXISTS   2
+#define SIEVE_OPTIMIZE_COST_HEADER   3
+#define SIEVE_OPTIMIZE_COST_ADDRESS  4
+
+static bool
+sieve_optimize_test_get_match(struct sieve_command *tst,
+			      const struct sieve_match_type **mcht_r,
+			      const struct sieve_comparator **cmp_r,
+			      bool *address_part_r)
+{
+	struct sieve_ast_argument *arg = sieve_command_first_argument(tst);
+
+	*mcht_r = NULL;
+	*cmp_r = NULL;
+	*address_part_r = FALSE;
+
+	while (arg != NULL && arg != tst->first_positional) {
+		if (arg->argument == NULL)
+			return FALSE;
+		if (sieve_argument_is_comparator(arg)) {
+			*cmp_r = sieve_comparator_tag_get(arg);
+		} else if (sieve_argument_is_match_type(arg)) {
+			const struct sieve_match_type_context *mtctx =
+				(const struct sieve_match_type_context *)
+				arg->argument->data;
+
+			if (mtctx == NULL || mtctx->match_type == NULL)
+				return FALSE;
+			*mcht_r = mtctx->match_type;
+		} else if (sieve_argument_is(arg, address_part_tag)) {
+			*address_part_r = TRUE;
+		} else {
+			/* Unknown tag; may belong to an extension */
+			return FALSE;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+	return TRUE;
+}
+
+static unsigned int
+sieve_optimize_count_strings(struct sieve_ast_argument *arg)
+{
+	if (arg == NULL)
+		return 0;
+	if (sieve_ast_argument_type(arg) == SAAT_STRING_LIST)
+		return sieve_ast_strlist_count(arg);
+	return 1;
+}
+
+/* Returns FALSE if the test has (potential) side effects or if its cost
+   cannot be estimated. Match values set by :matches or :regex count as side
+   effects. */
+static bool
+sieve_optimize_test_cost(struct sieve_ast_node *test, unsigned int *cost_r)
+{
+	struct sieve_command *tst = test->command;
+	const struct sieve_match_type *mcht;
+	const struct sieve_comparator *cmp;
+	struct sieve_ast_node *subtest;
+	unsigned int cost, keys;
+	bool address_part;
+
+	*cost_r = 0;
+	if (tst == NULL || tst->def == NULL || tst->ext != NULL)
+		return FALSE;
+
+	if (sieve_command_is(tst, tst_not) ||
+	    sieve_command_is(tst, tst_allof) ||
+	    sieve_command_is(tst, tst_anyof)) {
+		subtest = sieve_ast_test_first(test);
+		while (subtest != NULL) {
+			if (!sieve_optimize_test_cost(subtest, &cost))
+				return FALSE;
+			*cost_r += cost;
+			subtest = sieve_ast_test_next(subtest);
+		}
+		return TRUE;
+	}
+	if (sieve_command_is(tst, tst_true) ||
+	    sieve_command_is(tst, tst_false))
+		return TRUE;
+	if (sieve_command_is(tst, tst_size)) {
+		*cost_r = SIEVE_OPTIMIZE_COST_SIZE;
+		return TRUE;
+	}
+
+	if (!sieve_optimize_test_get_match(tst, &mcht, &cmp, &address_part))
+		return FALSE;
+	if (mcht != NULL && !sieve_match_type_is(mcht, is_match_type) &&
+	    !sieve_match_type_is(mcht, contains_match_type))
+		return FALSE;
+
+	if (sieve_command_is(tst, tst_exists)) {
+		*cost_r = SIEVE_OPTIMIZE_COST_EXISTS +
+			sieve_optimize_count_strings(tst->first_positional);
+		return TRUE;
+	}
+	if (sieve_command_is(tst, tst_header))
+		cost = SIEVE_OPTIMIZE_COST_HEADER;
+	else if (sieve_command_is(tst, tst_address))
+		cost = SIEVE_OPTIMIZE_COST_ADDRESS;
+	else
+		return FALSE;
+
+	/* Substring matching is more expensive per key */
+	keys = sieve_optimize_count_strings(sieve_ast_argument_last(test));
+	if (mcht != NULL && sieve_match_type_is(mcht, contains_match_type))
+		keys *= 2;
+	*cost_r = cost + keys *
+		sieve_optimize_count_strings(tst->first_positional);
+	return TRUE;
+}
+
+static bool
+sieve_optimize_strings_equal(struct sieve_ast_argument *arg1,
+			     struct sieve_ast_argument *arg2)
+{
+	struct sieve_ast_argument *item1 = arg1, *item2 = arg2;
+
+	if (sieve_ast_argument_type(arg1) != sieve_ast_argument_type(arg2))
+		return FALSE;
+	if (sieve_ast_argument_type(arg1) == SAAT_STRING_LIST) {
+		if (sieve_ast_strlist_count(arg1) !=
+		    sieve_ast_strlist_count(arg2))
+			return FALSE;
+		item1 = sieve_ast_strlist_first(arg1);
+		item2 = sieve_ast_strlist_first(arg2);
+	}
+
+	while (item1 != NULL && item2 != NULL) {
+		if (item1->argument == NULL || item2->argument == NULL ||
+		    !sieve_argument_is_string_literal(item1) ||
+		    !sieve_argument_is_string_literal(item2) ||
+		    strcasecmp(sieve_ast_argument_strc(item1),
+			       sieve_ast_argument_strc(item2)) != 0)
+			return FALSE;
+		if (item1 == arg1)
+			break;
+		item1 = sieve_ast_strlist_next(item1);
+		item2 = sieve_ast_strlist_next(item2);
+	}
+	return TRUE;
+}
+
+static bool
+sieve_optimize_header_mergeable(struct sieve_ast_node *test1,
+				struct sieve_ast_node *test2)
+{
+	struct sieve_command *tst1 = test1->command, *tst2 = test2->command;
+	const struct sieve_match_type *mcht1, *mcht2;
+	const struct sieve_comparator *cmp1, *cmp2;
+	const struct sieve_match_type_def *mdef1, *mdef2;
+	const struct sieve_comparator_def *cdef1, *cdef2;
+	bool address_part;
+
+	if (tst1 == NULL || tst2 == NULL ||
+	    !sieve_command_is(tst1, tst_header) || tst1->ext != NULL ||
+	    !sieve_command_is(tst2, tst_header) || tst2->ext != NULL)
+		return FALSE;
+
+	if (!sieve_optimize_test_get_match(tst1, &mcht1, &cmp1,
+					   &address_part) || address_part ||
+	    !sieve_optimize_test_get_match(tst2, &mcht2, &cmp2,
+					   &address_part) || address_part)
+		return FALSE;
+
+	/* Only :is and :contains; their result does not depend on which key
+	   matches first */
+	mdef1 = (mcht1 == NULL ? &is_match_type : mcht1->def);
+	mdef2 = (mcht2 == NULL ? &is_match_type : mcht2->def);
+	if (mdef1 != mdef2 ||
+	    (mdef1 != &is_match_type && mdef1 != &contains_match_type))
+		return FALSE;
+
+	cdef1 = (cmp1 == NULL ? &i_ascii_casemap_comparator : cmp1->def);
+	cdef2 = (cmp2 == NULL ? &i_ascii_casemap_comparator : cmp2->def);
+	if (cdef1 != cdef2)
+		return FALSE;
+
+	/* Header names must be identical */
+	return sieve_optimize_strings_equal(tst1->first_positional,
+					    tst2->first_positional);
+}
+
+static bool
+sieve_optimize_header_merge(struct sieve_ast_node *test1,
+			    struct sieve_ast_node *test2)
+{
+	struct sieve_ast_argument *keys1, *keys2, *keys;
+
+	keys1 = sieve_ast_argument_last(test1);
+	keys2 = sieve_ast_argument_last(test2);
+
+	keys = sieve_ast_stringlist_join(keys1, keys2);
+	if (keys == NULL)
+		return FALSE;
+	if (keys->argument == NULL) {
+		keys->argument = sieve_argument_create(
+			keys->ast, &string_list_argument, NULL, 0);
+	}
+	return TRUE;
+}
+
+static void
+sieve_optimize_anyof(struct sieve_ast_node *node)
+{
+	struct sieve_ast_node *test, *next, **tests;
+	unsigned int *costs, count, i, j;
+	bool pure = TRUE;
+
+	/* Merge consecutive header tests on the same fields */
+	test = sieve_ast_test_first(node);
+	while (test != NULL) {
+		next = sieve_ast_test_next(test);
+		if (next != NULL &&
+		    sieve_optimize_header_mergeable(test, next) &&
+		    sieve_optimize_header_merge(test, next)) {
+			(void)sieve_ast_node_detach(next);
+			continue;
+		}
+		test = next;
+	}
+
+	/* Order operands cheapest-first, but only when none of them have side
+	   effects */
+	count = sieve_ast_test_count(node);
+	if (count < 2)
+		return;
+
+	tests = t_new(struct sieve_ast_node *, count);
+	costs = t_new(unsigned int, count);
+	test = sieve_ast_test_first(node);
+	for (i = 0; i < count && pure; i++) {
+		pure = sieve_optimize_test_cost(test, &costs[i]);
+		tests[i] = test;
+		test = sieve_ast_test_next(test);
+	}
+	if (!pure)
+		return;
+
+	/* Stable insertion sort */
+	for (i = 1; i < count; i++) {
+		struct sieve_ast_node *tmp_test = tests[i];
+		unsigned int tmp_cost = costs[i];
+
+		for (j = i; j > 0 && costs[j - 1] > tmp_cost; j--) {
+			tests[j] = tests[j - 1];
+			costs[j] = costs[j - 1];
+		}
+		tests[j] = tmp_test;
+		costs[j] = tmp_cost;
+	}
+
+	test = sieve_ast_test_first(node);
+	while (test != NULL)
+		test = sieve_ast_node_detach(test);
+	for (i = 0; i < count; i++)
+		(void)sieve_ast_test_append(node, tests[i]);
+}
+
+static void sieve_optimize_node(struct sieve_ast_node *node)
+{
+	struct sieve_ast_node *child;
+
+	if (node->tests != NULL) {
+		child = sieve_ast_test_first(node);
+		for (; child != NULL; child = sieve_ast_test_next(child))
+			sieve_optimize_node(child);
+	}
+	if (node->commands != NULL) {
+		child = sieve_ast_command_first(node);
+		for (; child != NULL; child = sieve_ast_command_next(child))
+			sieve_optimize_node(child);
+	}
+
+	if (node->type == SAT_TEST && node->command != NULL &&
+	    sieve_command_is(node->command, tst_anyof) &&
+	    node->command->ext == NULL)
+		sieve_optimize_anyof(node);
+}
+
 bool sieve_validator_run(struct sieve_validator *valdtr)
 {
-	return sieve_validate_block(valdtr, sieve_ast_root(valdtr->ast));
+	struct sieve_ast_node *root = sieve_ast_root(valdtr->ast);
+
+	if (!sieve_validate_block(valdtr, root))
+		return FALSE;
+
+	/* Constant tests were already folded during validation; further
+	   simplify the validated AST before code generation */
+	T_BEGIN {
+		sieve_optimize_node(root);
+	} T_END;
+	return TRUE;
 }
 
 /*
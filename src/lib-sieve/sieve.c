@@ -243,6 +243,33 @@ static struct sieve_binary *sieve_generate(struct sieve_ast *ast,
  * Sieve compilation
  */
 
+static bool
+sieve_compile_check_cost(struct sieve_script *script, struct sieve_binary *sbin,
+			 struct sieve_error_handler *ehandler)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	unsigned int cost;
+
+	if (svinst->max_script_cost == 0 && svinst->script_cost_warning == 0)
+		return TRUE;
+
+	cost = sieve_binary_cost_estimate(sieve_binary_get_cost(sbin));
+	if (svinst->max_script_cost > 0 && cost > svinst->max_script_cost) {
+		sieve_error(ehandler, sieve_script_name(script),
+			    "script is too expensive to execute "
+			    "(estimated cost %u exceeds the limit of %u)",
+			    cost, svinst->max_script_cost);
+		return FALSE;
+	}
+	if (svinst->script_cost_warning > 0 &&
+	    cost > svinst->script_cost_warning) {
+		sieve_warning(ehandler, sieve_script_name(script),
+			      "script is expensive to execute "
+			      "(estimated cost %u)", cost);
+	}
+	return TRUE;
+}
+
 struct sieve_binary *sieve_compile_script(struct sieve_script *script,
 					  struct sieve_error_handler *ehandler,
 					  enum sieve_compile_flags flags,
@@ -291,6 +318,15 @@ struct sieve_binary *sieve_compile_script(struct sieve_script *script,
 		return NULL;
 	}
 
+	/* Check cost estimate of uploaded scripts */
+	if ((flags & SIEVE_COMPILE_FLAG_UPLOADED) != 0 &&
+	    !sieve_compile_check_cost(script, sbin, ehandler)) {
+		*errorp = SIEVE_ERROR_NOT_VALID;
+		sieve_binary_unref(&sbin);
+		sieve_ast_unref(&ast);
+		return NULL;
+	}
+
 	/* Cleanup */
 	sieve_ast_unref(&ast);
 	return sbin;
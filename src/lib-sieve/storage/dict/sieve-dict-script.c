@@ -2,6 +2,8 @@
  */
 
 #include "lib.h"
+#include "hash.h"
+#include "ioloop.h"
 #include "str.h"
 #include "strfuncs.h"
 #include "istream.h"
@@ -14,6 +16,143 @@
 
 #include "sieve-dict-storage.h"
 
+/*
+ * Script cache
+ */
+
+/* The data ID and text of scripts are cached per process, keyed by dict URI,
+   user and script name. While the entry is within its TTL, the dict is not
+   consulted at all. Once it expires, only the data ID is looked up again; the
+   cached script text remains valid for as long as the data ID is unchanged,
+   since changing a script always involves a new data ID. */
+
+struct sieve_dict_script_cache_entry {
+	char *key;
+	time_t expires;
+
+	char *data_id;
+	char *data;
+};
+
+static HASH_TABLE(const char *, struct sieve_dict_script_cache_entry *)
+	sieve_dict_script_cache;
+
+static void
+sieve_dict_script_cache_entry_free(struct sieve_dict_script_cache_entry *entry)
+{
+	i_free(entry->key);
+	i_free(entry->data_id);
+	i_free(entry->data);
+	i_free(entry);
+}
+
+static void sieve_dict_script_cache_clear(void)
+{
+	struct hash_iterate_context *iter;
+	const char *key;
+	struct sieve_dict_script_cache_entry *entry;
+
+	iter = hash_table_iterate_init(sieve_dict_script_cache);
+	while ( hash_table_iterate(iter, sieve_dict_script_cache, &key, &entry) )
+		sieve_dict_script_cache_entry_free(entry);
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_clear(sieve_dict_script_cache, FALSE);
+}
+
+static void sieve_dict_script_cache_deinit(void)
+{
+	sieve_dict_script_cache_clear();
+	hash_table_destroy(&sieve_dict_script_cache);
+}
+
+static const char *
+sieve_dict_script_cache_key(struct sieve_dict_script *dscript)
+{
+	struct sieve_script *script = &dscript->script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+
+	return t_strconcat(dstorage->uri, "\n", dstorage->username, "\n",
+		script->name, NULL);
+}
+
+static struct sieve_dict_script_cache_entry *
+sieve_dict_script_cache_get(struct sieve_dict_script *dscript)
+{
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)dscript->script.storage;
+
+	if ( dstorage->cache_ttl == 0 ||
+		!hash_table_is_created(sieve_dict_script_cache) )
+		return NULL;
+
+	return hash_table_lookup(sieve_dict_script_cache,
+		sieve_dict_script_cache_key(dscript));
+}
+
+static bool sieve_dict_script_cache_is_valid(struct sieve_dict_script *dscript)
+{
+	struct sieve_dict_script_cache_entry *entry;
+
+	entry = sieve_dict_script_cache_get(dscript);
+	return ( entry != NULL && entry->expires > ioloop_time );
+}
+
+static void
+sieve_dict_script_cache_update(struct sieve_dict_script *dscript,
+	const char *data_id)
+{
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)dscript->script.storage;
+	struct sieve_dict_script_cache_entry *entry;
+	const char *key;
+
+	if ( dstorage->cache_ttl == 0 )
+		return;
+
+	if ( !hash_table_is_created(sieve_dict_script_cache) ) {
+		hash_table_create(&sieve_dict_script_cache, default_pool, 0,
+			str_hash, strcmp);
+		lib_atexit(sieve_dict_script_cache_deinit);
+	}
+
+	key = sieve_dict_script_cache_key(dscript);
+	entry = hash_table_lookup(sieve_dict_script_cache, key);
+	if ( entry == NULL ) {
+		if ( dstorage->cache_size > 0 &&
+			hash_table_count(sieve_dict_script_cache) >=
+				dstorage->cache_size )
+			sieve_dict_script_cache_clear();
+
+		entry = i_new(struct sieve_dict_script_cache_entry, 1);
+		entry->key = i_strdup(key);
+		hash_table_insert(sieve_dict_script_cache, entry->key, entry);
+	} else if ( strcmp(entry->data_id, data_id) != 0 ) {
+		/* Script changed */
+		i_free(entry->data_id);
+		i_free(entry->data);
+	}
+
+	if ( entry->data_id == NULL )
+		entry->data_id = i_strdup(data_id);
+	entry->expires = ioloop_time + dstorage->cache_ttl;
+}
+
+static void
+sieve_dict_script_cache_add_data(struct sieve_dict_script *dscript,
+	const char *data)
+{
+	struct sieve_dict_script_cache_entry *entry;
+
+	entry = sieve_dict_script_cache_get(dscript);
+	if ( entry == NULL || strcmp(entry->data_id, dscript->data_id) != 0 )
+		return;
+
+	i_free(entry->data);
+	entry->data = i_strdup(data);
+}
+
 /*
  * Script dict implementation
  */
@@ -58,10 +197,56 @@ static void sieve_dict_script_destroy(struct sieve_script *script)
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
 
+	/* The callback refers to the script */
+	if ( dscript->lookup_pending )
+		dict_wait(dscript->dict);
+
 	if ( dscript->data_pool != NULL )
 		pool_unref(&dscript->data_pool);
 }
 
+static void
+sieve_dict_script_lookup_callback(const struct dict_lookup_result *result,
+	struct sieve_dict_script *dscript)
+{
+	struct sieve_script *script = &dscript->script;
+
+	dscript->lookup_pending = FALSE;
+	dscript->lookup_finished = TRUE;
+	dscript->lookup_ret = result->ret;
+	if ( result->ret > 0 )
+		dscript->lookup_value = p_strdup(script->pool, result->value);
+	else if ( result->ret < 0 )
+		dscript->lookup_error = p_strdup(script->pool, result->error);
+}
+
+static void sieve_dict_script_open_begin(struct sieve_script *script)
+{
+	struct sieve_dict_script *dscript =
+		(struct sieve_dict_script *)script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+	enum sieve_error error;
+	const char *path;
+
+	if ( dscript->lookup_pending || dscript->lookup_finished )
+		return;
+	if ( sieve_dict_script_cache_is_valid(dscript) )
+		return;
+
+	/* Failures are reported by the subsequent open() */
+	if ( sieve_dict_storage_get_dict
+		(dstorage, &dscript->dict, &error) < 0 )
+		return;
+
+	path = t_strconcat
+		(DICT_SIEVE_NAME_PATH, dict_escape_string(script->name), NULL);
+
+	dscript->lookup_pending = TRUE;
+	dict_lookup_async(dscript->dict, path,
+		sieve_dict_script_lookup_callback, dscript);
+}
+
 static int sieve_dict_script_open
 (struct sieve_script *script, enum sieve_error *error_r)
 {
@@ -71,9 +256,19 @@ static int sieve_dict_script_open
 	struct sieve_dict_storage *dstorage =
 		(struct sieve_dict_storage *)storage;
 	const char *name = script->name;
+	struct sieve_dict_script_cache_entry *entry;
 	const char *path, *data_id, *error;
 	int ret;
 
+	entry = sieve_dict_script_cache_get(dscript);
+	if ( entry != NULL && entry->expires > ioloop_time ) {
+		e_debug(script->event,
+			"Using cached data ID `%s' for script `%s'",
+			entry->data_id, name);
+		dscript->data_id = p_strdup(script->pool, entry->data_id);
+		return 0;
+	}
+
 	if ( sieve_dict_storage_get_dict
 		(dstorage, &dscript->dict, error_r) < 0 )
 		return -1;
@@ -81,8 +276,18 @@ static int sieve_dict_script_open
 	path = t_strconcat
 		(DICT_SIEVE_NAME_PATH, dict_escape_string(name), NULL);
 
-	ret = dict_lookup
-		(dscript->dict, script->pool, path, &data_id, &error);
+	if ( dscript->lookup_pending )
+		dict_wait(dscript->dict);
+	if ( dscript->lookup_finished ) {
+		/* Result of the lookup started by open_begin() */
+		dscript->lookup_finished = FALSE;
+		ret = dscript->lookup_ret;
+		data_id = dscript->lookup_value;
+		error = dscript->lookup_error;
+	} else {
+		ret = dict_lookup
+			(dscript->dict, script->pool, path, &data_id, &error);
+	}
 	if ( ret <= 0 ) {
 		if ( ret < 0 ) {
 			sieve_script_set_critical(script,
@@ -100,6 +305,7 @@ static int sieve_dict_script_open
 	}
 
 	dscript->data_id = p_strdup(script->pool, data_id);
+	sieve_dict_script_cache_update(dscript, data_id);
 	return 0;
 }
 
@@ -109,9 +315,29 @@ static int sieve_dict_script_get_stream
 {
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+	struct sieve_dict_script_cache_entry *entry;
 	const char *path, *name = script->name, *data, *error;
 	int ret;
 
+	entry = sieve_dict_script_cache_get(dscript);
+	if ( entry != NULL && entry->data != NULL &&
+		strcmp(entry->data_id, dscript->data_id) == 0 ) {
+		e_debug(script->event,
+			"Using cached data with id `%s' for script `%s'",
+			dscript->data_id, name);
+		dscript->data = p_strdup(script->pool, entry->data);
+		*stream_r = i_stream_create_from_data
+			(dscript->data, strlen(dscript->data));
+		return 0;
+	}
+
+	/* The dict is not opened when the data ID came from the cache */
+	if ( sieve_dict_storage_get_dict
+		(dstorage, &dscript->dict, error_r) < 0 )
+		return -1;
+
 	dscript->data_pool =
 		pool_alloconly_create("sieve_dict_script data pool", 1024);
 
@@ -137,6 +363,7 @@ static int sieve_dict_script_get_stream
 	}
 	
 	dscript->data = p_strdup(script->pool, data);
+	sieve_dict_script_cache_add_data(dscript, dscript->data);
 	*stream_r = i_stream_create_from_data(dscript->data, strlen(dscript->data));
 	return 0;
 }
@@ -261,6 +488,7 @@ const struct sieve_script sieve_dict_script = {
 		.destroy = sieve_dict_script_destroy,
 
 		.open = sieve_dict_script_open,
+		.open_begin = sieve_dict_script_open_begin,
 
 		.get_stream = sieve_dict_script_get_stream,
 
@@ -281,6 +509,9 @@ const struct sieve_script sieve_dict_script = {
 struct sieve_dict_script_sequence {
 	struct sieve_script_sequence seq;
 
+	/* Script being opened in the background */
+	struct sieve_dict_script *dscript;
+
 	bool done:1;
 };
 
@@ -296,6 +527,12 @@ struct sieve_script_sequence *sieve_dict_storage_get_script_sequence
 	dseq = i_new(struct sieve_dict_script_sequence, 1);
 	sieve_script_sequence_init(&dseq->seq, storage);
 
+	/* Start the lookup right away, so that it proceeds concurrently
+	   with those of other sequences */
+	dseq->dscript = sieve_dict_script_init
+		((struct sieve_dict_storage *)storage, storage->script_name);
+	sieve_script_open_begin(&dseq->dscript->script);
+
 	return &dseq->seq;
 }
 
@@ -304,8 +541,6 @@ struct sieve_script *sieve_dict_script_sequence_next
 {
 	struct sieve_dict_script_sequence *dseq =
 		(struct sieve_dict_script_sequence *)seq;
-	struct sieve_dict_storage *dstorage =
-		(struct sieve_dict_storage *)seq->storage;
 	struct sieve_dict_script *dscript;
 
 	if ( error_r != NULL )
@@ -315,8 +550,8 @@ struct sieve_script *sieve_dict_script_sequence_next
 		return NULL;
 	dseq->done = TRUE;
 
-	dscript = sieve_dict_script_init
-		(dstorage, seq->storage->script_name);
+	dscript = dseq->dscript;
+	dseq->dscript = NULL;
 	if ( sieve_script_open(&dscript->script, error_r) < 0 ) {
 		struct sieve_script *script = &dscript->script;
 		sieve_script_unref(&script);
@@ -330,6 +565,10 @@ void sieve_dict_script_sequence_destroy(struct sieve_script_sequence *seq)
 {
 	struct sieve_dict_script_sequence *dseq =
 		(struct sieve_dict_script_sequence *)seq;
+	if ( dseq->dscript != NULL ) {
+		struct sieve_script *script = &dseq->dscript->script;
+		sieve_script_unref(&script);
+	}
 	i_free(dseq);
 }
 
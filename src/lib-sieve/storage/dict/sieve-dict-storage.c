@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "strnum.h"
 #include "dict.h"
 
 #include "sieve-common.h"
@@ -35,12 +36,28 @@ static int sieve_dict_storage_init
 	struct sieve_instance *svinst = storage->svinst;
 	const char *uri = storage->location, *username = NULL;
 
+	dstorage->cache_size = SIEVE_DICT_CACHE_DEFAULT_SIZE;
+
 	if ( options != NULL ) {
 		while ( *options != NULL ) {
 			const char *option = *options;
 
 			if ( strncasecmp(option, "user=", 5) == 0 && option[5] != '\0' ) {
 				username = option+5;
+			} else if ( strncasecmp(option, "cache_ttl=", 10) == 0 ) {
+				if ( str_to_uint(option+10, &dstorage->cache_ttl) < 0 ) {
+					sieve_storage_set_critical(storage,
+						"Invalid cache_ttl value `%s'", option+10);
+					*error_r = SIEVE_ERROR_TEMP_FAILURE;
+					return -1;
+				}
+			} else if ( strncasecmp(option, "cache_size=", 11) == 0 ) {
+				if ( str_to_uint(option+11, &dstorage->cache_size) < 0 ) {
+					sieve_storage_set_critical(storage,
+						"Invalid cache_size value `%s'", option+11);
+					*error_r = SIEVE_ERROR_TEMP_FAILURE;
+					return -1;
+				}
 			} else {
 				sieve_storage_set_critical(storage,
 					"Invalid option `%s'", option);
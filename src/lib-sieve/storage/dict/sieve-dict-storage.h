@@ -11,6 +11,8 @@
 
 #define SIEVE_DICT_SCRIPT_DEFAULT "default"
 
+#define SIEVE_DICT_CACHE_DEFAULT_SIZE 1000
+
 /*
  * Storage class
  */
@@ -21,6 +23,9 @@ struct sieve_dict_storage {
 	const char *username;
 	const char *uri;
 
+	/* Script cache (cache_ttl=0 disables it) */
+	unsigned int cache_ttl, cache_size;
+
 	struct dict *dict;
 };
 
@@ -47,6 +52,13 @@ struct sieve_dict_script {
 	const char *data;
 
 	const char *binpath;
+
+	/* Asynchronous lookup started by open_begin() */
+	int lookup_ret;
+	const char *lookup_value, *lookup_error;
+
+	bool lookup_pending:1;
+	bool lookup_finished:1;
 };
 
 struct sieve_dict_script *sieve_dict_script_init
@@ -571,12 +571,20 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 {
 	struct sieve_file_script *fscript =
 		(struct sieve_file_script *)script;
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)script->storage;
+	struct sieve_file_quota_index_lock *qlock;
+	const char *quota_paths[2];
 	int ret = 0;
 
 	if ( sieve_file_storage_pre_modify(script->storage) < 0 )
 		return -1;
 
+	quota_paths[0] = fscript->path;
+	quota_paths[1] = NULL;
+	qlock = sieve_file_storage_quota_index_lock(fstorage, quota_paths);
 	ret = unlink(fscript->path);
+	sieve_file_storage_quota_index_unlock(&qlock);
 	if ( ret < 0 ) {
 		if ( errno == ENOENT ) {
 			sieve_script_set_error(script,
@@ -680,7 +688,8 @@ static int sieve_file_storage_script_rename
 	struct sieve_storage *storage = script->storage;
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)storage;
-	const char *newpath, *newfile, *link_path;
+	struct sieve_file_quota_index_lock *qlock;
+	const char *newpath, *newfile, *link_path, *quota_paths[3];
 	int ret = 0;
 
 	if ( sieve_file_storage_pre_modify(storage) < 0 )
@@ -690,6 +699,11 @@ static int sieve_file_storage_script_rename
 		newfile = sieve_script_file_from_name(newname);
 		newpath = t_strconcat( fstorage->path, "/", newfile, NULL );
 
+		quota_paths[0] = fscript->path;
+		quota_paths[1] = newpath;
+		quota_paths[2] = NULL;
+		qlock = sieve_file_storage_quota_index_lock(fstorage, quota_paths);
+
 		/* The normal rename() system call overwrites the existing file without
 		 * notice. Also, active scripts must not be disrupted by renaming a script.
 		 * That is why we use a link(newpath) [activate newpath] unlink(oldpath)
@@ -747,6 +761,8 @@ static int sieve_file_storage_script_rename
 					"link(%s, %s) failed: %m", fscript->path, newpath);
 			}
 		}
+
+		sieve_file_storage_quota_index_unlock(&qlock);
 	} T_END;
 
 	return ret;
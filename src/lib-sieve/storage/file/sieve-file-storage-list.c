@@ -2,6 +2,8 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "hash.h"
 #include "str.h"
 #include "eacces-error.h"
 
@@ -13,69 +15,299 @@
 #include <stdio.h>
 #include <dirent.h>
 
-struct sieve_file_list_context {
-	struct sieve_storage_list_context context;
+/*
+ * Listing cache
+ */
+
+/* Script listings are cached per process, so that clients polling with
+   LISTSCRIPTS are served from memory. A cached listing is valid for as long as
+   the script directory and the active script link are unchanged, which is
+   determined from their stat() results. Listings of directories that changed
+   within the last second are not cached, since changes made within the
+   timestamp resolution would go unnoticed. */
+
+struct sieve_file_list_script {
+	const char *filename;
+	const char *name;
+};
+
+struct sieve_file_list_stamp {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime, ctime;
+	unsigned int mtime_nsec, ctime_nsec;
+};
+
+struct sieve_file_list_cache_entry {
 	pool_t pool;
+	int refcount;
+
+	const char *path;
+	struct sieve_file_list_stamp dir_stamp, link_stamp;
 
+	ARRAY(struct sieve_file_list_script) scripts;
 	const char *active;
-	const char *dir;
-	DIR *dirp;
 };
 
-struct sieve_storage_list_context *sieve_file_storage_list_init
-(struct sieve_storage *storage)
+static HASH_TABLE(const char *, struct sieve_file_list_cache_entry *)
+	sieve_file_list_cache;
+
+static void
+sieve_file_list_stamp_init(struct sieve_file_list_stamp *stamp,
+	const struct stat *st)
 {
-	struct sieve_file_storage *fstorage =
-		(struct sieve_file_storage *)storage;
-	struct sieve_file_list_context *flctx;
-	const char *active = NULL;
+	i_zero(stamp);
+	if ( st == NULL )
+		return;
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->mtime = st->st_mtime;
+	stamp->mtime_nsec = ST_MTIME_NSEC(*st);
+	stamp->ctime = st->st_ctime;
+	stamp->ctime_nsec = ST_CTIME_NSEC(*st);
+}
+
+static bool
+sieve_file_list_stamp_equals(const struct sieve_file_list_stamp *stamp1,
+	const struct sieve_file_list_stamp *stamp2)
+{
+	return ( stamp1->dev == stamp2->dev && stamp1->ino == stamp2->ino &&
+		stamp1->mtime == stamp2->mtime &&
+		stamp1->mtime_nsec == stamp2->mtime_nsec &&
+		stamp1->ctime == stamp2->ctime &&
+		stamp1->ctime_nsec == stamp2->ctime_nsec );
+}
+
+static void
+sieve_file_list_cache_entry_unref(struct sieve_file_list_cache_entry **_entry)
+{
+	struct sieve_file_list_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+
+	i_assert( entry->refcount > 0 );
+	if ( --entry->refcount > 0 )
+		return;
+	pool_unref(&entry->pool);
+}
+
+static void sieve_file_list_cache_clear(void)
+{
+	struct hash_iterate_context *iter;
+	const char *key;
+	struct sieve_file_list_cache_entry *entry;
+
+	iter = hash_table_iterate_init(sieve_file_list_cache);
+	while ( hash_table_iterate(iter, sieve_file_list_cache, &key, &entry) )
+		sieve_file_list_cache_entry_unref(&entry);
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_clear(sieve_file_list_cache, FALSE);
+}
+
+static void sieve_file_list_cache_deinit(void)
+{
+	sieve_file_list_cache_clear();
+	hash_table_destroy(&sieve_file_list_cache);
+}
+
+static void
+sieve_file_list_cache_put(struct sieve_file_list_cache_entry *entry)
+{
+	struct sieve_file_list_cache_entry *old_entry;
+
+	if ( !hash_table_is_created(sieve_file_list_cache) ) {
+		hash_table_create(&sieve_file_list_cache, default_pool, 0,
+			str_hash, strcmp);
+		lib_atexit(sieve_file_list_cache_deinit);
+	}
+
+	old_entry = hash_table_lookup(sieve_file_list_cache, entry->path);
+	if ( old_entry != NULL ) {
+		hash_table_remove(sieve_file_list_cache, entry->path);
+		sieve_file_list_cache_entry_unref(&old_entry);
+	} else if ( hash_table_count(sieve_file_list_cache) >=
+		SIEVE_FILE_LIST_CACHE_MAX_ENTRIES ) {
+		sieve_file_list_cache_clear();
+	}
+
+	entry->refcount++;
+	hash_table_insert(sieve_file_list_cache, entry->path, entry);
+}
+
+static struct sieve_file_list_cache_entry *
+sieve_file_list_cache_get(struct sieve_file_storage *fstorage,
+	const struct sieve_file_list_stamp *dir_stamp,
+	const struct sieve_file_list_stamp *link_stamp)
+{
+	struct sieve_file_list_cache_entry *entry;
+
+	if ( !hash_table_is_created(sieve_file_list_cache) )
+		return NULL;
+
+	entry = hash_table_lookup(sieve_file_list_cache, fstorage->path);
+	if ( entry == NULL ||
+		!sieve_file_list_stamp_equals(&entry->dir_stamp, dir_stamp) ||
+		!sieve_file_list_stamp_equals(&entry->link_stamp, link_stamp) )
+		return NULL;
+
+	entry->refcount++;
+	return entry;
+}
+
+/*
+ * Listing
+ */
+
+struct sieve_file_list_context {
+	struct sieve_storage_list_context context;
+
+	struct sieve_file_list_cache_entry *listing;
+	unsigned int index;
+	bool active_seen:1;
+};
+
+static void
+sieve_file_storage_list_set_error(struct sieve_storage *storage,
+	const char *func, const char *path)
+{
+	switch ( errno ) {
+	case ENOENT:
+		sieve_storage_set_error(storage,
+			SIEVE_ERROR_NOT_FOUND,
+			"Script storage not found");
+		break;
+	case EACCES:
+		sieve_storage_set_error(storage,
+			SIEVE_ERROR_NO_PERMISSION,
+			"Script storage not accessible");
+		e_error(storage->event, "Failed to list scripts: %s",
+			eacces_error_get(func, path));
+		break;
+	default:
+		sieve_storage_set_critical(storage,
+			"Failed to list scripts: "
+			"%s(%s) failed: %m", func, path);
+		break;
+	}
+}
+
+static struct sieve_file_list_cache_entry *
+sieve_file_storage_list_read(struct sieve_file_storage *fstorage)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_list_cache_entry *listing;
+	struct sieve_file_list_script *lscript;
+	const char *active = NULL, *scriptname;
+	struct dirent *dp;
 	pool_t pool;
 	DIR *dirp;
+	int ret;
 
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
-		switch ( errno ) {
-		case ENOENT:
-			sieve_storage_set_error(storage,
-				SIEVE_ERROR_NOT_FOUND,
-				"Script storage not found");
-			break;
-		case EACCES:
-			sieve_storage_set_error(storage,
-				SIEVE_ERROR_NO_PERMISSION,
-				"Script storage not accessible");
-			e_error(storage->event, "Failed to list scripts: %s",
-				eacces_error_get("opendir", fstorage->path));
-			break;
-		default:
-			sieve_storage_set_critical(storage,
-				"Failed to list scripts: "
-				"opendir(%s) failed: %m", fstorage->path);
-			break;
-		}
+		sieve_file_storage_list_set_error(storage,
+			"opendir", fstorage->path);
 		return NULL;
 	}
 
+	pool = pool_alloconly_create("sieve_file_list_cache_entry", 1024);
+	listing = p_new(pool, struct sieve_file_list_cache_entry, 1);
+	listing->pool = pool;
+	listing->refcount = 1;
+	listing->path = p_strdup(pool, fstorage->path);
+	p_array_init(&listing->scripts, pool, 16);
+
+	for (;;) {
+		if ( (dp = readdir(dirp)) == NULL )
+			break;
+
+		scriptname = sieve_script_file_get_scriptname(dp->d_name);
+		if ( scriptname == NULL )
+			continue;
+
+		/* Don't list our active sieve script link if the link
+		 * resides in the script dir (generally a bad idea).
+		 */
+		i_assert( fstorage->link_path != NULL );
+		if ( *(fstorage->link_path) == '\0' &&
+			strcmp(fstorage->active_fname, dp->d_name) == 0 )
+			continue;
+
+		lscript = array_append_space(&listing->scripts);
+		lscript->filename = p_strdup(pool, dp->d_name);
+		lscript->name = p_strdup(pool, scriptname);
+	}
+
+	if ( closedir(dirp) < 0) {
+		e_error(storage->event,
+			"closedir(%s) failed: %m", fstorage->path);
+	}
+
+	/* Get the name of the active script */
 	T_BEGIN {
-		/* Get the name of the active script */
-		if ( sieve_file_storage_active_script_get_file(fstorage, &active) < 0) {
-			flctx = NULL;
-		} else {
-			pool = pool_alloconly_create("sieve_file_list_context", 1024);
-			flctx = p_new(pool, struct sieve_file_list_context, 1);
-			flctx->pool = pool;
-			flctx->dirp = dirp;
-			flctx->active = ( active != NULL ? p_strdup(pool, active) : NULL );
-		}
+		ret = sieve_file_storage_active_script_get_file(fstorage, &active);
+		if ( ret >= 0 && active != NULL )
+			listing->active = p_strdup(pool, active);
 	} T_END;
 
-	if ( flctx == NULL ) {
-		if ( closedir(dirp) < 0) {
-			e_error(storage->event,
-				"closedir(%s) failed: %m", fstorage->path);	
-		}
+	if ( ret < 0 ) {
+		sieve_file_list_cache_entry_unref(&listing);
 		return NULL;
 	}
+	return listing;
+}
+
+struct sieve_storage_list_context *sieve_file_storage_list_init
+(struct sieve_storage *storage)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	struct sieve_file_list_context *flctx;
+	struct sieve_file_list_cache_entry *listing;
+	struct sieve_file_list_stamp dir_stamp, link_stamp;
+	struct stat st, lnk_st;
+	bool cacheable;
+
+	/* Check whether the cached listing is still valid */
+	if ( stat(fstorage->path, &st) < 0 ) {
+		sieve_file_storage_list_set_error(storage,
+			"stat", fstorage->path);
+		return NULL;
+	}
+	sieve_file_list_stamp_init(&dir_stamp, &st);
+	cacheable = ( st.st_mtime < ioloop_time - 1 &&
+		st.st_ctime < ioloop_time - 1 );
+
+	if ( fstorage->active_path != NULL &&
+		lstat(fstorage->active_path, &lnk_st) == 0 ) {
+		sieve_file_list_stamp_init(&link_stamp, &lnk_st);
+		if ( lnk_st.st_mtime >= ioloop_time - 1 ||
+			lnk_st.st_ctime >= ioloop_time - 1 )
+			cacheable = FALSE;
+	} else {
+		sieve_file_list_stamp_init(&link_stamp, NULL);
+		if ( fstorage->active_path != NULL && errno != ENOENT )
+			cacheable = FALSE;
+	}
+
+	listing = sieve_file_list_cache_get(fstorage, &dir_stamp, &link_stamp);
+	if ( listing != NULL ) {
+		e_debug(storage->event, "Using cached script listing");
+	} else {
+		listing = sieve_file_storage_list_read(fstorage);
+		if ( listing == NULL )
+			return NULL;
+
+		if ( cacheable ) {
+			listing->dir_stamp = dir_stamp;
+			listing->link_stamp = link_stamp;
+			sieve_file_list_cache_put(listing);
+		}
+	}
+
+	flctx = i_new(struct sieve_file_list_context, 1);
+	flctx->listing = listing;
 	return &flctx->context;
 }
 
@@ -84,57 +316,32 @@ const char *sieve_file_storage_list_next
 {
 	struct sieve_file_list_context *flctx =
 		(struct sieve_file_list_context *)ctx;
-	const struct sieve_file_storage *fstorage =
-		(const struct sieve_file_storage *)ctx->storage;
-	struct dirent *dp;
-	const char *scriptname;
+	struct sieve_file_list_cache_entry *listing = flctx->listing;
+	const struct sieve_file_list_script *lscript;
 
 	*active = FALSE;
 
-	for (;;) {
-		if ( (dp = readdir(flctx->dirp)) == NULL )
-			return NULL;
-
-		scriptname = sieve_script_file_get_scriptname(dp->d_name);
-		if (scriptname != NULL ) {
-			/* Don't list our active sieve script link if the link
-			 * resides in the script dir (generally a bad idea).
-			 */
-			i_assert( fstorage->link_path != NULL );
-			if ( *(fstorage->link_path) == '\0' &&
-				strcmp(fstorage->active_fname, dp->d_name) == 0 )
-				continue;
-
-			break;
-		}
-	}
+	if ( flctx->index >= array_count(&listing->scripts) )
+		return NULL;
+	lscript = array_idx(&listing->scripts, flctx->index++);
 
-	if ( flctx->active != NULL && strcmp(dp->d_name, flctx->active) == 0 ) {
+	if ( !flctx->active_seen && listing->active != NULL &&
+		strcmp(lscript->filename, listing->active) == 0 ) {
 		*active = TRUE;
-		flctx->active = NULL;
+		flctx->active_seen = TRUE;
 	}
 
-	return scriptname;
+	return lscript->name;
 }
 
 int sieve_file_storage_list_deinit(struct sieve_storage_list_context *lctx)
 {
 	struct sieve_file_list_context *flctx =
 		(struct sieve_file_list_context *)lctx;
-	const struct sieve_file_storage *fstorage =
-		(const struct sieve_file_storage *)lctx->storage;
 
-	if (closedir(flctx->dirp) < 0) {
-		e_error(lctx->storage->event,
-			"closedir(%s) failed: %m", fstorage->path);
-	}
-
-	pool_unref(&flctx->pool);
+	sieve_file_list_cache_entry_unref(&flctx->listing);
+	i_free(flctx);
 
 	// FIXME: return error here if something went wrong during listing
 	return 0;
 }
-
-
-
-
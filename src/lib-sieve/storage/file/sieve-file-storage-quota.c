@@ -2,7 +2,9 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
+#include "strnum.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
@@ -14,17 +16,131 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-int sieve_file_storage_quota_havespace
-(struct sieve_storage *storage, const char *scriptname, size_t size,
-	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+/*
+ * Quota index
+ */
+
+/* The number of scripts and their total size are recorded in a small index
+   file within the script directory, so that quota checks need not scan the
+   whole directory. The index is updated while holding a lock on it by all
+   operations that add, replace, remove or rename scripts. It is rebuilt by
+   scanning the directory when it is missing, unreadable or inconsistent, and
+   periodically to pick up changes made outside the storage API.
+
+   Format: "<version> <script count> <total size> <rebuild time>\n"
+ */
+
+#define SIEVE_FILE_QUOTA_INDEX_VERSION 1
+
+struct sieve_file_quota_index_file {
+	char *path;
+
+	bool existed;
+	uoff_t size;
+};
+
+struct sieve_file_quota_index_lock {
+	struct sieve_file_storage *fstorage;
+	int fd;
+
+	ARRAY(struct sieve_file_quota_index_file) files;
+
+	bool failed:1;
+};
+
+static int
+sieve_file_quota_index_file_stat(const char *path, bool *exists_r,
+	uoff_t *size_r)
 {
-	struct sieve_file_storage *fstorage =
-		(struct sieve_file_storage *)storage;
+	struct stat st;
+
+	*exists_r = FALSE;
+	*size_r = 0;
+	if ( stat(path, &st) < 0 )
+		return ( errno == ENOENT ? 0 : -1 );
+
+	*exists_r = TRUE;
+	*size_r = st.st_size;
+	return 0;
+}
+
+static int
+sieve_file_quota_index_read(struct sieve_file_quota_index_lock *qlock,
+	uint64_t *count_r, uint64_t *size_r, time_t *rebuild_time_r)
+{
+	struct sieve_storage *storage = &qlock->fstorage->storage;
+	const char *const *fields;
+	char buf[128];
+	unsigned int version;
+	uint64_t rebuild_time;
+	ssize_t ret;
+
+	ret = pread(qlock->fd, buf, sizeof(buf) - 1, 0);
+	if ( ret < 0 ) {
+		e_error(storage->event, "quota: "
+			"pread(%s) failed: %m",
+			sieve_file_storage_path_extend(qlock->fstorage,
+				SIEVE_FILE_QUOTA_INDEX_FNAME));
+		return -1;
+	}
+	if ( ret == 0 || buf[ret - 1] != '\n' )
+		return 0;
+	buf[ret - 1] = '\0';
+
+	fields = t_strsplit_spaces(buf, " ");
+	if ( str_array_length(fields) != 4 ||
+		str_to_uint(fields[0], &version) < 0 ||
+		version != SIEVE_FILE_QUOTA_INDEX_VERSION ||
+		str_to_uint64(fields[1], count_r) < 0 ||
+		str_to_uint64(fields[2], size_r) < 0 ||
+		str_to_uint64(fields[3], &rebuild_time) < 0 )
+		return 0;
+	*rebuild_time_r = (time_t)rebuild_time;
+
+	/* Rebuild periodically */
+	if ( *rebuild_time_r > ioloop_time ||
+		*rebuild_time_r + SIEVE_FILE_QUOTA_INDEX_MAX_AGE <= ioloop_time )
+		return 0;
+	return 1;
+}
+
+static void
+sieve_file_quota_index_write(struct sieve_file_quota_index_lock *qlock,
+	uint64_t count, uint64_t size, time_t rebuild_time)
+{
+	struct sieve_file_storage *fstorage = qlock->fstorage;
+	struct sieve_storage *storage = &fstorage->storage;
+	const char *data;
+	size_t data_len;
+
+	data = t_strdup_printf("%u %llu %llu %lld\n",
+		SIEVE_FILE_QUOTA_INDEX_VERSION,
+		(unsigned long long)count, (unsigned long long)size,
+		(long long)rebuild_time);
+	data_len = strlen(data);
+
+	/* A torn write fails to parse and merely causes a rebuild */
+	if ( pwrite(qlock->fd, data, data_len, 0) != (ssize_t)data_len ||
+		ftruncate(qlock->fd, data_len) < 0 ) {
+		e_error(storage->event, "quota: "
+			"Failed to write index %s: %m",
+			sieve_file_storage_path_extend(fstorage,
+				SIEVE_FILE_QUOTA_INDEX_FNAME));
+	}
+}
+
+static int
+sieve_file_quota_index_rebuild(struct sieve_file_quota_index_lock *qlock,
+	uint64_t *count_r, uint64_t *size_r)
+{
+	struct sieve_file_storage *fstorage = qlock->fstorage;
+	struct sieve_storage *storage = &fstorage->storage;
 	struct dirent *dp;
 	DIR *dirp;
-	uint64_t script_count = 1;
-	uint64_t script_storage = size;
-	int result = 1;
+	int result = 0;
+
+	*count_r = 0;
+	*size_r = 0;
 
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
@@ -35,8 +151,8 @@ int sieve_file_storage_quota_havespace
 
 	/* Scan all files */
 	for (;;) {
-		const char *name;
-		bool replaced = FALSE;
+		const char *name, *path;
+		struct stat st;
 
 		/* Read next entry */
 		errno = 0;
@@ -64,57 +180,269 @@ int sieve_file_storage_quota_havespace
 			strcmp(fstorage->active_fname, dp->d_name) == 0 )
 			continue;
 
-		if ( strcmp(name, scriptname) == 0 )
-			replaced = TRUE;
+		path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
+		if ( stat(path, &st) < 0 ) {
+			e_warning(storage->event,
+				  "quota: stat(%s) failed: %m", path);
+			continue;
+		}
 
-		/* Check count quota if necessary */
-		if ( storage->max_scripts > 0 ) {
-			if ( !replaced ) {
-				script_count++;
+		*count_r += 1;
+		*size_r += st.st_size;
+	}
 
-				if ( script_count > storage->max_scripts ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
-					*limit_r = storage->max_scripts;
-					result = 0;
-					break;
-				}
-			}
+	/* Close directory */
+	if ( closedir(dirp) < 0 ) {
+		sieve_storage_set_critical(storage,
+			"quota: closedir(%s) failed: %m", fstorage->path);
+	}
+
+	if ( result == 0 && qlock->fd != -1 ) {
+		e_debug(storage->event, "quota: "
+			"Rebuilt index: %llu scripts, %llu bytes",
+			(unsigned long long)*count_r, (unsigned long long)*size_r);
+		sieve_file_quota_index_write(qlock, *count_r, *size_r, ioloop_time);
+	}
+	return result;
+}
+
+static int
+sieve_file_quota_index_open(struct sieve_file_storage *fstorage,
+	short lock_type)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct flock fl;
+	const char *path;
+	int fd;
+
+	path = sieve_file_storage_path_extend(fstorage,
+		SIEVE_FILE_QUOTA_INDEX_FNAME);
+	fd = open(path, O_RDWR | O_CREAT, fstorage->file_create_mode);
+	if ( fd < 0 ) {
+		/* Quota checks fall back to scanning the directory */
+		if ( errno != ENOENT && errno != EACCES && errno != EROFS ) {
+			e_error(storage->event, "quota: "
+				"open(%s) failed: %m", path);
 		}
+		return -1;
+	}
 
-		/* Check storage quota if necessary */
-		if ( storage->max_storage > 0 ) {
-			const char *path;
-			struct stat st;
+	i_zero(&fl);
+	fl.l_type = lock_type;
+	fl.l_whence = SEEK_SET;
+	while ( fcntl(fd, F_SETLKW, &fl) < 0 ) {
+		if ( errno == EINTR )
+			continue;
+		e_error(storage->event, "quota: "
+			"fcntl(%s, F_SETLKW) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	return fd;
+}
 
-			path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
+static void
+sieve_file_quota_index_discard(struct sieve_file_storage *fstorage)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	const char *path;
 
-			if ( stat(path, &st) < 0 ) {
-				e_warning(storage->event,
-					  "quota: stat(%s) failed: %m", path);
-				continue;
-			}
+	/* An index left behind while quota is disabled would go stale */
+	path = sieve_file_storage_path_extend(fstorage,
+		SIEVE_FILE_QUOTA_INDEX_FNAME);
+	if ( unlink(path) < 0 && errno != ENOENT && errno != EACCES &&
+		errno != EROFS ) {
+		e_error(storage->event, "quota: "
+			"unlink(%s) failed: %m", path);
+	}
+}
+
+struct sieve_file_quota_index_lock *
+sieve_file_storage_quota_index_lock(struct sieve_file_storage *fstorage,
+	const char *const *paths)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_quota_index_lock *qlock;
+	struct sieve_file_quota_index_file *qfile;
+	int fd;
+
+	/* The index is only maintained when a quota is configured */
+	if ( storage->max_scripts == 0 && storage->max_storage == 0 ) {
+		sieve_file_quota_index_discard(fstorage);
+		return NULL;
+	}
+
+	fd = sieve_file_quota_index_open(fstorage, F_WRLCK);
+	if ( fd < 0 )
+		return NULL;
 
-			if ( !replaced ) {
-				script_storage += st.st_size;
+	qlock = i_new(struct sieve_file_quota_index_lock, 1);
+	qlock->fstorage = fstorage;
+	qlock->fd = fd;
+	i_array_init(&qlock->files, 2);
 
-				if ( script_storage > storage->max_storage ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
-					*limit_r = storage->max_storage;
-					result = 0;
-					break;
-				}
+	/* Record the state of the files about to be modified */
+	if ( paths != NULL ) {
+		for (; *paths != NULL; paths++) {
+			qfile = array_append_space(&qlock->files);
+			qfile->path = i_strdup(*paths);
+			if ( sieve_file_quota_index_file_stat
+				(qfile->path, &qfile->existed, &qfile->size) < 0 ) {
+				e_warning(storage->event, "quota: "
+					"stat(%s) failed: %m", qfile->path);
+				qlock->failed = TRUE;
 			}
 		}
 	}
+	return qlock;
+}
 
-	/* Close directory */
-	if ( closedir(dirp) < 0 ) {
-		sieve_storage_set_critical(storage,
-			"quota: closedir(%s) failed: %m", fstorage->path);
+void sieve_file_storage_quota_index_unlock
+(struct sieve_file_quota_index_lock **_qlock)
+{
+	struct sieve_file_quota_index_lock *qlock = *_qlock;
+	struct sieve_storage *storage;
+	struct sieve_file_quota_index_file *qfile;
+	int64_t count_diff = 0, size_diff = 0;
+	uint64_t count, size;
+	time_t rebuild_time;
+	bool exists, valid;
+	uoff_t fsize;
+
+	*_qlock = NULL;
+	if ( qlock == NULL )
+		return;
+	storage = &qlock->fstorage->storage;
+	valid = !qlock->failed;
+
+	/* Account for the changes made to the files */
+	array_foreach_modifiable(&qlock->files, qfile) {
+		if ( sieve_file_quota_index_file_stat
+			(qfile->path, &exists, &fsize) < 0 ) {
+			e_warning(storage->event, "quota: "
+				"stat(%s) failed: %m", qfile->path);
+			valid = FALSE;
+		}
+		count_diff += (int64_t)exists - (int64_t)qfile->existed;
+		size_diff += (int64_t)fsize - (int64_t)qfile->size;
+		i_free(qfile->path);
 	}
-	return result;
+
+	if ( count_diff != 0 || size_diff != 0 || !valid ) T_BEGIN {
+		if ( valid && sieve_file_quota_index_read
+				(qlock, &count, &size, &rebuild_time) > 0 &&
+			(count_diff >= 0 || count >= (uint64_t)-count_diff) &&
+			(size_diff >= 0 || size >= (uint64_t)-size_diff) ) {
+			sieve_file_quota_index_write(qlock,
+				count + count_diff, size + size_diff, rebuild_time);
+		} else {
+			/* Inconsistent; rebuild upon next check */
+			if ( ftruncate(qlock->fd, 0) < 0 ) {
+				e_error(storage->event, "quota: "
+					"ftruncate(%s) failed: %m",
+					sieve_file_storage_path_extend(qlock->fstorage,
+						SIEVE_FILE_QUOTA_INDEX_FNAME));
+			}
+		}
+	} T_END;
+
+	/* Closing the fd releases the lock */
+	i_close_fd(&qlock->fd);
+	array_free(&qlock->files);
+	i_free(qlock);
+}
+
+/*
+ * Quota checking
+ */
+
+static int
+sieve_file_storage_quota_get(struct sieve_file_storage *fstorage,
+	uint64_t *count_r, uint64_t *size_r)
+{
+	struct sieve_file_quota_index_lock qlock;
+	time_t rebuild_time;
+	int ret;
+
+	i_zero(&qlock);
+	qlock.fstorage = fstorage;
+
+	/* Reading the index only needs a shared lock */
+	qlock.fd = sieve_file_quota_index_open(fstorage, F_RDLCK);
+	if ( qlock.fd >= 0 ) {
+		T_BEGIN {
+			ret = sieve_file_quota_index_read
+				(&qlock, count_r, size_r, &rebuild_time);
+		} T_END;
+		i_close_fd(&qlock.fd);
+		if ( ret > 0 )
+			return 0;
+
+		/* Rebuild it while holding an exclusive lock */
+		qlock.fd = sieve_file_quota_index_open(fstorage, F_WRLCK);
+	}
+	if ( qlock.fd < 0 ) {
+		/* No index available; just scan the directory */
+		return sieve_file_quota_index_rebuild(&qlock, count_r, size_r);
+	}
+
+	T_BEGIN {
+		/* Another process may have rebuilt it in the meantime */
+		ret = sieve_file_quota_index_read
+			(&qlock, count_r, size_r, &rebuild_time);
+		if ( ret <= 0 )
+			ret = sieve_file_quota_index_rebuild(&qlock, count_r, size_r);
+		else
+			ret = 0;
+	} T_END;
+
+	/* Closing the fd releases the lock */
+	i_close_fd(&qlock.fd);
+	return ret;
 }
 
+int sieve_file_storage_quota_havespace
+(struct sieve_storage *storage, const char *scriptname, size_t size,
+	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	uint64_t script_count, script_storage;
+	const char *path;
+	bool replaced;
+	uoff_t old_size;
 
+	if ( sieve_file_storage_quota_get
+		(fstorage, &script_count, &script_storage) < 0 )
+		return -1;
 
+	/* A replaced script does not count */
+	path = t_strconcat(fstorage->path, "/",
+		sieve_script_file_from_name(scriptname), NULL);
+	if ( sieve_file_quota_index_file_stat(path, &replaced, &old_size) < 0 ) {
+		e_warning(storage->event,
+			  "quota: stat(%s) failed: %m", path);
+	}
+	if ( replaced ) {
+		if ( script_count > 0 )
+			script_count--;
+		script_storage -= I_MIN(script_storage, old_size);
+	}
+
+	/* Check count quota if necessary */
+	if ( storage->max_scripts > 0 &&
+		script_count + 1 > storage->max_scripts ) {
+		*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
+		*limit_r = storage->max_scripts;
+		return 0;
+	}
 
+	/* Check storage quota if necessary */
+	if ( storage->max_storage > 0 &&
+		script_storage + size > storage->max_storage ) {
+		*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
+		*limit_r = storage->max_storage;
+		return 0;
+	}
+	return 1;
+}
@@ -398,7 +398,8 @@ int sieve_file_storage_save_commit
 	struct sieve_storage *storage = sctx->storage;
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)sctx->storage;
-	const char *dest_path;
+	struct sieve_file_quota_index_lock *qlock;
+	const char *dest_path, *quota_paths[2];
 	bool failed = FALSE;
 
 	i_assert(fsctx->output == NULL);
@@ -407,7 +408,12 @@ int sieve_file_storage_save_commit
 		dest_path = t_strconcat(fstorage->path, "/",
 			sieve_script_file_from_name(sctx->scriptname), NULL);
 
+		quota_paths[0] = dest_path;
+		quota_paths[1] = NULL;
+		qlock = sieve_file_storage_quota_index_lock(fstorage, quota_paths);
 		failed = ( sieve_file_storage_script_move(fsctx, dest_path) < 0 );
+		sieve_file_storage_quota_index_unlock(&qlock);
+
 		if ( sctx->mtime != (time_t)-1 )
 			sieve_file_storage_update_mtime(storage, dest_path, sctx->mtime);
 	} T_END;
@@ -505,8 +511,10 @@ int sieve_file_storage_save_as
 {
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)storage;
+	struct sieve_file_quota_index_lock *qlock;
 	string_t *temp_path;
-	const char *dest_path;
+	const char *dest_path, *quota_paths[2];
+	int ret;
 
 	temp_path = t_str_new(256);
 	str_append(temp_path, fstorage->path);
@@ -517,8 +525,13 @@ int sieve_file_storage_save_as
 	dest_path = t_strconcat(fstorage->path, "/",
 		sieve_script_file_from_name(name), NULL);
 
-	return sieve_file_storage_save_to
+	quota_paths[0] = dest_path;
+	quota_paths[1] = NULL;
+	qlock = sieve_file_storage_quota_index_lock(fstorage, quota_paths);
+	ret = sieve_file_storage_save_to
 		(fstorage, temp_path, input, dest_path);
+	sieve_file_storage_quota_index_unlock(&qlock);
+	return ret;
 }
 
 int sieve_file_storage_save_as_active
@@ -20,6 +20,14 @@
 /* Delete files having ctime older than this from tmp/. 36h is standard. */
 #define SIEVE_FILE_STORAGE_TMP_DELETE_SECS (36*60*60)
 
+/* Name of the quota index file within the script directory */
+#define SIEVE_FILE_QUOTA_INDEX_FNAME ".dovecot-sieve-quota"
+/* Rebuild the quota index at least this often */
+#define SIEVE_FILE_QUOTA_INDEX_MAX_AGE (60*60)
+
+/* Maximum number of script listings cached per process */
+#define SIEVE_FILE_LIST_CACHE_MAX_ENTRIES 1000
+
 /*
  * Storage class
  */
@@ -111,6 +119,16 @@ int sieve_file_storage_save_as_active
 
 /* Quota */
 
+/* Locks the quota index and records the state of the listed script files
+   (NULL-terminated), which are about to be modified. Unlocking accounts for
+   the changes made to these files in the meantime. Returns NULL when no index
+   is available. */
+struct sieve_file_quota_index_lock *
+sieve_file_storage_quota_index_lock(struct sieve_file_storage *fstorage,
+	const char *const *paths);
+void sieve_file_storage_quota_index_unlock
+	(struct sieve_file_quota_index_lock **_qlock);
+
 int sieve_file_storage_quota_havespace
 (struct sieve_storage *storage, const char *scriptname, size_t size,
 	enum sieve_storage_quota *quota_r, uint64_t *limit_r);
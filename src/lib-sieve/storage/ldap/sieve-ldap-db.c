@@ -1083,6 +1083,213 @@ static void sieve_ldap_db_script_free(unsigned char *script)
 	i_free(script);
 }
 
+/*
+ * Cache
+ */
+
+/* Results of script lookups and script reads are cached per process, so that
+   all deliveries handled by a (LMTP) process share them. Lookup results are
+   keyed by configuration, user and script name; script bodies are keyed by
+   configuration, DN and modified attribute, which means that a changed script
+   is fetched anew as soon as its lookup result is refreshed. */
+
+struct sieve_ldap_db_cache_entry {
+	char *key;
+	time_t expires;
+
+	/* Lookup result (dn == NULL means not found) */
+	char *dn, *modattr;
+
+	/* Script body */
+	unsigned char *data;
+	size_t size;
+};
+
+static HASH_TABLE(const char *, struct sieve_ldap_db_cache_entry *)
+	sieve_ldap_db_cache;
+
+static void
+sieve_ldap_db_cache_entry_free(struct sieve_ldap_db_cache_entry *entry)
+{
+	i_free(entry->key);
+	i_free(entry->dn);
+	i_free(entry->modattr);
+	i_free(entry->data);
+	i_free(entry);
+}
+
+static void sieve_ldap_db_cache_clear(void)
+{
+	struct hash_iterate_context *iter;
+	const char *key;
+	struct sieve_ldap_db_cache_entry *entry;
+
+	iter = hash_table_iterate_init(sieve_ldap_db_cache);
+	while (hash_table_iterate(iter, sieve_ldap_db_cache, &key, &entry))
+		sieve_ldap_db_cache_entry_free(entry);
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_clear(sieve_ldap_db_cache, FALSE);
+}
+
+static void sieve_ldap_db_cache_deinit(void)
+{
+	sieve_ldap_db_cache_clear();
+	hash_table_destroy(&sieve_ldap_db_cache);
+}
+
+static const char *
+sieve_ldap_db_cache_lookup_key(struct ldap_connection *conn, const char *name)
+{
+	struct sieve_ldap_storage *lstorage = conn->lstorage;
+
+	return t_strconcat("L", lstorage->config_file, "\n",
+			   lstorage->username, "\n", name, NULL);
+}
+
+static const char *
+sieve_ldap_db_cache_script_key(struct ldap_connection *conn,
+	const char *dn, const char *modattr)
+{
+	return t_strconcat("S", conn->lstorage->config_file, "\n",
+			   dn, "\n", modattr, NULL);
+}
+
+static struct sieve_ldap_db_cache_entry *
+sieve_ldap_db_cache_get(const char *key)
+{
+	struct sieve_ldap_db_cache_entry *entry;
+
+	if (!hash_table_is_created(sieve_ldap_db_cache))
+		return NULL;
+
+	entry = hash_table_lookup(sieve_ldap_db_cache, key);
+	if (entry == NULL)
+		return NULL;
+	if (entry->expires <= ioloop_time) {
+		hash_table_remove(sieve_ldap_db_cache, key);
+		sieve_ldap_db_cache_entry_free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+static struct sieve_ldap_db_cache_entry *
+sieve_ldap_db_cache_put(struct ldap_connection *conn, const char *key,
+	unsigned int ttl)
+{
+	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	struct sieve_ldap_db_cache_entry *entry;
+
+	if (!hash_table_is_created(sieve_ldap_db_cache)) {
+		hash_table_create(&sieve_ldap_db_cache, default_pool, 0,
+				  str_hash, strcmp);
+		lib_atexit(sieve_ldap_db_cache_deinit);
+	}
+
+	entry = hash_table_lookup(sieve_ldap_db_cache, key);
+	if (entry != NULL) {
+		hash_table_remove(sieve_ldap_db_cache, key);
+		sieve_ldap_db_cache_entry_free(entry);
+	} else if (set->sieve_ldap_cache_size > 0 &&
+		   hash_table_count(sieve_ldap_db_cache) >=
+		   set->sieve_ldap_cache_size) {
+		sieve_ldap_db_cache_clear();
+	}
+
+	entry = i_new(struct sieve_ldap_db_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->expires = ioloop_time + ttl;
+	hash_table_insert(sieve_ldap_db_cache, entry->key, entry);
+	return entry;
+}
+
+static void
+sieve_ldap_db_cache_add_lookup(struct ldap_connection *conn,
+	const char *name, const char *dn, const char *modattr)
+{
+	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	struct sieve_ldap_db_cache_entry *entry;
+	unsigned int ttl;
+
+	ttl = (dn == NULL ?
+	       set->sieve_ldap_cache_negative_ttl : set->sieve_ldap_cache_ttl);
+	if (ttl == 0)
+		return;
+
+	entry = sieve_ldap_db_cache_put(conn,
+		sieve_ldap_db_cache_lookup_key(conn, name), ttl);
+	entry->dn = i_strdup(dn);
+	entry->modattr = i_strdup(modattr);
+}
+
+static void
+sieve_ldap_db_cache_add_script(struct ldap_connection *conn,
+	const char *dn, const char *modattr,
+	const unsigned char *data, size_t size)
+{
+	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	struct sieve_ldap_db_cache_entry *entry;
+
+	/* Without a modified attribute, changes cannot be detected */
+	if (set->sieve_ldap_cache_ttl == 0 ||
+	    modattr == NULL || *modattr == '\0')
+		return;
+
+	entry = sieve_ldap_db_cache_put(conn,
+		sieve_ldap_db_cache_script_key(conn, dn, modattr),
+		set->sieve_ldap_cache_ttl);
+	entry->data = i_malloc(I_MAX(size, 1));
+	memcpy(entry->data, data, size);
+	entry->size = size;
+}
+
+int sieve_ldap_db_cache_lookup_script(struct ldap_connection *conn,
+	const char *name, const char **dn_r, const char **modattr_r)
+{
+	struct sieve_storage *storage = &conn->lstorage->storage;
+	struct sieve_ldap_db_cache_entry *entry;
+
+	entry = sieve_ldap_db_cache_get(
+		sieve_ldap_db_cache_lookup_key(conn, name));
+	if (entry == NULL)
+		return -1;
+
+	e_debug(storage->event, "db: "
+		"Using cached lookup result for script `%s'", name);
+
+	*dn_r = t_strdup(entry->dn);
+	*modattr_r = t_strdup(entry->modattr);
+	return (*dn_r == NULL ? 0 : 1);
+}
+
+int sieve_ldap_db_cache_read_script(struct ldap_connection *conn,
+	const char *dn, const char *modattr, struct istream **script_r)
+{
+	struct sieve_storage *storage = &conn->lstorage->storage;
+	struct sieve_ldap_db_cache_entry *entry;
+	unsigned char *data;
+
+	if (modattr == NULL || *modattr == '\0')
+		return -1;
+
+	entry = sieve_ldap_db_cache_get(
+		sieve_ldap_db_cache_script_key(conn, dn, modattr));
+	if (entry == NULL)
+		return -1;
+
+	e_debug(storage->event, "db: "
+		"Using cached script with length %zu", entry->size);
+
+	/* The cache entry may be dropped while the stream is still in use */
+	data = i_malloc(I_MAX(entry->size, 1));
+	memcpy(data, entry->data, entry->size);
+	*script_r = i_stream_create_from_data(data, entry->size);
+	i_stream_add_destroy_callback(*script_r,
+		sieve_ldap_db_script_free, data);
+	return 1;
+}
+
 static int
 sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
 	LDAPMessage *entry, pool_t pool, const char **modattr_r)
@@ -1123,7 +1330,7 @@ sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
 
 static int
 sieve_ldap_db_get_script(struct ldap_connection *conn,
-	LDAPMessage *entry, struct istream **script_r)
+	LDAPMessage *entry, unsigned char **data_r, size_t *size_r)
 {
 	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
 	struct sieve_storage *storage = &conn->lstorage->storage;
@@ -1157,9 +1364,8 @@ sieve_ldap_db_get_script(struct ldap_connection *conn,
 			ldap_value_free_len(vals);
 			ldap_memfree(attr);
 
-			*script_r = i_stream_create_from_data(data, size);
-			i_stream_add_destroy_callback
-				(*script_r,	sieve_ldap_db_script_free, data);
+			*data_r = data;
+			*size_r = size;
 			return 1;
 		}
 		ldap_memfree(attr);
@@ -1210,9 +1416,14 @@ db_ldap_get_var_expand_table(struct ldap_connection *conn,
 struct sieve_ldap_script_lookup_request {
 	struct ldap_request request;
 
+	const char *name;
+
 	unsigned int entries;
 	const char *result_dn;
 	const char *result_modattr;
+
+	bool failed:1;
+	bool finished:1;
 };
 
 static void
@@ -1224,7 +1435,10 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 		(struct sieve_ldap_script_lookup_request *)request;
 
 	if (res == NULL) {
-		io_loop_stop(conn->ioloop);
+		srequest->failed = TRUE;
+		srequest->finished = TRUE;
+		if (conn->ioloop != NULL)
+			io_loop_stop(conn->ioloop);
 		return;
 	}
 
@@ -1240,13 +1454,16 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 				  "using only the first one.");
 		}
 	} else {
-		io_loop_stop(conn->ioloop);
+		srequest->finished = TRUE;
+		if (conn->ioloop != NULL)
+			io_loop_stop(conn->ioloop);
 		return;
 	}
 }
 
-int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
-	const char *name, const char **dn_r, const char **modattr_r)
+struct sieve_ldap_script_lookup_request *
+sieve_ldap_db_lookup_script_begin(struct ldap_connection *conn,
+	const char *name)
 {
 	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_storage *storage = &lstorage->storage;
@@ -1261,6 +1478,7 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 		("sieve_ldap_script_lookup_request", 512);
 	request = p_new(pool, struct sieve_ldap_script_lookup_request, 1);
 	request->request.pool = pool;
+	request->name = p_strdup(pool, name);
 
 	tab = db_ldap_get_var_expand_table(conn, name);
 
@@ -1269,7 +1487,8 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 		e_error(storage->event, "db: "
 			"Failed to expand base=%s: %s",
 			set->base, error);
-		return -1;
+		pool_unref(&pool);
+		return NULL;
 	}
 	request->request.base = p_strdup(pool, str_c(str));
 
@@ -1281,7 +1500,8 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 		e_error(storage->event, "db: "
 			"Failed to expand sieve_ldap_filter=%s: %s",
 			set->sieve_ldap_filter, error);
-		return -1;
+		pool_unref(&pool);
+		return NULL;
 	}
 
 	request->request.scope = lstorage->set.ldap_scope;
@@ -1295,19 +1515,50 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 
 	request->request.callback = sieve_ldap_lookup_script_callback;
 	db_ldap_request(conn, &request->request);
-	db_ldap_wait(conn);
+	return request;
+}
+
+int sieve_ldap_db_lookup_script_finish(struct ldap_connection *conn,
+	struct sieve_ldap_script_lookup_request **_request,
+	const char **dn_r, const char **modattr_r)
+{
+	struct sieve_ldap_script_lookup_request *request = *_request;
+
+	*_request = NULL;
+
+	/* Waits for all requests issued on this connection */
+	if (!request->finished)
+		db_ldap_wait(conn);
+	i_assert(request->finished);
 
 	*dn_r = t_strdup(request->result_dn);
 	*modattr_r = t_strdup(request->result_modattr);
+	if (!request->failed) {
+		sieve_ldap_db_cache_add_lookup(conn, request->name,
+					       *dn_r, *modattr_r);
+	}
 	pool_unref(&request->request.pool);
 	return (*dn_r == NULL ? 0 : 1);
 }
 
+int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
+	const char *name, const char **dn_r, const char **modattr_r)
+{
+	struct sieve_ldap_script_lookup_request *request;
+
+	request = sieve_ldap_db_lookup_script_begin(conn, name);
+	if (request == NULL)
+		return -1;
+	return sieve_ldap_db_lookup_script_finish(conn, &request,
+						  dn_r, modattr_r);
+}
+
 struct sieve_ldap_script_read_request {
 	struct ldap_request request;
 
 	unsigned int entries;
-	struct istream *result;
+	unsigned char *result;
+	size_t result_size;
 };
 
 static void
@@ -1319,28 +1570,31 @@ sieve_ldap_read_script_callback(struct ldap_connection *conn,
 		(struct sieve_ldap_script_read_request *)request;
 
 	if (res == NULL) {
-		io_loop_stop(conn->ioloop);
+		if (conn->ioloop != NULL)
+			io_loop_stop(conn->ioloop);
 		return;
 	}
 
 	if (ldap_msgtype(res) != LDAP_RES_SEARCH_RESULT) {
 
 		if (srequest->result == NULL) {
-			(void)sieve_ldap_db_get_script(conn, res, &srequest->result);
+			(void)sieve_ldap_db_get_script(conn, res,
+				&srequest->result, &srequest->result_size);
 		} else {
 			e_error(storage->event, "db: "
 				"Search returned more than one entry for Sieve script DN");
-			i_stream_unref(&srequest->result);
+			i_free(srequest->result);
 		}
 
 	} else {
-		io_loop_stop(conn->ioloop);
+		if (conn->ioloop != NULL)
+			io_loop_stop(conn->ioloop);
 		return;
 	}
 }
 
 int sieve_ldap_db_read_script(struct ldap_connection *conn,
-	const char *dn, struct istream **script_r)
+	const char *dn, const char *modattr, struct istream **script_r)
 {
 	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_storage *storage = &lstorage->storage;
@@ -1369,7 +1623,15 @@ int sieve_ldap_db_read_script(struct ldap_connection *conn,
 	db_ldap_request(conn, &request->request);
 	db_ldap_wait(conn);
 
-	*script_r = request->result;
+	*script_r = NULL;
+	if (request->result != NULL) {
+		sieve_ldap_db_cache_add_script(conn, dn, modattr,
+			request->result, request->result_size);
+		*script_r = i_stream_create_from_data(
+			request->result, request->result_size);
+		i_stream_add_destroy_callback(*script_r,
+			sieve_ldap_db_script_free, request->result);
+	}
 	pool_unref(&request->request.pool);
 	return (*script_r == NULL ? 0 : 1);
 }
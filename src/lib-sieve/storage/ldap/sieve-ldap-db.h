@@ -49,6 +49,7 @@
 
 struct ldap_connection;
 struct ldap_request;
+struct sieve_ldap_script_lookup_request;
 
 typedef void db_search_callback_t(struct ldap_connection *conn,
 				  struct ldap_request *request,
@@ -134,7 +135,22 @@ void sieve_ldap_db_unref(struct ldap_connection **conn);
 
 int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 	const char *name, const char **dn_r, const char **modattr_r);
+
+/* Asynchronous lookup: the request is sent right away, but the result is only
+   collected by _finish(), which waits for it if necessary */
+struct sieve_ldap_script_lookup_request *
+sieve_ldap_db_lookup_script_begin(struct ldap_connection *conn,
+	const char *name);
+int sieve_ldap_db_lookup_script_finish(struct ldap_connection *conn,
+	struct sieve_ldap_script_lookup_request **_request,
+	const char **dn_r, const char **modattr_r);
 int sieve_ldap_db_read_script(struct ldap_connection *conn,
-	const char *dn, struct istream **script_r);
+	const char *dn, const char *modattr, struct istream **script_r);
+
+/* Cache: return -1 when the result is not cached */
+int sieve_ldap_db_cache_lookup_script(struct ldap_connection *conn,
+	const char *name, const char **dn_r, const char **modattr_r);
+int sieve_ldap_db_cache_read_script(struct ldap_connection *conn,
+	const char *dn, const char *modattr, struct istream **script_r);
 
 #endif
@@ -54,6 +54,43 @@ struct sieve_ldap_script *sieve_ldap_script_init
 	return lscript;
 }
 
+static void sieve_ldap_script_destroy(struct sieve_script *script)
+{
+	struct sieve_ldap_script *lscript =
+		(struct sieve_ldap_script *)script;
+	struct sieve_ldap_storage *lstorage =
+		(struct sieve_ldap_storage *)script->storage;
+	const char *dn, *modattr;
+
+	/* The pending request cannot be abandoned */
+	if ( lscript->lookup != NULL ) T_BEGIN {
+		(void)sieve_ldap_db_lookup_script_finish(lstorage->conn,
+			&lscript->lookup, &dn, &modattr);
+	} T_END;
+}
+
+static void sieve_ldap_script_open_begin(struct sieve_script *script)
+{
+	struct sieve_ldap_script *lscript =
+		(struct sieve_ldap_script *)script;
+	struct sieve_ldap_storage *lstorage =
+		(struct sieve_ldap_storage *)script->storage;
+	const char *dn, *modattr;
+
+	if ( lscript->lookup != NULL )
+		return;
+	if ( sieve_ldap_db_cache_lookup_script(lstorage->conn,
+		script->name, &dn, &modattr) >= 0 )
+		return;
+
+	/* Connection failures are reported by the subsequent open() */
+	if ( sieve_ldap_db_connect(lstorage->conn) < 0 )
+		return;
+
+	lscript->lookup = sieve_ldap_db_lookup_script_begin(
+		lstorage->conn, script->name);
+}
+
 static int sieve_ldap_script_open
 (struct sieve_script *script, enum sieve_error *error_r)
 {
@@ -64,15 +101,25 @@ static int sieve_ldap_script_open
 		(struct sieve_ldap_storage *)storage;
 	int ret;
 
-	if ( sieve_ldap_db_connect(lstorage->conn) < 0 ) {
-		sieve_storage_set_critical(storage,
-			"Failed to connect to LDAP database");
-		*error_r = storage->error_code;
-		return -1;
+	if ( lscript->lookup != NULL ) {
+		ret = sieve_ldap_db_lookup_script_finish(lstorage->conn,
+			&lscript->lookup, &lscript->dn, &lscript->modattr);
+	} else {
+		ret = sieve_ldap_db_cache_lookup_script(lstorage->conn,
+			script->name, &lscript->dn, &lscript->modattr);
 	}
+	if ( ret < 0 ) {
+		if ( sieve_ldap_db_connect(lstorage->conn) < 0 ) {
+			sieve_storage_set_critical(storage,
+				"Failed to connect to LDAP database");
+			*error_r = storage->error_code;
+			return -1;
+		}
 
-	if ( (ret=sieve_ldap_db_lookup_script(lstorage->conn,
-		script->name, &lscript->dn, &lscript->modattr)) <= 0 ) {
+		ret = sieve_ldap_db_lookup_script(lstorage->conn,
+			script->name, &lscript->dn, &lscript->modattr);
+	}
+	if ( ret <= 0 ) {
 		if ( ret == 0 ) {
 			e_debug(script->event, "Script entry not found");
 			sieve_script_set_error(script,
@@ -101,8 +148,20 @@ static int sieve_ldap_script_get_stream
 
 	i_assert(lscript->dn != NULL);
 
-	if ( (ret=sieve_ldap_db_read_script(
-		lstorage->conn, lscript->dn, stream_r)) <= 0 ) {
+	ret = sieve_ldap_db_cache_read_script(lstorage->conn,
+		lscript->dn, lscript->modattr, stream_r);
+	if ( ret < 0 ) {
+		if ( sieve_ldap_db_connect(lstorage->conn) < 0 ) {
+			sieve_storage_set_critical(storage,
+				"Failed to connect to LDAP database");
+			*error_r = storage->error_code;
+			return -1;
+		}
+
+		ret = sieve_ldap_db_read_script(lstorage->conn,
+			lscript->dn, lscript->modattr, stream_r);
+	}
+	if ( ret <= 0 ) {
 		if ( ret == 0 ) {
 			e_debug(script->event, "Script attribute not found");
 			sieve_script_set_error(script,
@@ -291,7 +350,10 @@ static bool sieve_ldap_script_equals
 const struct sieve_script sieve_ldap_script = {
 	.driver_name = SIEVE_LDAP_STORAGE_DRIVER_NAME,
 	.v = {
+		.destroy = sieve_ldap_script_destroy,
+
 		.open = sieve_ldap_script_open,
+		.open_begin = sieve_ldap_script_open_begin,
 
 		.get_stream = sieve_ldap_script_get_stream,
 
@@ -312,6 +374,9 @@ const struct sieve_script sieve_ldap_script = {
 struct sieve_ldap_script_sequence {
 	struct sieve_script_sequence seq;
 
+	/* Script being opened in the background */
+	struct sieve_ldap_script *lscript;
+
 	bool done:1;
 };
 
@@ -327,6 +392,12 @@ struct sieve_script_sequence *sieve_ldap_storage_get_script_sequence
 	lsec = i_new(struct sieve_ldap_script_sequence, 1);
 	sieve_script_sequence_init(&lsec->seq, storage);
 
+	/* Start the lookup right away, so that it proceeds concurrently
+	   with those of other sequences */
+	lsec->lscript = sieve_ldap_script_init
+		((struct sieve_ldap_storage *)storage, storage->script_name);
+	sieve_script_open_begin(&lsec->lscript->script);
+
 	return &lsec->seq;
 }
 
@@ -335,8 +406,6 @@ struct sieve_script *sieve_ldap_script_sequence_next
 {
 	struct sieve_ldap_script_sequence *lsec =
 		(struct sieve_ldap_script_sequence *)seq;
-	struct sieve_ldap_storage *lstorage =
-		(struct sieve_ldap_storage *)seq->storage;
 	struct sieve_ldap_script *lscript;
 
 	if ( error_r != NULL )
@@ -346,8 +415,8 @@ struct sieve_script *sieve_ldap_script_sequence_next
 		return NULL;
 	lsec->done = TRUE;
 
-	lscript = sieve_ldap_script_init
-		(lstorage, seq->storage->script_name);
+	lscript = lsec->lscript;
+	lsec->lscript = NULL;
 	if ( sieve_script_open(&lscript->script, error_r) < 0 ) {
 		struct sieve_script *script = &lscript->script;
 		sieve_script_unref(&script);
@@ -362,6 +431,10 @@ void sieve_ldap_script_sequence_destroy
 {
 	struct sieve_ldap_script_sequence *lsec =
 		(struct sieve_ldap_script_sequence *)seq;
+	if ( lsec->lscript != NULL ) {
+		struct sieve_script *script = &lsec->lscript->script;
+		sieve_script_unref(&script);
+	}
 	i_free(lsec);
 }
 
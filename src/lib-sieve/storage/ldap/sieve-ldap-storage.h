@@ -48,6 +48,10 @@ struct sieve_ldap_storage_settings {
 	const char *sieve_ldap_mod_attr;
 	const char *sieve_ldap_filter;
 
+	unsigned int sieve_ldap_cache_ttl;
+	unsigned int sieve_ldap_cache_negative_ttl;
+	unsigned int sieve_ldap_cache_size;
+
 	/* ... */
 	int ldap_deref, ldap_scope, ldap_tls_require_cert;
 };
@@ -87,6 +91,9 @@ struct sieve_ldap_script {
 	const char *modattr;
 
 	const char *binpath;
+
+	/* Lookup started by open_begin() */
+	struct sieve_ldap_script_lookup_request *lookup;
 };
 
 struct sieve_ldap_script *sieve_ldap_script_init
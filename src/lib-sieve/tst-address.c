@@ -44,6 +44,7 @@ const struct sieve_command_def tst_address = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.message_data = SIEVE_COMMAND_MESSAGE_HEADERS,
 	.registered = tst_address_registered,
 	.validate = tst_address_validate,
 	.generate = tst_address_generate
@@ -39,6 +39,7 @@ const struct sieve_command_def tst_header = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.message_data = SIEVE_COMMAND_MESSAGE_HEADERS,
 	.registered = tst_header_registered,
 	.validate = tst_header_validate,
 	.generate = tst_header_generate
@@ -30,6 +30,10 @@ tst_size_pre_validate(struct sieve_validator *valdtr,
 static bool
 tst_size_validate(struct sieve_validator *valdtr, struct sieve_command *tst);
 static bool
+tst_size_validate_const(struct sieve_validator *valdtr,
+			struct sieve_command *tst, int *const_current,
+			int const_next);
+static bool
 tst_size_generate(const struct sieve_codegen_env *cgenv,
 		  struct sieve_command *ctx);
 
@@ -40,9 +44,11 @@ const struct sieve_command_def tst_size = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.message_data = SIEVE_COMMAND_MESSAGE_SIZE,
 	.registered = tst_size_registered,
 	.pre_validate = tst_size_pre_validate,
 	.validate = tst_size_validate,
+	.validate_const = tst_size_validate_const,
 	.generate = tst_size_generate
 };
 
@@ -197,6 +203,28 @@ tst_size_validate(struct sieve_validator *valdtr, struct sieve_command *tst)
 	return sieve_validator_argument_activate(valdtr, tst, arg, FALSE);
 }
 
+static bool
+tst_size_validate_const(struct sieve_validator *valdtr ATTR_UNUSED,
+			struct sieve_command *tst, int *const_current,
+			int const_next ATTR_UNUSED)
+{
+	struct tst_size_context_data *ctx_data =
+		(struct tst_size_context_data *)tst->data;
+	struct sieve_ast_argument *arg = tst->first_positional;
+
+	/* No message is smaller than zero octets. Note that `:over 0' is not
+	   constant: an empty message is (theoretically) possible. */
+	if (ctx_data->type == SIZE_UNDER &&
+	    sieve_ast_argument_type(arg) == SAAT_NUMBER &&
+	    sieve_ast_argument_number(arg) == 0) {
+		*const_current = 0;
+		return TRUE;
+	}
+
+	*const_current = -1;
+	return TRUE;
+}
+
 /*
  * Code generation
  */
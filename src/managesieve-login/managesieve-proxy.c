@@ -19,6 +19,7 @@
 #include "managesieve-quote.h"
 #include "managesieve-proxy.h"
 #include "managesieve-parser.h"
+#include "managesieve-response.h"
 
 typedef enum {
 	MANAGESIEVE_RESPONSE_NONE,
@@ -31,6 +32,12 @@ static const char *managesieve_proxy_state_names[MSIEVE_PROXY_STATE_COUNT] = {
 	"none", "tls-start", "tls-ready", "xclient", "auth"
 };
 
+/* Response codes from the backend's reply to AUTHENTICATE that are passed on
+   to the client. These say nothing about whether the user exists. */
+static const char *const managesieve_proxy_auth_resp_codes[] = {
+	"AUTH-TOO-WEAK", "ENCRYPT-NEEDED", NULL
+};
+
 static void proxy_write_xclient
 (struct managesieve_client *client, string_t *str)
 {
@@ -241,12 +248,32 @@ static int proxy_input_capability
 	struct istream *input;
 	struct managesieve_parser *parser;
  	const struct managesieve_arg *args;
-	const char *capability;
+	struct managesieve_response resp;
+	const char *capability, *error;
 	int ret;
 	bool fatal = FALSE;
 
 	*resp_r = MANAGESIEVE_RESPONSE_NONE;
 
+	/* The final response may carry a response code, which the argument
+	   parser below cannot handle */
+	if ( managesieve_response_parse(line, &resp, &error) == 0 ) {
+		switch ( resp.type ) {
+		case MANAGESIEVE_RESPONSE_TYPE_OK:
+			*resp_r = MANAGESIEVE_RESPONSE_OK;
+			break;
+		case MANAGESIEVE_RESPONSE_TYPE_NO:
+			*resp_r = MANAGESIEVE_RESPONSE_NO;
+			break;
+		case MANAGESIEVE_RESPONSE_TYPE_BYE:
+			*resp_r = MANAGESIEVE_RESPONSE_BYE;
+			break;
+		case MANAGESIEVE_RESPONSE_TYPE_NONE:
+			i_unreached();
+		}
+		return 0;
+	}
+
 	/* Build an input stream for the managesieve parser
 	 *  FIXME: It would be nice if the line-wise parsing could be
 	 *    substituded by something similar to the command line interpreter.
@@ -258,10 +285,7 @@ static int proxy_input_capability
 	parser = managesieve_parser_create(input, MAX_MANAGESIEVE_LINE);
 	managesieve_parser_reset(parser);
 
-	/* Parse input
-	 *  FIXME: Theoretically the OK response could include a
-	 *   response code which could be rejected by the parser.
-	 */
+	/* Parse input */
 	(void)i_stream_read(input);
 	ret = managesieve_parser_read_args(parser, 2, 0, &args);
 
@@ -361,47 +385,47 @@ static int proxy_input_capability
 
 static void
 managesieve_proxy_parse_auth_reply(const char *line,
-				   const char **reason_r, bool *trylater_r)
+				   const char **reason_r,
+				   const char **resp_code_r, bool *trylater_r)
 {
-	struct managesieve_parser *parser;
-	const struct managesieve_arg *args;
-	struct istream *input;
-	const char *reason;
-	int ret;
+	struct managesieve_response resp;
+	const char *error;
 
+	*reason_r = line;
+	*resp_code_r = NULL;
 	*trylater_r = FALSE;
 
-	if (strncasecmp(line, "NO ", 3) != 0) {
-		*reason_r = line;
+	if (managesieve_response_parse(line, &resp, &error) < 0 ||
+	    resp.type != MANAGESIEVE_RESPONSE_TYPE_NO)
 		return;
-	}
-	line += 3;
-	*reason_r = line;
 
-	if (line[0] == '(') {
-		/* Parse optional resp-code. FIXME: The current
-		   managesieve-parser can't really handle this properly, so
-		   we'll just assume that there aren't any strings with ')'
-		   in them. */
-		if (strncasecmp(line, "(TRYLATER) ", 11) == 0) {
-			*trylater_r = TRUE;
-			line += 11;
-		} else {
-			line = strstr(line, ") ");
-			if (line == NULL)
-				return;
-			line += 2;
-		}
-	}
+	if (resp.text != NULL)
+		*reason_r = resp.text;
+	if (resp.code == NULL)
+		return;
 
-	/* parse the string */
-	input = i_stream_create_from_data(line, strlen(line));
-	parser = managesieve_parser_create(input, (size_t)-1);
-	(void)i_stream_read(input);
-	ret = managesieve_parser_finish_line(parser, 0, 0, &args);
-	if (ret == 1 && managesieve_arg_get_string(&args[0], &reason))
-		*reason_r = t_strdup(reason);
-	managesieve_parser_destroy(&parser);
+	if (strcmp(resp.code, "TRYLATER") == 0)
+		*trylater_r = TRUE;
+	else if (str_array_find(managesieve_proxy_auth_resp_codes, resp.code))
+		*resp_code_r = resp.code;
+}
+
+static void
+managesieve_proxy_write_auth_success(const char *line, string_t *str)
+{
+	struct managesieve_response resp;
+	const char *error;
+
+	/* The final SASL data is meant for the proxy's own authentication
+	   exchange; don't pass it on to the client */
+	if (managesieve_response_parse(line, &resp, &error) < 0 ||
+	    resp.code == NULL || strcmp(resp.code, "SASL") != 0) {
+		str_append(str, line);
+		return;
+	}
+	resp.code = NULL;
+	resp.code_arg = NULL;
+	managesieve_response_append(str, &resp);
 }
 
 int managesieve_proxy_parse_line(struct client *client, const char *line)
@@ -448,7 +472,11 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 				msieve_client->proxy_state = MSIEVE_PROXY_STATE_TLS_START;
 
 			} else if (msieve_client->proxy_xclient) {
+				/* Pipeline the AUTHENTICATE command right after
+				   XCLIENT to save a round trip */
 				proxy_write_xclient(msieve_client, command);
+				if ( proxy_write_auth(msieve_client, command) < 0 )
+					return -1;
 				msieve_client->proxy_state = MSIEVE_PROXY_STATE_XCLIENT;
 
 			} else {
@@ -499,7 +527,11 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 
 			command = t_str_new(128);
 			if ( msieve_client->proxy_xclient ) {
+				/* Pipeline the AUTHENTICATE command right after
+				   XCLIENT to save a round trip */
 				proxy_write_xclient(msieve_client, command);
+				if ( proxy_write_auth(msieve_client, command) < 0 )
+					return -1;
 				msieve_client->proxy_state = MSIEVE_PROXY_STATE_XCLIENT;
 
 			} else {
@@ -514,11 +546,7 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 	case MSIEVE_PROXY_STATE_XCLIENT:
 		if ( strncasecmp(line, "OK", 2) == 0 &&
 			( strlen(line) == 2 || line[2] == ' ' ) ) {
-
-			command = t_str_new(128);
-			if ( proxy_write_auth(msieve_client, command) < 0 )
-				return -1;
-			o_stream_nsend(output, str_data(command), str_len(command));
+			/* AUTHENTICATE was already sent along with XCLIENT */
 			msieve_client->proxy_state = MSIEVE_PROXY_STATE_AUTH;
 			return 0;
 		}
@@ -557,7 +585,7 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 			/* FIXME: some SASL mechanisms cause a capability response to be sent */
 
 			/* Send this line to client. */
-			str_append(str, line );
+			managesieve_proxy_write_auth_success(line, str);
 			str_append(str, "\r\n");
 			o_stream_nsend(client->output, str_data(str), str_len(str));
 
@@ -567,8 +595,10 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 		}
 
 		/* Authentication failed */
+		const char *resp_code;
 		bool try_later;
-		(void)managesieve_proxy_parse_auth_reply(line, &reason, &try_later);
+		managesieve_proxy_parse_auth_reply(line, &reason, &resp_code,
+						   &try_later);
 
 		/* Login failed. Send our own failure reply so client can't
 		 * figure out if user exists or not just by looking at the
@@ -579,7 +609,7 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 			failure_type = LOGIN_PROXY_FAILURE_TYPE_AUTH_TEMPFAIL;
 		else {
 			failure_type = LOGIN_PROXY_FAILURE_TYPE_AUTH;
-			client_send_no(client, AUTH_FAILED_MSG);
+			client_send_noresp(client, resp_code, AUTH_FAILED_MSG);
 		}
 
 		login_proxy_failed(client->login_proxy,
@@ -13,6 +13,7 @@
 
 #include "sieve.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
 #include "sieve-storage.h"
 
 #include "managesieve-parser.h"
@@ -21,6 +22,7 @@
 #include "managesieve-client.h"
 #include "managesieve-commands.h"
 #include "managesieve-quota.h"
+#include "managesieve-compile-cache.h"
 
 #include <sys/time.h>
 
@@ -80,6 +82,7 @@ static void client_input_putscript(struct client *client)
 		return;
 	}
 
+	o_stream_cork(client->output);
 	if (cmd->func(cmd)) {
 		/* command execution was finished. Note that if cmd_sync()
 		   didn't finish, we didn't get here but the input handler
@@ -89,9 +92,15 @@ static void client_input_putscript(struct client *client)
 		   reset command once again to reset cmd_sync()'s changes. */
 		_client_reset_command(client);
 
-		if (client->input_pending)
+		if (client->input_pending) {
+			/* handle pipelined commands; their responses are
+			   sent along with this one when client_input()
+			   uncorks the output. */
 			client_input(client);
+			return;
+		}
 	}
+	o_stream_uncork(client->output);
 }
 
 static void cmd_putscript_finish(struct cmd_putscript_context *ctx)
@@ -168,24 +177,57 @@ static bool cmd_putscript_save(struct cmd_putscript_context *ctx)
 	return TRUE;
 }
 
+static void cmd_putscript_save_binary(struct cmd_putscript_context *ctx)
+{
+	struct client_command_context *cmd = ctx->cmd;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+
+	/* The uploaded script was validated from its temporary file, so the
+	   stored script is compiled once more from its final location. Saving
+	   the binary next to it spares the next delivery from compiling it.
+	   Failure is not fatal; delivery compiles the script as before. */
+	script = sieve_storage_open_script(ctx->storage, ctx->scriptname, NULL);
+	if (script == NULL)
+		return;
+
+	sbin = sieve_compile_script(script, NULL,
+				    SIEVE_COMPILE_FLAG_NOGLOBAL |
+				    SIEVE_COMPILE_FLAG_ACTIVATED, &error);
+	if (sbin == NULL) {
+		e_debug(cmd->event, "Not saving binary for script `%s': "
+			"Compilation failed", ctx->scriptname);
+	} else {
+		if (sieve_save(sbin, TRUE, &error) < 0) {
+			e_debug(cmd->event, "Failed to save binary "
+				"for script `%s'", ctx->scriptname);
+		}
+		sieve_close(&sbin);
+	}
+	sieve_script_unref(&script);
+}
+
 static void
-cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
-			    struct sieve_script *script)
+cmd_putscript_compile(struct cmd_putscript_context *ctx,
+		      struct sieve_script *script,
+		      enum sieve_compile_flags cpflags,
+		      struct managesieve_compile_result *result_r,
+		      const char **errormsg_r)
 {
 	struct client *client = ctx->client;
-	struct client_command_context *cmd = ctx->cmd;
 	struct sieve_error_handler *ehandler;
-	enum sieve_compile_flags cpflags =
-		SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
 	struct sieve_binary *sbin;
-	bool success = TRUE;
-	enum sieve_error error;
+	enum sieve_error error = SIEVE_ERROR_NONE;
+	const char *cache_key;
 	string_t *errors;
 
-	/* Mark this as an activation when we are replacing the
-	   active script */
-	if (sieve_storage_save_will_activate(ctx->save_ctx))
-		cpflags |= SIEVE_COMPILE_FLAG_ACTIVATED;
+	*errormsg_r = NULL;
+
+	/* Identical scripts need not be compiled again */
+	if (managesieve_compile_cache_lookup(client, script, cpflags,
+					     &cache_key, result_r))
+		return;
 
 	/* Prepare error handler */
 	errors = str_new(default_pool, 1024);
@@ -196,13 +238,56 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 	/* Compile */
 	sbin = sieve_compile_script(script, ehandler, cpflags, &error);
 	if (sbin == NULL) {
-		const char *errormsg = NULL, *action;
-
 		if (error != SIEVE_ERROR_NOT_VALID) {
-			errormsg = sieve_script_get_last_error(script, &error);
+			*errormsg_r = sieve_script_get_last_error(script, &error);
 			if (error == SIEVE_ERROR_NONE)
-				errormsg = NULL;
+				*errormsg_r = NULL;
 		}
+		result_r->valid = FALSE;
+	} else {
+		result_r->valid = TRUE;
+		result_r->cost = sieve_binary_cost_estimate(
+			sieve_binary_get_cost(sbin));
+		sieve_close(&sbin);
+	}
+	result_r->error_count = sieve_get_errors(ehandler);
+	result_r->warning_count = sieve_get_warnings(ehandler);
+	result_r->messages = t_strdup(str_c(errors));
+	sieve_error_handler_unref(&ehandler);
+	str_free(&errors);
+
+	/* Only cache the outcome of the compilation itself, not failures to
+	   read the script */
+	if (cache_key != NULL && *errormsg_r == NULL &&
+	    (result_r->valid || error == SIEVE_ERROR_NOT_VALID))
+		managesieve_compile_cache_update(client, cache_key, result_r);
+}
+
+static void
+cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
+			    struct sieve_script *script)
+{
+	struct client *client = ctx->client;
+	struct client_command_context *cmd = ctx->cmd;
+	enum sieve_compile_flags cpflags =
+		SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
+	struct managesieve_compile_result result;
+	const char *errormsg;
+	bool success = TRUE, activating = FALSE;
+
+	/* Mark this as an activation when we are replacing the
+	   active script */
+	if (ctx->scriptname != NULL &&
+	    sieve_storage_save_will_activate(ctx->save_ctx)) {
+		cpflags |= SIEVE_COMPILE_FLAG_ACTIVATED;
+		activating = TRUE;
+	}
+
+	/* Compile */
+	i_zero(&result);
+	cmd_putscript_compile(ctx, script, cpflags, &result, &errormsg);
+	if (!result.valid) {
+		const char *action;
 
 		action = (ctx->scriptname != NULL ?
 			  t_strdup_printf("store script `%s'",
@@ -213,16 +298,15 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 			struct event_passthrough *e =
 				client_command_create_finish_event(cmd)->
 				add_str("error", "Compilation failed")->
-				add_int("compile_errors",
-					sieve_get_errors(ehandler))->
+				add_int("compile_errors", result.error_count)->
 				add_int("compile_warnings",
-					sieve_get_warnings(ehandler));
+					result.warning_count);
 			e_debug(e->event(), "Failed to %s: "
 				"Compilation failed (%u errors, %u warnings)",
-				action, sieve_get_errors(ehandler),
-				sieve_get_warnings(ehandler));
+				action, result.error_count,
+				result.warning_count);
 
-			client_send_no(client, str_c(errors));
+			client_send_no(client, result.messages);
 		} else {
 			struct event_passthrough *e =
 				client_command_create_finish_event(cmd)->
@@ -235,10 +319,10 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 
 		success = FALSE;
 	} else {
-		sieve_close(&sbin);
-
 		if (!cmd_putscript_save(ctx))
 			success = FALSE;
+		else if (activating)
+			cmd_putscript_save_binary(ctx);
 	}
 
 	/* Finish up */
@@ -256,27 +340,24 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 
 		struct event_passthrough *e =
 			client_command_create_finish_event(cmd)->
-			add_int("compile_warnings",
-				sieve_get_warnings(ehandler));
+			add_int("compile_warnings", result.warning_count)->
+			add_int("script_cost", result.cost);
 		if (ctx->scriptname != NULL) {
 			e_debug(e->event(), "Stored script `%s' successfully "
 				"(%u warnings)", ctx->scriptname,
-				sieve_get_warnings(ehandler));
+				result.warning_count);
 		} else {
 			e_debug(e->event(), "Checked script successfully "
-				"(%u warnings)", sieve_get_warnings(ehandler));
+				"(%u warnings)", result.warning_count);
 		}
 
-		if (sieve_get_warnings(ehandler) > 0)
-			client_send_okresp(client, "WARNINGS", str_c(errors));
+		if (result.warning_count > 0)
+			client_send_okresp(client, "WARNINGS", result.messages);
 		else if (ctx->scriptname != NULL)
 			client_send_ok(client, "PUTSCRIPT completed.");
 		else
 			client_send_ok(client, "Script checked successfully.");
 	}
-
-	sieve_error_handler_unref(&ehandler);
-	str_free(&errors);
 }
 
 static void cmd_putscript_handle_script(struct cmd_putscript_context *ctx)
@@ -18,6 +18,7 @@ cmd_setactive_activate(struct client_command_context *cmd,
 	struct client *client = cmd->client;
 	struct sieve_storage *storage = client->storage;
 	struct sieve_script *script;
+	struct sieve_binary *sbin = NULL;
 	string_t *errors = NULL;
 	const char *errormsg = NULL;
 	unsigned int warning_count = 0, error_count = 0;
@@ -41,7 +42,6 @@ cmd_setactive_activate(struct client_command_context *cmd,
 		enum sieve_compile_flags cpflags =
 			SIEVE_COMPILE_FLAG_NOGLOBAL |
 			SIEVE_COMPILE_FLAG_ACTIVATED;
-		struct sieve_binary *sbin;
 		enum sieve_error error;
 
 		/* Prepare error handler */
@@ -60,8 +60,6 @@ cmd_setactive_activate(struct client_command_context *cmd,
 					errormsg = NULL;
 			}
 			success = FALSE;
-		} else {
-			sieve_close(&sbin);
 		}
 
 		warning_count = sieve_get_warnings(ehandler);
@@ -82,6 +80,11 @@ cmd_setactive_activate(struct client_command_context *cmd,
 			struct event_passthrough *e =
 				client_command_create_finish_event(cmd)->
 				add_int("compile_warnings", warning_count);
+
+			/* Save the binary, so that it is ready for delivery */
+			if (sbin != NULL)
+				(void)sieve_save(sbin, FALSE, NULL);
+
 			e_debug(e->event(), "Activated script `%s' "
 				" (%u warnings%s)",
 				scriptname, warning_count,
@@ -119,6 +122,8 @@ cmd_setactive_activate(struct client_command_context *cmd,
 		client_send_no(client, errormsg);
 	}
 
+	if (sbin != NULL)
+		sieve_close(&sbin);
 	if (errors != NULL)
 		str_free(&errors);
 	sieve_script_unref(&script);
@@ -691,10 +691,37 @@ static bool client_handle_input(struct client_command_context *cmd)
 	return TRUE;
 }
 
+static bool client_output_is_full(struct client *client)
+{
+	return (o_stream_get_buffer_used_size(client->output) >=
+		CLIENT_OUTPUT_OPTIMAL_SIZE);
+}
+
+/* Handle all commands available in the input buffer, which may be many when
+   the client pipelines its commands. */
+static void client_handle_commands(struct client *client)
+{
+	bool ret;
+
+	do {
+		T_BEGIN {
+			ret = client_handle_input(&client->cmd);
+		} T_END;
+	} while (ret && !client->disconnected &&
+		 !client_output_is_full(client));
+
+	if (ret && !client->disconnected) {
+		/* the client isn't reading our responses fast enough. continue
+		   with the remaining commands once the output is flushed. */
+		o_stream_set_flush_pending(client->output, TRUE);
+	}
+}
+
 void client_input(struct client *client)
 {
 	struct client_command_context *cmd = &client->cmd;
-	bool ret;
+	size_t size_before, size_after;
+	ssize_t ret;
 
 	if (client->command_pending) {
 		/* already processing one command. wait. */
@@ -706,29 +733,37 @@ void client_input(struct client *client)
 	client->last_input = ioloop_time;
 	timeout_reset(client->to_idle);
 
-	switch (i_stream_read(client->input)) {
-	case -1:
+	ret = i_stream_read(client->input);
+	if (ret == -1) {
 		/* disconnected */
 		client_destroy(client, NULL);
 		return;
-	case -2:
-		/* parameter word is longer than max. input buffer size.
-		   this is most likely an error, so skip the new data
-		   until newline is found. */
-		client->input_skip_line = TRUE;
-
-		client_send_command_error(cmd, "Too long argument.");
-		_client_reset_command(client);
-		break;
 	}
 
 	client->handling_input = TRUE;
 	o_stream_cork(client->output);
-	do {
-		T_BEGIN {
-			ret = client_handle_input(cmd);
-		} T_END;
-	} while (ret && !client->disconnected);
+	if (ret != -2)
+		client_handle_commands(client);
+	else {
+		/* input buffer is full. first handle the pipelined commands
+		   it may contain. */
+		(void)i_stream_get_data(client->input, &size_before);
+		client_handle_commands(client);
+		(void)i_stream_get_data(client->input, &size_after);
+
+		if (size_after == size_before && !client->disconnected &&
+		    !client->command_pending &&
+		    !client_output_is_full(client)) {
+			/* parameter word is longer than max. input buffer size.
+			   this is most likely an error, so skip the new data
+			   until newline is found. */
+			client->input_skip_line = TRUE;
+
+			client_send_command_error(cmd, "Too long argument.");
+			_client_reset_command(client);
+			client_handle_commands(client);
+		}
+	}
 	o_stream_uncork(client->output);
 	client->handling_input = FALSE;
 
@@ -755,8 +790,14 @@ int client_output(struct client *client)
 		return 1;
 	}
 
-	if (!client->command_pending)
+	if (!client->command_pending) {
+		if (client->input_pending && ret > 0) {
+			/* output is flushed; continue with the pipelined
+			   commands held back by client_input() */
+			client_input(client);
+		}
 		return 1;
+	}
 
 	/* continue processing command */
 	o_stream_cork(client->output);
@@ -769,16 +810,21 @@ int client_output(struct client *client)
 	if (!finished && client->output_pending)
 		o_stream_set_flush_pending(client->output, TRUE);
 
-	o_stream_uncork(client->output);
-
 	if (finished) {
 		/* command execution was finished */
 		client->bad_counter = 0;
 		_client_reset_command(client);
 
-		if (client->input_pending)
+		if (client->input_pending) {
+			/* the output is still corked, so the responses to the
+			   pipelined commands are sent along with this one.
+			   client_input() uncorks it. */
 			client_input(client);
+			return ret;
+		}
 	}
+
+	o_stream_uncork(client->output);
 	return ret;
 }
 
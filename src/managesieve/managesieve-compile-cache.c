@@ -0,0 +1,448 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "sha2.h"
+#include "hex-binary.h"
+#include "safe-mkstemp.h"
+#include "mkdir-parents.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "mail-storage-settings.h"
+#include "mail-user.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+
+#include "managesieve-common.h"
+#include "managesieve-client.h"
+#include "managesieve-compile-cache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+/*
+ * Compile cache
+ */
+
+/* Results of compiling uploaded scripts are kept in a directory shared by
+   all ManageSieve processes, in files named after a hash of everything the
+   result depends on: the script text and name (which appears in the
+   diagnostics), the compile flags, the enabled extensions, the maximum
+   number of reported errors and the user's Sieve settings (limits such as
+   sieve_max_script_cost or sieve_variables_max_scope_size change what is
+   accepted). Scripts that may include other scripts are not cached, since
+   their result also depends on the contents of the user's storage.
+
+   Cache entries are trusted, so only files owned by the current process
+   user are used. Files planted by other users are ignored.
+
+   Entries expire after managesieve_compile_cache_max_age. Expired entries
+   are removed by the process that next updates the cache, at most once per
+   MANAGESIEVE_COMPILE_CACHE_PRUNE_INTERVAL; the mtime of the stamp file
+   records when this was last done.
+
+   Format: "<version> <valid> <errors> <warnings> <cost>\n<diagnostics>"
+ */
+
+#define MANAGESIEVE_COMPILE_CACHE_VERSION 1
+
+/* Cache files larger than this are not read; they cannot be valid */
+#define MANAGESIEVE_COMPILE_CACHE_MAX_FILE_SIZE (1024*1024)
+
+#define MANAGESIEVE_COMPILE_CACHE_PRUNE_INTERVAL (60*60)
+#define MANAGESIEVE_COMPILE_CACHE_PRUNE_STAMP ".prune"
+
+static bool
+managesieve_compile_cache_expired(struct client *client, const struct stat *st)
+{
+	unsigned int max_age = client->set->managesieve_compile_cache_max_age;
+
+	return (max_age > 0 && st->st_mtime < ioloop_time - (time_t)max_age);
+}
+
+static bool
+managesieve_compile_cache_may_include(const unsigned char *data, size_t size)
+{
+	static const char word[] = "include";
+	const size_t word_len = sizeof(word) - 1;
+	size_t i;
+
+	for (i = 0; i + word_len <= size; i++) {
+		if (strncasecmp((const char *)data + i, word, word_len) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Settings that only locate scripts and logs; these differ per user, but
+   do not affect the compile result */
+static const char *const managesieve_compile_cache_ignored_settings[] = {
+	"sieve",
+	"sieve_dir",
+	"sieve_default",
+	"sieve_default_name",
+	"sieve_global",
+	"sieve_global_dir",
+	"sieve_global_path",
+	"sieve_discard",
+	"sieve_user_log",
+	"sieve_user_email",
+	"sieve_trace_dir",
+	NULL
+};
+
+static bool managesieve_compile_cache_setting_ignored(const char *key)
+{
+	if (str_begins(key, "sieve_before") || str_begins(key, "sieve_after"))
+		return TRUE;
+	return str_array_find(managesieve_compile_cache_ignored_settings, key);
+}
+
+static void
+managesieve_compile_cache_append_settings(struct client *client,
+					  string_t *params)
+{
+	const struct mail_user_settings *set = client->user->set;
+	ARRAY_TYPE(const_string) settings;
+	const char *const *envs, *const *items;
+	unsigned int i, count;
+
+	if (!array_is_created(&set->plugin_envs))
+		return;
+
+	t_array_init(&settings, 32);
+	envs = array_get(&set->plugin_envs, &count);
+	for (i = 0; i + 1 < count; i += 2) {
+		if (!str_begins(envs[i], "sieve") ||
+		    managesieve_compile_cache_setting_ignored(envs[i]))
+			continue;
+		array_push_back(&settings,
+				t_strconcat(envs[i], "=", envs[i+1], NULL));
+	}
+	/* Userdb overrides may change the order */
+	array_sort(&settings, i_strcmp_p);
+
+	items = array_get(&settings, &count);
+	for (i = 0; i < count; i++) {
+		str_append(params, items[i]);
+		str_append_c(params, '\n');
+	}
+}
+
+static const char *
+managesieve_compile_cache_get_key(struct client *client,
+				  struct sieve_script *script,
+				  enum sieve_compile_flags cpflags)
+{
+	struct sieve_instance *svinst = client->svinst;
+	unsigned char digest[SHA256_RESULTLEN];
+	struct sha256_ctx ctx;
+	struct istream *input;
+	const unsigned char *data;
+	const char *sname;
+	string_t *params;
+	buffer_t *text;
+	size_t size;
+	ssize_t ret;
+
+	if (sieve_script_get_stream(script, &input, NULL) < 0)
+		return NULL;
+
+	text = t_buffer_create(1024);
+	while ((ret = i_stream_read_more(input, &data, &size)) > 0) {
+		buffer_append(text, data, size);
+		i_stream_skip(input, size);
+	}
+	if (ret < 0 && input->stream_errno != 0) {
+		e_error(client->event, "compile cache: "
+			"Failed to read script: %s", i_stream_get_error(input));
+		i_stream_seek(input, 0);
+		return NULL;
+	}
+	/* The script is compiled from this same stream */
+	i_stream_seek(input, 0);
+
+	if (managesieve_compile_cache_may_include(text->data, text->used))
+		return NULL;
+
+	sname = sieve_script_name(script);
+	params = t_str_new(1024);
+	str_printfa(params, "%u\n%s\n%s\n%s\n%u\n%u\n%s\n",
+		MANAGESIEVE_COMPILE_CACHE_VERSION, PIGEONHOLE_VERSION_FULL,
+		sieve_get_capabilities(svinst, NULL),
+		sieve_get_capabilities(svinst, "notify"),
+		(unsigned int)cpflags,
+		client->set->managesieve_max_compile_errors,
+		(sname == NULL ? "" : sname));
+	managesieve_compile_cache_append_settings(client, params);
+
+	sha256_init(&ctx);
+	sha256_loop(&ctx, str_data(params), str_len(params));
+	sha256_loop(&ctx, text->data, text->used);
+	sha256_result(&ctx, digest);
+
+	return binary_to_hex(digest, sizeof(digest));
+}
+
+static bool
+managesieve_compile_cache_parse(const char *data,
+				struct managesieve_compile_result *result_r)
+{
+	const char *const *fields, *p;
+	unsigned int version, valid;
+
+	p = strchr(data, '\n');
+	if (p == NULL)
+		return FALSE;
+
+	fields = t_strsplit_spaces(t_strdup_until(data, p), " ");
+	if (str_array_length(fields) != 5 ||
+	    str_to_uint(fields[0], &version) < 0 ||
+	    version != MANAGESIEVE_COMPILE_CACHE_VERSION ||
+	    str_to_uint(fields[1], &valid) < 0 || valid > 1 ||
+	    str_to_uint(fields[2], &result_r->error_count) < 0 ||
+	    str_to_uint(fields[3], &result_r->warning_count) < 0 ||
+	    str_to_uint(fields[4], &result_r->cost) < 0)
+		return FALSE;
+
+	result_r->valid = (valid == 1);
+	result_r->messages = p + 1;
+	return TRUE;
+}
+
+bool managesieve_compile_cache_lookup(struct client *client,
+				      struct sieve_script *script,
+				      enum sieve_compile_flags cpflags,
+				      const char **key_r,
+				      struct managesieve_compile_result *result_r)
+{
+	const char *dir = client->set->managesieve_compile_cache_dir;
+	const char *key, *path;
+	struct stat st;
+	char *data;
+	int fd, ret;
+
+	*key_r = NULL;
+	i_zero(result_r);
+
+	if (*dir == '\0')
+		return FALSE;
+	key = managesieve_compile_cache_get_key(client, script, cpflags);
+	if (key == NULL)
+		return FALSE;
+	*key_r = key;
+
+	path = t_strconcat(dir, "/", key, NULL);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			e_error(client->event, "compile cache: "
+				"open(%s) failed: %m", path);
+		}
+		return FALSE;
+	}
+	if (fstat(fd, &st) < 0) {
+		e_error(client->event, "compile cache: "
+			"fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return FALSE;
+	}
+	if (st.st_uid != geteuid() || (st.st_mode & 0022) != 0) {
+		e_debug(client->event, "compile cache: "
+			"Ignoring cache file %s not written by this user",
+			path);
+		i_close_fd(&fd);
+		return FALSE;
+	}
+	if (st.st_size == 0 ||
+	    st.st_size > MANAGESIEVE_COMPILE_CACHE_MAX_FILE_SIZE ||
+	    managesieve_compile_cache_expired(client, &st)) {
+		i_close_fd(&fd);
+		return FALSE;
+	}
+
+	data = t_malloc0(st.st_size + 1);
+	ret = read_full(fd, data, st.st_size);
+	if (ret < 0) {
+		e_error(client->event, "compile cache: "
+			"read(%s) failed: %m", path);
+	}
+	i_close_fd(&fd);
+	if (ret <= 0)
+		return FALSE;
+
+	if (!managesieve_compile_cache_parse(data, result_r)) {
+		e_debug(client->event, "compile cache: "
+			"Ignoring invalid cache file %s", path);
+		i_zero(result_r);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+managesieve_compile_cache_create_temp(struct client *client, const char *key,
+				      string_t *temp_path)
+{
+	const char *dir = client->set->managesieve_compile_cache_dir;
+	int fd;
+
+	str_truncate(temp_path, 0);
+	str_printfa(temp_path, "%s/.%s.", dir, key);
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdir_parents(dir, 0700) < 0 && errno != EEXIST) {
+			e_error(client->event, "compile cache: "
+				"mkdir_parents(%s) failed: %m", dir);
+			return -1;
+		}
+		str_truncate(temp_path, 0);
+		str_printfa(temp_path, "%s/.%s.", dir, key);
+		fd = safe_mkstemp_hostpid(temp_path, 0600,
+					  (uid_t)-1, (gid_t)-1);
+	}
+	if (fd == -1) {
+		e_error(client->event, "compile cache: "
+			"safe_mkstemp(%s) failed: %m", str_c(temp_path));
+	}
+	return fd;
+}
+
+static void managesieve_compile_cache_prune(struct client *client)
+{
+	const char *dir = client->set->managesieve_compile_cache_dir;
+	const char *stamp_path;
+	string_t *path;
+	size_t dir_len;
+	struct stat st;
+	struct dirent *dp;
+	DIR *dirp;
+	int fd;
+
+	if (client->set->managesieve_compile_cache_max_age == 0)
+		return;
+
+	stamp_path = t_strconcat(dir, "/"MANAGESIEVE_COMPILE_CACHE_PRUNE_STAMP,
+				 NULL);
+	if (stat(stamp_path, &st) == 0) {
+		if (st.st_mtime <= ioloop_time &&
+		    st.st_mtime > (ioloop_time -
+				   MANAGESIEVE_COMPILE_CACHE_PRUNE_INTERVAL))
+			return;
+	} else if (errno != ENOENT) {
+		e_error(client->event, "compile cache: "
+			"stat(%s) failed: %m", stamp_path);
+		return;
+	}
+
+	/* Update the stamp first, so that concurrent processes skip this */
+	fd = open(stamp_path, O_WRONLY | O_CREAT, 0600);
+	if (fd == -1) {
+		e_error(client->event, "compile cache: "
+			"open(%s) failed: %m", stamp_path);
+		return;
+	}
+	i_close_fd(&fd);
+	if (utime(stamp_path, NULL) < 0) {
+		e_error(client->event, "compile cache: "
+			"utime(%s) failed: %m", stamp_path);
+		return;
+	}
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		e_error(client->event, "compile cache: "
+			"opendir(%s) failed: %m", dir);
+		return;
+	}
+	path = t_str_new(256);
+	str_printfa(path, "%s/", dir);
+	dir_len = str_len(path);
+
+	errno = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		/* Temporary files of failed writers are removed as well */
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0 ||
+		    strcmp(dp->d_name,
+			   MANAGESIEVE_COMPILE_CACHE_PRUNE_STAMP) == 0)
+			continue;
+
+		str_truncate(path, dir_len);
+		str_append(path, dp->d_name);
+		if (lstat(str_c(path), &st) < 0) {
+			if (errno != ENOENT) {
+				e_error(client->event, "compile cache: "
+					"lstat(%s) failed: %m", str_c(path));
+			}
+		} else if (S_ISREG(st.st_mode) && st.st_uid == geteuid() &&
+			   managesieve_compile_cache_expired(client, &st)) {
+			i_unlink_if_exists(str_c(path));
+		}
+		errno = 0;
+	}
+	if (errno != 0) {
+		e_error(client->event, "compile cache: "
+			"readdir(%s) failed: %m", dir);
+	}
+	if (closedir(dirp) < 0) {
+		e_error(client->event, "compile cache: "
+			"closedir(%s) failed: %m", dir);
+	}
+}
+
+void managesieve_compile_cache_update(
+	struct client *client, const char *key,
+	const struct managesieve_compile_result *result)
+{
+	const char *dir = client->set->managesieve_compile_cache_dir;
+	string_t *data, *temp_path;
+	const char *path;
+	int fd;
+
+	i_assert(*dir != '\0');
+
+	data = t_str_new(256);
+	str_printfa(data, "%u %u %u %u %u\n",
+		    MANAGESIEVE_COMPILE_CACHE_VERSION,
+		    (result->valid ? 1 : 0), result->error_count,
+		    result->warning_count, result->cost);
+	str_append(data, result->messages);
+
+	temp_path = t_str_new(256);
+	fd = managesieve_compile_cache_create_temp(client, key, temp_path);
+	if (fd == -1)
+		return;
+
+	path = t_strconcat(dir, "/", key, NULL);
+	if (write_full(fd, str_data(data), str_len(data)) < 0) {
+		e_error(client->event, "compile cache: "
+			"write(%s) failed: %m", str_c(temp_path));
+	} else if (close(fd) < 0) {
+		fd = -1;
+		e_error(client->event, "compile cache: "
+			"close(%s) failed: %m", str_c(temp_path));
+	} else {
+		fd = -1;
+		/* Concurrent writers of the same key write the same data */
+		if (rename(str_c(temp_path), path) == 0) {
+			managesieve_compile_cache_prune(client);
+			return;
+		}
+		e_error(client->event, "compile cache: "
+			"rename(%s, %s) failed: %m", str_c(temp_path), path);
+	}
+
+	if (fd != -1)
+		i_close_fd(&fd);
+	i_unlink_if_exists(str_c(temp_path));
+}
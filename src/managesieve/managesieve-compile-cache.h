@@ -0,0 +1,31 @@
+#ifndef MANAGESIEVE_COMPILE_CACHE_H
+#define MANAGESIEVE_COMPILE_CACHE_H
+
+#include "sieve-types.h"
+
+struct client;
+struct sieve_script;
+
+struct managesieve_compile_result {
+	bool valid;
+	unsigned int error_count;
+	unsigned int warning_count;
+	unsigned int cost;
+
+	/* Diagnostics as sent to the client */
+	const char *messages;
+};
+
+/* Looks up the compile result for the uploaded script. Returns TRUE when it
+   was found. Otherwise, key_r is set to the key under which the result can
+   be added to the cache, or to NULL when the result cannot be cached. */
+bool managesieve_compile_cache_lookup(struct client *client,
+				      struct sieve_script *script,
+				      enum sieve_compile_flags cpflags,
+				      const char **key_r,
+				      struct managesieve_compile_result *result_r);
+void managesieve_compile_cache_update(
+	struct client *client, const char *key,
+	const struct managesieve_compile_result *result);
+
+#endif
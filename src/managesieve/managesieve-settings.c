@@ -73,6 +73,8 @@ static struct setting_define managesieve_setting_defines[] = {
 	DEF(SET_STR, managesieve_client_workarounds),
 	DEF(SET_STR, managesieve_logout_format),
 	DEF(SET_UINT, managesieve_max_compile_errors),
+	DEF(SET_STR, managesieve_compile_cache_dir),
+	DEF(SET_TIME, managesieve_compile_cache_max_age),
 
 
 	SETTING_DEFINE_LIST_END
@@ -90,7 +92,9 @@ static struct managesieve_settings managesieve_default_settings = {
 	.managesieve_implementation_string = DOVECOT_NAME " " PIGEONHOLE_NAME,
 	.managesieve_client_workarounds = "",
 	.managesieve_logout_format = "bytes=%i/%o",
-	.managesieve_max_compile_errors = 5
+	.managesieve_max_compile_errors = 5,
+	.managesieve_compile_cache_dir = "",
+	.managesieve_compile_cache_max_age = 7*24*60*60
 };
 
 static const struct setting_parser_info *managesieve_setting_dependencies[] = {
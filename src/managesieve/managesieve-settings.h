@@ -20,6 +20,8 @@ struct managesieve_settings {
 	const char *managesieve_client_workarounds;
 	const char *managesieve_logout_format;
 	unsigned int managesieve_max_compile_errors;
+	const char *managesieve_compile_cache_dir;
+	unsigned int managesieve_compile_cache_max_age;
 
 	enum managesieve_client_workarounds parsed_workarounds;
 };
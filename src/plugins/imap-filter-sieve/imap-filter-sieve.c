@@ -14,6 +14,7 @@
 #include "sieve.h"
 #include "sieve-storage.h"
 #include "sieve-script.h"
+#include "sieve-message.h"
 
 #include "imap-filter-sieve.h"
 
@@ -237,7 +238,8 @@ imap_filter_sieve_get_global_storage(struct imap_filter_sieve_context *sctx,
 		return -1;
 	}
 	ifsuser->global_storage =
-		sieve_storage_create(svinst, location, 0, &error);
+		sieve_storage_create(svinst, location,
+				     SIEVE_STORAGE_FLAG_GLOBAL, &error);
 	if (ifsuser->global_storage != NULL) {
 		*storage_r = ifsuser->global_storage;
 		return 0;
@@ -298,6 +300,8 @@ void imap_filter_sieve_context_free(struct imap_filter_sieve_context **_sctx)
 			sieve_script_unref(&scripts[i].script);
 	}
 
+	if (sctx->user_ehandler != NULL)
+		sieve_error_handler_unref(&sctx->user_ehandler);
 	if (sctx->trace_log != NULL)
 		sieve_trace_log_free(&sctx->trace_log);
 
@@ -322,6 +326,21 @@ imap_filter_sieve_create_error_handler(struct imap_filter_sieve_context *sctx)
 		10 /* client->set->_max_compile_errors */);
 }
 
+static struct sieve_error_handler *
+imap_filter_sieve_get_error_handler(struct imap_filter_sieve_context *sctx)
+{
+	/* The user error handler is shared by all messages of the command;
+	   reset it for the next message */
+	if (sctx->user_ehandler == NULL) {
+		sctx->user_ehandler =
+			imap_filter_sieve_create_error_handler(sctx);
+	} else {
+		str_truncate(sctx->errors, 0);
+		sieve_error_handler_reset(sctx->user_ehandler);
+	}
+	return sctx->user_ehandler;
+}
+
 /*
  *
  */
@@ -895,9 +914,48 @@ int imap_sieve_filter_run_init(struct imap_filter_sieve_context *sctx)
 	scriptenv->duplicate_check = imap_filter_sieve_duplicate_check;
 	scriptenv->duplicate_flush = imap_filter_sieve_duplicate_flush;
 	scriptenv->script_context = sctx;
+
+	/* Complete script execution environment; it is the same for all
+	   messages of the command */
+	imap_filter_sieve_init_trace_log(sctx, &scriptenv->trace_config,
+					 &scriptenv->trace_log);
+	scriptenv->default_mailbox =
+		mailbox_get_vname(sctx->filter_context->box);
+	scriptenv->result_amend_log_message =
+		imap_filter_sieve_result_amend_log_message;
 	return 0;
 }
 
+/* Header names used by imap_sieve_filter_get_msgdata() */
+static const char *const imap_filter_sieve_base_headers[] = {
+	"Return-Path", "Delivered-To", "Message-ID",
+};
+
+void imap_sieve_filter_get_wanted(struct imap_filter_sieve_context *sctx,
+				  enum mail_fetch_field *fields_r,
+				  const char *const **headers_r)
+{
+	struct imap_filter_sieve_script *scripts = sctx->scripts;
+	ARRAY_TYPE(const_string) headers;
+	unsigned int i;
+
+	*fields_r = 0;
+
+	t_array_init(&headers, 16);
+	array_append(&headers, imap_filter_sieve_base_headers,
+		     N_ELEMENTS(imap_filter_sieve_base_headers));
+
+	for (i = 0; i < sctx->scripts_count; i++) {
+		if (scripts[i].binary == NULL)
+			continue;
+		sieve_message_get_wanted_data(scripts[i].binary,
+					      &headers, fields_r);
+	}
+
+	array_append_zero(&headers);
+	*headers_r = array_front(&headers);
+}
+
 static void
 imap_sieve_filter_get_msgdata(struct imap_filter_sieve_context *sctx,
 			      struct mail *mail,
@@ -964,9 +1022,8 @@ int imap_sieve_filter_run_mail(struct imap_filter_sieve_context *sctx,
 	struct sieve_error_handler *user_ehandler;
 	struct sieve_message_data msgdata;
 	struct sieve_script_env *scriptenv = &sctx->scriptenv;
+	struct sieve_trace_log *trace_log = scriptenv->trace_log;
 	struct sieve_exec_status estatus;
-	struct sieve_trace_config trace_config;
-	struct sieve_trace_log *trace_log;
 	int ret;
 
 	*errors_r = NULL;
@@ -977,10 +1034,7 @@ int imap_sieve_filter_run_mail(struct imap_filter_sieve_context *sctx,
 	sctx->mail = mail;
 
 	/* Prepare error handler */
-	user_ehandler = imap_filter_sieve_create_error_handler(sctx);
-
-	/* Initialize trace logging */
-	imap_filter_sieve_init_trace_log(sctx, &trace_config, &trace_log);
+	user_ehandler = imap_filter_sieve_get_error_handler(sctx);
 
 	T_BEGIN {
 		if (trace_log != NULL) {
@@ -995,15 +1049,6 @@ int imap_sieve_filter_run_mail(struct imap_filter_sieve_context *sctx,
 
 		imap_sieve_filter_get_msgdata(sctx, mail, &msgdata);
 
-		/* Complete script execution environment */
-
-		scriptenv->default_mailbox = mailbox_get_vname(mail->box);
-		scriptenv->result_amend_log_message =
-			imap_filter_sieve_result_amend_log_message;
-		scriptenv->trace_log = trace_log;
-		scriptenv->trace_config = trace_config;
-		scriptenv->script_context = sctx;
-
 		scriptenv->exec_status = &estatus;
 
 		/* Execute script(s) */
@@ -1022,8 +1067,6 @@ int imap_sieve_filter_run_mail(struct imap_filter_sieve_context *sctx,
 	*have_changes_r = estatus.significant_action_executed;
 	*errors_r = sctx->errors;
 
-	sieve_error_handler_unref(&user_ehandler);
-
 	sctx->mail = NULL;
 
 	return ret;
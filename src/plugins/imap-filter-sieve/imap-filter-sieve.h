@@ -29,6 +29,7 @@ struct imap_filter_sieve_context {
 	struct mail *mail;
 
 	struct sieve_script_env scriptenv;
+	struct sieve_error_handler *user_ehandler;
 	struct sieve_trace_config trace_config;
 	struct sieve_trace_log *trace_log;
 
@@ -80,6 +81,9 @@ int imap_filter_sieve_open_global(struct imap_filter_sieve_context *sctx,
  */
 
 int imap_sieve_filter_run_init(struct imap_filter_sieve_context *sctx);
+void imap_sieve_filter_get_wanted(struct imap_filter_sieve_context *sctx,
+				  enum mail_fetch_field *fields_r,
+				  const char *const **headers_r);
 int imap_sieve_filter_run_mail(struct imap_filter_sieve_context *sctx,
 			       struct mail *mail, string_t **errors_r,
 			       bool *have_warnings_r, bool *have_changes_r);
@@ -141,6 +141,9 @@ imap_filter_start(struct imap_filter_context *ctx,
 		  struct mail_search_args *sargs)
 {
 	struct client_command_context *cmd = ctx->cmd;
+	struct mailbox_header_lookup_ctx *headers_ctx = NULL;
+	enum mail_fetch_field wanted_fields;
+	const char *const *wanted_headers;
 
 	imap_filter_args_check(ctx, sargs->args);
 
@@ -151,7 +154,18 @@ imap_filter_start(struct imap_filter_context *ctx,
 	ctx->trans = mailbox_transaction_begin(ctx->box, 0,
 					       imap_client_command_get_reason(cmd));
 	ctx->sargs = sargs;
-	ctx->search_ctx = mailbox_search_init(ctx->trans, sargs, NULL, 0, NULL);
+
+	/* Prefetch the message data used by the script(s) */
+	imap_sieve_filter_get_wanted(ctx->sieve, &wanted_fields,
+				     &wanted_headers);
+	if (wanted_headers != NULL) {
+		headers_ctx = mailbox_header_lookup_init(ctx->box,
+							 wanted_headers);
+	}
+	ctx->search_ctx = mailbox_search_init(ctx->trans, sargs, NULL,
+					      wanted_fields, headers_ctx);
+	if (headers_ctx != NULL)
+		mailbox_header_lookup_unref(&headers_ctx);
 
 	if (imap_sieve_filter_run_init(ctx->sieve) < 0) {
 		const char *error = t_strflocaltime(
@@ -20,6 +20,8 @@
 #define MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT "imapsieve/script"
 #define MAIL_SERVER_ATTRIBUTE_IMAPSIEVE_SCRIPT "imapsieve/script"
 
+#define IMAP_SIEVE_MAILBOX_RULES_CACHE_MAX 256
+
 #define IMAP_SIEVE_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, imap_sieve_user_module)
 #define IMAP_SIEVE_USER_CONTEXT_REQUIRE(obj) \
@@ -62,6 +64,10 @@ struct imap_sieve_mailbox_rule {
 	const char *const *causes;
 	const char *before, *after;
 	const char *copy_source_after;
+
+	/* Compiled wildcard patterns */
+	struct imap_match_glob *mailbox_glob, *from_glob;
+	char mailbox_glob_sep, from_glob_sep;
 };
 
 struct imap_sieve_user {
@@ -74,6 +80,10 @@ struct imap_sieve_user {
 	HASH_TABLE_TYPE(imap_sieve_mailbox_rule) mbox_rules;
 	ARRAY_TYPE(imap_sieve_mailbox_rule) mbox_patterns;
 
+	/* Matched rules per cause, destination and source mailbox */
+	pool_t mbox_rules_cache_pool;
+	HASH_TABLE(char *, struct imap_sieve_mailbox_rule **) mbox_rules_cache;
+
 	bool sieve_active:1;
 	bool user_script:1;
 	bool expunge_discarded:1;
@@ -780,7 +790,16 @@ imap_sieve_mailbox_transaction_run(
 
 	/* Cleanup */
 	mail_free(&mail);
-	ret = mailbox_transaction_commit(&st);
+
+	/* Commit the messages stored by the scripts before discarding
+	   anything, so that a failure cannot lose messages */
+	ret = imap_sieve_run_commit(isrun);
+	if (ret == 0 && isrun_src != NULL)
+		ret = imap_sieve_run_commit(isrun_src);
+	if (ret < 0)
+		mailbox_transaction_rollback(&st);
+	else
+		ret = mailbox_transaction_commit(&st);
 	if (src_mail != NULL)
 		mail_free(&src_mail);
 	imap_sieve_run_deinit(&isrun);
@@ -887,10 +906,44 @@ static bool rule_pattern_has_wildcards(const char *pattern)
 	return FALSE;
 }
 
+static bool
+imap_sieve_mailbox_rule_match_glob(struct imap_match_glob **glob,
+	char *glob_sep, const char *pattern, struct mailbox *box)
+{
+	char sep = mail_namespace_get_sep(mailbox_get_namespace(box));
+
+	/* Patterns are compiled for the hierarchy separator of the
+	   namespace; recompile only when it differs */
+	if (*glob == NULL || *glob_sep != sep) {
+		if (*glob != NULL)
+			imap_match_deinit(glob);
+		*glob = imap_match_init(default_pool, pattern, TRUE, sep);
+		*glob_sep = sep;
+	}
+	return (imap_match(*glob, mailbox_get_vname(box)) == IMAP_MATCH_YES);
+}
+
+static void
+imap_sieve_mailbox_rule_compile(struct imap_sieve_mailbox_rule *rule,
+	char sep)
+{
+	if (strcmp(rule->mailbox, "*") != 0) {
+		rule->mailbox_glob = imap_match_init(default_pool,
+			rule->mailbox, TRUE, sep);
+		rule->mailbox_glob_sep = sep;
+	}
+	if (rule->from != NULL) {
+		rule->from_glob = imap_match_init(default_pool,
+			rule->from, TRUE, sep);
+		rule->from_glob_sep = sep;
+	}
+}
+
 static void
 imap_sieve_mailbox_rules_init(struct mail_user *user)
 {
 	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT_REQUIRE(user);
+	struct mail_namespace *ns;
 	string_t *identifier;
 	unsigned int i = 0;
 	size_t prefix_len;
@@ -902,6 +955,8 @@ imap_sieve_mailbox_rules_init(struct mail_user *user)
 		imap_sieve_mailbox_rule_hash, imap_sieve_mailbox_rule_cmp);
 	i_array_init(&isuser->mbox_patterns, 8);
 
+	ns = mail_namespace_find_inbox(user->namespaces);
+
 	identifier = t_str_new(256);
 	str_append(identifier, "imapsieve_mailbox");
 	prefix_len = str_len(identifier);
@@ -1010,6 +1065,8 @@ imap_sieve_mailbox_rules_init(struct mail_user *user)
 				!rule_pattern_has_wildcards(mbrule->from))) {
 			hash_table_insert(isuser->mbox_rules, mbrule, mbrule);
 		} else {
+			imap_sieve_mailbox_rule_compile(mbrule,
+				mail_namespace_get_sep(ns));
 			array_append(&isuser->mbox_patterns, &mbrule, 1);
 		}
 	}
@@ -1042,38 +1099,26 @@ imap_sieve_mailbox_rules_match_patterns(struct mail_user *user,
 {
 	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT_REQUIRE(user);
 	struct imap_sieve_mailbox_rule *const *rule_idx;
-	struct mail_namespace *dst_ns, *src_ns;
 
 	if (array_count(&isuser->mbox_patterns) == 0)
 		return;
 
-	dst_ns = mailbox_get_namespace(dst_box);
-	src_ns = (src_box == NULL ? NULL :
-		mailbox_get_namespace(src_box));
-
 	array_foreach(&isuser->mbox_patterns, rule_idx) {
 		struct imap_sieve_mailbox_rule *rule = *rule_idx;
-		struct imap_match_glob *glob;
 
-		if (src_ns == NULL && rule->from != NULL)
+		if (src_box == NULL && rule->from != NULL)
 			continue;
 		if (!imap_sieve_mailbox_rule_match_cause(rule, cause))
 			continue;
 
-		if (strcmp(rule->mailbox, "*") != 0) {
-			glob = imap_match_init(pool_datastack_create(),
-				rule->mailbox, TRUE, mail_namespace_get_sep(dst_ns));
-			if (imap_match(glob, mailbox_get_vname(dst_box))
-				!= IMAP_MATCH_YES)
-				continue;
-		}
-		if (rule->from != NULL) {
-			glob = imap_match_init(pool_datastack_create(),
-				rule->from, TRUE, mail_namespace_get_sep(src_ns));
-			if (imap_match(glob, mailbox_get_vname(src_box))
-				!= IMAP_MATCH_YES)
-				continue;
-		}
+		if (strcmp(rule->mailbox, "*") != 0 &&
+			!imap_sieve_mailbox_rule_match_glob(&rule->mailbox_glob,
+				&rule->mailbox_glob_sep, rule->mailbox, dst_box))
+			continue;
+		if (rule->from != NULL &&
+			!imap_sieve_mailbox_rule_match_glob(&rule->from_glob,
+				&rule->from_glob_sep, rule->from, src_box))
+			continue;
 
 		imap_sieve_debug(user,
 			"Matched static mailbox rule [%u]",
@@ -1117,23 +1162,95 @@ imap_sieve_mailbox_rules_match(struct mail_user *user,
 	}
 }
 
+static void
+imap_sieve_mailbox_rules_cache_clear(struct imap_sieve_user *isuser)
+{
+	if (!hash_table_is_created(isuser->mbox_rules_cache))
+		return;
+	hash_table_destroy(&isuser->mbox_rules_cache);
+	pool_unref(&isuser->mbox_rules_cache_pool);
+}
+
+static const char *
+imap_sieve_mailbox_rules_cache_key(const char *dst_name,
+	const char *src_name, const char *cause)
+{
+	return t_strdup_printf("%s\n%s\n%s", t_str_ucase(cause),
+		dst_name, (src_name == NULL ? "" : src_name));
+}
+
+static bool
+imap_sieve_mailbox_rules_cache_get(struct mail_user *user, const char *key,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+{
+	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT_REQUIRE(user);
+	struct imap_sieve_mailbox_rule **cached, **rp;
+
+	if (!hash_table_is_created(isuser->mbox_rules_cache))
+		return FALSE;
+	cached = hash_table_lookup(isuser->mbox_rules_cache, key);
+	if (cached == NULL)
+		return FALSE;
+
+	for (rp = cached; *rp != NULL; rp++) {
+		imap_sieve_debug(user,
+			"Matched static mailbox rule [%u] (cached)",
+			(*rp)->index);
+		array_append(rules, rp, 1);
+	}
+	return TRUE;
+}
+
+static void
+imap_sieve_mailbox_rules_cache_add(struct mail_user *user, const char *key,
+	const ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+{
+	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT_REQUIRE(user);
+	struct imap_sieve_mailbox_rule **cached;
+	unsigned int count = array_count(rules);
+
+	if (hash_table_is_created(isuser->mbox_rules_cache) &&
+		hash_table_count(isuser->mbox_rules_cache) >=
+			IMAP_SIEVE_MAILBOX_RULES_CACHE_MAX)
+		imap_sieve_mailbox_rules_cache_clear(isuser);
+	if (!hash_table_is_created(isuser->mbox_rules_cache)) {
+		isuser->mbox_rules_cache_pool = pool_alloconly_create(
+			"imap sieve mailbox rules cache", 4096);
+		hash_table_create(&isuser->mbox_rules_cache,
+			isuser->mbox_rules_cache_pool, 0, str_hash, strcmp);
+	}
+
+	cached = p_new(isuser->mbox_rules_cache_pool,
+		struct imap_sieve_mailbox_rule *, count + 1);
+	if (count > 0)
+		memcpy(cached, array_front(rules), sizeof(*cached) * count);
+	hash_table_insert(isuser->mbox_rules_cache,
+		p_strdup(isuser->mbox_rules_cache_pool, key), cached);
+}
+
 static void
 imap_sieve_mailbox_rules_get(struct mail_user *user,
 	struct mailbox *dst_box, struct mailbox *src_box,
 	const char *cause,
 	ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
 {
-	const char *dst_name, *src_name;
+	const char *dst_name, *src_name, *key;
 
 	imap_sieve_mailbox_rules_init(user);
 
-	imap_sieve_mailbox_rules_match_patterns
-		(user, dst_box, src_box, cause, rules);
-
 	dst_name = mailbox_get_vname(dst_box);
 	src_name = (src_box == NULL ? NULL :
 		mailbox_get_vname(src_box));
 
+	/* The rules are static, so the outcome for the same mailboxes and
+	   cause is the same for the whole session */
+	key = imap_sieve_mailbox_rules_cache_key(dst_name, src_name, cause);
+	if (imap_sieve_mailbox_rules_cache_get(user, key, rules))
+		return;
+
+	imap_sieve_mailbox_rules_match_patterns
+		(user, dst_box, src_box, cause, rules);
+
 	imap_sieve_mailbox_rules_match
 		(user, dst_name, src_name, cause, rules);
 	imap_sieve_mailbox_rules_match
@@ -1144,6 +1261,8 @@ imap_sieve_mailbox_rules_get(struct mail_user *user,
 		imap_sieve_mailbox_rules_match
 			(user, "*", NULL, cause, rules);
 	}
+
+	imap_sieve_mailbox_rules_cache_add(user, key, rules);
 }
 
 /*
@@ -1157,9 +1276,21 @@ static void imap_sieve_user_deinit(struct mail_user *user)
 	if (isuser->isieve != NULL)
 		imap_sieve_deinit(&isuser->isieve);
 
+	imap_sieve_mailbox_rules_cache_clear(isuser);
 	hash_table_destroy(&isuser->mbox_rules);
-	if (array_is_created(&isuser->mbox_patterns))
+	if (array_is_created(&isuser->mbox_patterns)) {
+		struct imap_sieve_mailbox_rule *const *rule_idx;
+
+		array_foreach(&isuser->mbox_patterns, rule_idx) {
+			struct imap_sieve_mailbox_rule *rule = *rule_idx;
+
+			if (rule->mailbox_glob != NULL)
+				imap_match_deinit(&rule->mailbox_glob);
+			if (rule->from_glob != NULL)
+				imap_match_deinit(&rule->from_glob);
+		}
 		array_free(&isuser->mbox_patterns);
+	}
 
 	isuser->module_ctx.super.deinit(user);
 }
@@ -16,6 +16,7 @@
 #include "sieve.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
+#include "sieve-store-batch.h"
 
 #include "ext-imapsieve-common.h"
 
@@ -290,6 +291,13 @@ struct imap_sieve_run {
 	struct mailbox *dest_mailbox, *src_mailbox;
 	char *cause;
 
+	/* Script environment shared by all mails of this run */
+	struct sieve_script_env scriptenv;
+
+	/* Transactions for messages stored by the scripts, one per
+	   destination mailbox; committed once for all mails */
+	struct sieve_store_batch *stores;
+
 	struct sieve_error_handler *user_ehandler;
 	char *userlog;
 
@@ -301,6 +309,7 @@ struct imap_sieve_run {
 	unsigned int scripts_count;
 
 	bool trace_log_initialized:1;
+	bool scriptenv_initialized:1;
 };
 
 static void
@@ -482,6 +491,8 @@ void imap_sieve_run_deinit(struct imap_sieve_run **_isrun)
 
 	*_isrun = NULL;
 
+	sieve_store_batch_destroy(&isrun->stores);
+
 	for (i = 0; i < isrun->scripts_count; i++) {
 		if (isrun->scripts[i].binary != NULL)
 			sieve_close(&isrun->scripts[i].binary);
@@ -775,19 +786,85 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 					     scriptenv->exec_status);
 }
 
+static struct mailbox_transaction_context *
+imap_sieve_run_store_get_transaction(const struct sieve_script_env *senv,
+				     struct mailbox *box)
+{
+	struct imap_sieve_context *isctx = senv->script_context;
+	struct imap_sieve_run *isrun = isctx->isrun;
+
+	if (isrun->stores == NULL)
+		isrun->stores = sieve_store_batch_create();
+	return sieve_store_batch_get_transaction(isrun->stores, box);
+}
+
+/* Messages saved into these transactions were already reported as stored
+   by the store actions; a failure here is logged and makes the caller roll
+   back the discards, so that those messages are kept instead. */
+int imap_sieve_run_commit(struct imap_sieve_run *isrun)
+{
+	struct sieve_instance *svinst = isrun->isieve->svinst;
+	const char *error;
+
+	if (isrun->stores == NULL)
+		return 0;
+
+	if (sieve_store_batch_commit(isrun->stores, &error) < 0) {
+		e_error(sieve_get_event(svinst), "%s", error);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+imap_sieve_run_init_scriptenv(struct imap_sieve_run *isrun)
+{
+	struct imap_sieve *isieve = isrun->isieve;
+	struct sieve_instance *svinst = isieve->svinst;
+	struct mail_user *user = isieve->client->user;
+	struct sieve_script_env *scriptenv = &isrun->scriptenv;
+	const char *error;
+
+	if (isrun->scriptenv_initialized)
+		return 0;
+
+	if (sieve_script_env_init(scriptenv, user, &error) < 0) {
+		e_error(sieve_get_event(svinst),
+			"Failed to initialize script execution: %s",
+			error);
+		return -1;
+	}
+	isrun->scriptenv_initialized = TRUE;
+
+	scriptenv->smtp_start = imap_sieve_smtp_start;
+	scriptenv->smtp_add_rcpt = imap_sieve_smtp_add_rcpt;
+	scriptenv->smtp_send = imap_sieve_smtp_send;
+	scriptenv->smtp_abort = imap_sieve_smtp_abort;
+	scriptenv->smtp_finish = imap_sieve_smtp_finish;
+	scriptenv->duplicate_mark = imap_sieve_duplicate_mark;
+	scriptenv->duplicate_check = imap_sieve_duplicate_check;
+	scriptenv->duplicate_flush = imap_sieve_duplicate_flush;
+	scriptenv->store_get_transaction =
+		imap_sieve_run_store_get_transaction;
+	scriptenv->result_amend_log_message =
+		imap_sieve_result_amend_log_message;
+
+	/* Initialize trace logging */
+	imap_sieve_run_init_trace_log(isrun, &scriptenv->trace_config,
+				      &scriptenv->trace_log);
+	return 0;
+}
+
 int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 			const char *changed_flags)
 {
 	struct imap_sieve *isieve = isrun->isieve;
-	struct sieve_instance *svinst = isieve->svinst;
 	struct mail_user *user = isieve->client->user;
 	struct sieve_message_data msgdata;
-	struct sieve_script_env scriptenv;
+	struct sieve_script_env *scriptenv = &isrun->scriptenv;
 	struct sieve_exec_status estatus;
 	struct imap_sieve_context context;
-	struct sieve_trace_config trace_config;
 	struct sieve_trace_log *trace_log;
-	const char *error;
 	int ret;
 
 	i_zero(&context);
@@ -797,9 +874,12 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 	context.event.changed_flags = changed_flags;
 	context.mail = mail;
 	context.isieve = isieve;
+	context.isrun = isrun;
 
-	/* Initialize trace logging */
-	imap_sieve_run_init_trace_log(isrun, &trace_config, &trace_log);
+	/* Complete script execution environment */
+	if (imap_sieve_run_init_scriptenv(isrun) < 0)
+		return -1;
+	trace_log = scriptenv->trace_log;
 
 	T_BEGIN {
 		if (trace_log != NULL) {
@@ -821,39 +901,21 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 		msgdata.auth_user = user->username;
 		(void)mail_get_message_id(msgdata.mail, &msgdata.id);
 
-		/* Compose script execution environment */
+		/* The mail is not necessarily in the destination mailbox; the
+		   copy_source_after scripts run on the source mail */
+		scriptenv->default_mailbox = mailbox_get_vname(mail->box);
+		scriptenv->script_context = &context;
 
-		if (sieve_script_env_init(&scriptenv, user, &error) < 0) {
-			e_error(sieve_get_event(svinst),
-				"Failed to initialize script execution: %s",
-				error);
-			ret = -1;
-		} else {
-			scriptenv.default_mailbox =
-				mailbox_get_vname(mail->box);
-			scriptenv.smtp_start = imap_sieve_smtp_start;
-			scriptenv.smtp_add_rcpt = imap_sieve_smtp_add_rcpt;
-			scriptenv.smtp_send = imap_sieve_smtp_send;
-			scriptenv.smtp_abort = imap_sieve_smtp_abort;
-			scriptenv.smtp_finish = imap_sieve_smtp_finish;
-			scriptenv.duplicate_mark = imap_sieve_duplicate_mark;
-			scriptenv.duplicate_check = imap_sieve_duplicate_check;
-			scriptenv.duplicate_flush = imap_sieve_duplicate_flush;
-			scriptenv.result_amend_log_message =
-				imap_sieve_result_amend_log_message;
-			scriptenv.trace_log = trace_log;
-			scriptenv.trace_config = trace_config;
-			scriptenv.script_context = &context;
-
-			i_zero(&estatus);
-			scriptenv.exec_status = &estatus;
-
-			/* Execute script(s) */
-
-			ret = imap_sieve_run_scripts(isrun, &msgdata,
-						     &scriptenv);
-		}
+		i_zero(&estatus);
+		scriptenv->exec_status = &estatus;
+
+		/* Execute script(s) */
+
+		ret = imap_sieve_run_scripts(isrun, &msgdata, scriptenv);
 	} T_END;
 
+	scriptenv->default_mailbox = NULL;
+	scriptenv->script_context = NULL;
+	scriptenv->exec_status = NULL;
 	return ret;
 }
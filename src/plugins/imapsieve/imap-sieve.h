@@ -18,6 +18,7 @@ struct imap_sieve_context {
 	struct mail *mail;
 
 	struct imap_sieve *isieve;
+	struct imap_sieve_run *isrun;
 };
 
 static inline bool
@@ -53,6 +54,8 @@ int imap_sieve_run_init(struct imap_sieve *isieve, struct mailbox *dest_mailbox,
 
 int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 			const char *changed_flags);
+/* Commit the messages stored by the scripts for all mails of this run */
+int imap_sieve_run_commit(struct imap_sieve_run *isrun);
 
 void imap_sieve_run_deinit(struct imap_sieve_run **_isrun);
 
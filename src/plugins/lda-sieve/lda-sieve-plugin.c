@@ -257,20 +257,76 @@ lda_sieve_get_personal_storage(struct sieve_instance *svinst,
 	return 1;
 }
 
+struct lda_sieve_script_location {
+	const char *setting_name;
+	const char *location;
+
+	struct sieve_script_sequence *seq;
+	enum sieve_error error;
+};
+ARRAY_DEFINE_TYPE(lda_sieve_script_location, struct lda_sieve_script_location);
+
+/* Creates the script sequences for all configured locations of a kind
+   (sieve_before, sieve_before2, ...). Storages that support it start looking
+   up their scripts right away, so that the lookups for all locations proceed
+   concurrently while the other scripts are being located. */
+static void
+lda_sieve_multiscript_begin(struct sieve_instance *svinst,
+			    struct mail_user *user, const char *setting_prefix,
+			    ARRAY_TYPE(lda_sieve_script_location) *locations)
+{
+	struct lda_sieve_script_location *loc;
+	struct sieve_storage *storage;
+	const char *setting_name, *location;
+	unsigned int i = 2;
+
+	setting_name = setting_prefix;
+	location = mail_user_plugin_getenv(user, setting_name);
+	while (location != NULL && *location != '\0') {
+		loc = array_append_space(locations);
+		loc->setting_name = setting_name;
+		loc->location = location;
+		storage = sieve_storage_create(svinst, location,
+					       SIEVE_STORAGE_FLAG_GLOBAL,
+					       &loc->error);
+		if (storage != NULL) {
+			loc->seq = sieve_storage_get_script_sequence(
+				storage, &loc->error);
+			sieve_storage_unref(&storage);
+		}
+
+		setting_name = t_strdup_printf("%s%u", setting_prefix, i++);
+		location = mail_user_plugin_getenv(user, setting_name);
+	}
+}
+
+static void
+lda_sieve_multiscript_end(ARRAY_TYPE(lda_sieve_script_location) *locations)
+{
+	struct lda_sieve_script_location *loc;
+
+	array_foreach_modifiable(locations, loc) {
+		if (loc->seq != NULL)
+			sieve_script_sequence_free(&loc->seq);
+	}
+}
+
 static int
 lda_sieve_multiscript_get_scripts(struct sieve_instance *svinst,
-				  const char *label, const char *location,
+				  struct lda_sieve_script_location *loc,
 				  ARRAY_TYPE(sieve_script) *scripts,
 				  enum sieve_error *error_r)
 {
-	struct sieve_script_sequence *seq;
+	struct sieve_script_sequence *seq = loc->seq;
+	const char *label = loc->setting_name, *location = loc->location;
 	struct sieve_script *script;
 	bool finished = FALSE;
 	int ret = 1;
 
-	seq = sieve_script_sequence_create(svinst, location, error_r);
-	if (seq == NULL)
+	if (seq == NULL) {
+		*error_r = loc->error;
 		return (*error_r == SIEVE_ERROR_NOT_FOUND ? 0 : -1);
+	}
 
 	while (ret > 0 && !finished) {
 		script = sieve_script_sequence_next(seq, error_r);
@@ -294,7 +350,7 @@ lda_sieve_multiscript_get_scripts(struct sieve_instance *svinst,
 		array_append(scripts, &script, 1);
 	}
 
-	sieve_script_sequence_free(&seq);
+	sieve_script_sequence_free(&loc->seq);
 	return ret;
 }
 
@@ -665,20 +721,44 @@ static int lda_sieve_find_scripts(struct lda_sieve_run_context *srctx)
 	struct mail_deliver_context *mdctx = srctx->mdctx;
 	struct sieve_instance *svinst = srctx->svinst;
 	struct sieve_storage *main_storage;
-	const char *sieve_before, *sieve_after, *sieve_discard;
-	const char *setting_name;
-	enum sieve_error error;
+	const char *sieve_discard;
+	enum sieve_error error, discard_error = SIEVE_ERROR_NONE;
 	ARRAY_TYPE(sieve_script) script_sequence;
+	ARRAY_TYPE(lda_sieve_script_location) before_locations, after_locations;
+	struct lda_sieve_script_location *loc;
 	struct sieve_script *const *scripts;
+	struct sieve_script *discard_script = NULL;
 	unsigned int after_index, count, i;
 	int ret = 1;
 
+	/* Start looking up the global scripts */
+
+	t_array_init(&before_locations, 8);
+	t_array_init(&after_locations, 8);
+	lda_sieve_multiscript_begin(svinst, mdctx->rcpt_user, "sieve_before",
+				    &before_locations);
+	lda_sieve_multiscript_begin(svinst, mdctx->rcpt_user, "sieve_after",
+				    &after_locations);
+
+	sieve_discard = mail_user_plugin_getenv(
+		mdctx->rcpt_user, "sieve_discard");
+	if (sieve_discard != NULL && *sieve_discard != '\0') {
+		discard_script = sieve_script_create(svinst, sieve_discard,
+						     NULL, &discard_error);
+		if (discard_script != NULL)
+			sieve_script_open_begin(discard_script);
+	}
+
 	/* Find the personal script to execute */
 
 	ret = lda_sieve_get_personal_storage(svinst, mdctx->rcpt_user,
 					     &main_storage, &error);
-	if (ret == 0 && error == SIEVE_ERROR_NOT_POSSIBLE)
+	if (ret == 0 && error == SIEVE_ERROR_NOT_POSSIBLE) {
+		lda_sieve_multiscript_end(&before_locations);
+		lda_sieve_multiscript_end(&after_locations);
+		sieve_script_unref(&discard_script);
 		return 0;
+	}
 	if (ret > 0) {
 		srctx->main_script =
 			sieve_storage_active_script_open(main_storage, &error);
@@ -720,27 +800,18 @@ static int lda_sieve_find_scripts(struct lda_sieve_run_context *srctx)
 	
 	/* before */
 	if (ret >= 0) {
-		i = 2;
-		setting_name = "sieve_before";
-		sieve_before = mail_user_plugin_getenv(
-			mdctx->rcpt_user, setting_name);
-		while (ret >= 0 &&
-		       sieve_before != NULL && *sieve_before != '\0') {
+		array_foreach_modifiable(&before_locations, loc) {
 			ret = lda_sieve_multiscript_get_scripts(
-				svinst, setting_name, sieve_before,
-				&script_sequence, &error);
+				svinst, loc, &script_sequence, &error);
 			if (ret < 0 && error == SIEVE_ERROR_TEMP_FAILURE) {
 				ret = -1;
 				break;
 			} else if (ret == 0) {
 				e_debug(sieve_get_event(svinst),
 					"Location for %s not found: %s",
-					setting_name, sieve_before);
+					loc->setting_name, loc->location);
 			}
 			ret = 0;
-			setting_name = t_strdup_printf("sieve_before%u", i++);
-			sieve_before = mail_user_plugin_getenv(
-				mdctx->rcpt_user, setting_name);
 		}
 
 		if (ret >= 0) {
@@ -768,25 +839,18 @@ static int lda_sieve_find_scripts(struct lda_sieve_run_context *srctx)
 
 	/* after */
 	if (ret >= 0) {
-		i = 2;
-		setting_name = "sieve_after";
-		sieve_after = mail_user_plugin_getenv(mdctx->rcpt_user, setting_name);
-		while (sieve_after != NULL && *sieve_after != '\0') {
+		array_foreach_modifiable(&after_locations, loc) {
 			ret = lda_sieve_multiscript_get_scripts(
-				svinst, setting_name, sieve_after,
-				&script_sequence, &error);
+				svinst, loc, &script_sequence, &error);
 			if (ret < 0 && error == SIEVE_ERROR_TEMP_FAILURE) {
 				ret = -1;
 				break;
 			} else if (ret == 0) {
 				e_debug(sieve_get_event(svinst),
 					"Location for %s not found: %s",
-					setting_name, sieve_after);
+					loc->setting_name, loc->location);
 			}
 			ret = 0;
-			setting_name = t_strdup_printf("sieve_after%u", i++);
-			sieve_after = mail_user_plugin_getenv(
-				mdctx->rcpt_user, setting_name);
 		}
 
 		if (ret >= 0) {
@@ -799,14 +863,17 @@ static int lda_sieve_find_scripts(struct lda_sieve_run_context *srctx)
 		}
 	}
 
+	lda_sieve_multiscript_end(&before_locations);
+	lda_sieve_multiscript_end(&after_locations);
+
 	/* discard */
-	sieve_discard = mail_user_plugin_getenv(
-		mdctx->rcpt_user, "sieve_discard");
 	if (sieve_discard != NULL && *sieve_discard != '\0') {
-		srctx->discard_script = sieve_script_create_open(
-			svinst, sieve_discard, NULL, &error);
+		if (discard_script != NULL &&
+		    sieve_script_open(discard_script, &discard_error) < 0)
+			sieve_script_unref(&discard_script);
+		srctx->discard_script = discard_script;
 		if (srctx->discard_script == NULL) {
-			switch (error) {
+			switch (discard_error) {
 			case SIEVE_ERROR_NOT_FOUND:
 				e_debug(sieve_get_event(svinst),
 					"Location for sieve_discard not found: %s",
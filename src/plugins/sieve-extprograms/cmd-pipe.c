@@ -96,8 +96,13 @@ act_pipe_print(const struct sieve_action *action,
 	       const struct sieve_result_print_env *rpenv,
 	       bool *keep);	
 static int
+act_pipe_start(const struct sieve_action_exec_env *aenv, void **tr_context);
+static int
 act_pipe_commit(const struct sieve_action_exec_env *aenv,
 		void *tr_context, bool *keep);
+static int
+act_pipe_commit_wait(const struct sieve_action_exec_env *aenv,
+		     void *tr_context, bool *keep);
 
 /* Action object */
 
@@ -106,7 +111,9 @@ const struct sieve_action_def act_pipe = {
 	.flags = SIEVE_ACTFLAG_TRIES_DELIVER,
 	.check_duplicate = act_pipe_check_duplicate, 
 	.print = act_pipe_print,
-	.commit = act_pipe_commit
+	.start = act_pipe_start,
+	.commit = act_pipe_commit,
+	.commit_wait = act_pipe_commit_wait
 };
 
 /* Action context information */
@@ -117,6 +124,11 @@ struct ext_pipe_action {
 	bool try;
 };
 
+struct act_pipe_transaction {
+	/* Program still running after commit */
+	struct sieve_extprogram *sprog;
+};
+
 /*
  * Command registration
  */
@@ -329,35 +341,23 @@ act_pipe_print(const struct sieve_action *action,
 /* Result execution */
 
 static int
-act_pipe_commit(const struct sieve_action_exec_env *aenv,
-		void *tr_context ATTR_UNUSED, bool *keep)
+act_pipe_start(const struct sieve_action_exec_env *aenv,
+	       void **tr_context)
+{
+	pool_t pool = sieve_result_pool(aenv->result);
+
+	*tr_context = p_new(pool, struct act_pipe_transaction, 1);
+	return SIEVE_EXEC_OK;
+}
+
+static int
+act_pipe_finish(const struct sieve_action_exec_env *aenv, int ret,
+		enum sieve_error error, bool *keep)
 {
 	const struct sieve_action *action = aenv->action;
 	const struct sieve_execute_env *eenv = aenv->exec_env;
 	const struct ext_pipe_action *act =
 		(const struct ext_pipe_action *)action->context;
-	enum sieve_error error = SIEVE_ERROR_NONE;
-	struct mail *mail = (action->mail != NULL ?
-			     action->mail :
-			     sieve_message_get_mail(aenv->msgctx));
-	struct sieve_extprogram *sprog;
-	int ret;
-
-	sprog = sieve_extprogram_create(action->ext, eenv->scriptenv,
-					eenv->msgdata, "pipe",
-					act->program_name, act->args, &error);
-	if (sprog != NULL) {
-		if (sieve_extprogram_set_input_mail(sprog, mail) < 0) {
-			sieve_extprogram_destroy(&sprog);
-			return sieve_result_mail_error(
-				aenv, mail, "failed to read input message");
-		}
-		ret = sieve_extprogram_run(sprog);
-	} else {
-		ret = -1;
-	}
-	if (sprog != NULL)
-		sieve_extprogram_destroy(&sprog);
 
 	if (ret > 0) {
 		struct event_passthrough *e =
@@ -400,3 +400,54 @@ act_pipe_commit(const struct sieve_action_exec_env *aenv,
 	*keep = FALSE;
 	return SIEVE_EXEC_OK;
 }
+
+static int
+act_pipe_commit(const struct sieve_action_exec_env *aenv,
+		void *tr_context, bool *keep)
+{
+	const struct sieve_action *action = aenv->action;
+	const struct sieve_execute_env *eenv = aenv->exec_env;
+	const struct ext_pipe_action *act =
+		(const struct ext_pipe_action *)action->context;
+	struct act_pipe_transaction *trans =
+		(struct act_pipe_transaction *)tr_context;
+	enum sieve_error error = SIEVE_ERROR_NONE;
+	struct mail *mail = (action->mail != NULL ?
+			     action->mail :
+			     sieve_message_get_mail(aenv->msgctx));
+	struct sieve_extprogram *sprog;
+
+	sprog = sieve_extprogram_create(action->ext, eenv->scriptenv,
+					eenv->msgdata, "pipe",
+					act->program_name, act->args, &error);
+	if (sprog == NULL)
+		return act_pipe_finish(aenv, -1, error, keep);
+	if (sieve_extprogram_set_input_mail(sprog, mail) < 0) {
+		sieve_extprogram_destroy(&sprog);
+		return sieve_result_mail_error(
+			aenv, mail, "failed to read input message");
+	}
+
+	/* Let the program run alongside those of other pipe actions; the
+	   outcome is collected in act_pipe_commit_wait() */
+	sieve_extprogram_run_async(sprog);
+	trans->sprog = sprog;
+	return SIEVE_EXEC_OK;
+}
+
+static int
+act_pipe_commit_wait(const struct sieve_action_exec_env *aenv,
+		     void *tr_context, bool *keep)
+{
+	struct act_pipe_transaction *trans =
+		(struct act_pipe_transaction *)tr_context;
+	int ret;
+
+	if (trans->sprog == NULL)
+		return SIEVE_EXEC_OK;
+
+	ret = sieve_extprogram_wait(trans->sprog);
+	sieve_extprogram_destroy(&trans->sprog);
+
+	return act_pipe_finish(aenv, ret, SIEVE_ERROR_NONE, keep);
+}
@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "lib-signals.h"
 #include "str.h"
 #include "strfuncs.h"
@@ -14,6 +15,7 @@
 #include "istream-crlf.h"
 #include "istream-header-filter.h"
 #include "ostream.h"
+#include "iostream-temp.h"
 #include "mail-user.h"
 #include "mail-storage.h"
 
@@ -52,6 +54,9 @@
 #define SIEVE_EXTPROGRAMS_DEFAULT_EXEC_TIMEOUT_SECS 10
 #define SIEVE_EXTPROGRAMS_CONNECT_TIMEOUT_MSECS 5
 
+#define SIEVE_EXTPROGRAMS_DEFAULT_POOL_SIZE 1
+#define SIEVE_EXTPROGRAMS_DEFAULT_POOL_IDLE_TIMEOUT_SECS 60
+
 /*
  * Pipe Extension Context
  */
@@ -62,8 +67,9 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 	struct sieve_instance *svinst = ext->svinst;
 	struct sieve_extprograms_config *ext_config;
 	const char *extname = sieve_extension_name(ext);
-	const char *bin_dir, *socket_dir, *input_eol;
-	sieve_number_t execute_timeout;
+	const char *bin_dir, *socket_dir, *input_eol, *pool_programs;
+	sieve_number_t execute_timeout, pool_idle_timeout;
+	unsigned long long int pool_size;
 
 	extname = strrchr(extname, '.');
 	i_assert(extname != NULL);
@@ -98,6 +104,31 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 		ext_config->default_input_eol = SIEVE_EXTPROGRAMS_EOL_CRLF;
 		if (input_eol != NULL && strcasecmp(input_eol, "lf") == 0)
 			ext_config->default_input_eol = SIEVE_EXTPROGRAMS_EOL_LF;
+
+		/* Persistent program instances */
+		pool_programs = sieve_setting_get
+			(svinst, t_strdup_printf("sieve_%s_pool_programs", extname));
+		if ( bin_dir != NULL &&
+			pool_programs != NULL && *pool_programs != '\0' ) {
+			pool_size = SIEVE_EXTPROGRAMS_DEFAULT_POOL_SIZE;
+			(void)sieve_setting_get_uint_value
+				(svinst, t_strdup_printf("sieve_%s_pool_size", extname),
+					&pool_size);
+			pool_idle_timeout =
+				SIEVE_EXTPROGRAMS_DEFAULT_POOL_IDLE_TIMEOUT_SECS;
+			(void)sieve_setting_get_duration_value
+				(svinst, t_strdup_printf("sieve_%s_pool_idle_timeout", extname),
+					&pool_idle_timeout);
+
+			if ( pool_size > 0 ) {
+				ext_config->pool_programs =
+					p_strsplit_spaces(default_pool, pool_programs, " ,");
+				ext_config->pool_size =
+					(unsigned int)I_MIN(pool_size, UINT_MAX);
+				ext_config->pool_idle_timeout =
+					(unsigned int)pool_idle_timeout;
+			}
+		}
 	}
 
 	if ( sieve_extension_is(ext, sieve_ext_vnd_pipe) ) 
@@ -113,6 +144,8 @@ void sieve_extprograms_config_deinit
 	if ( *ext_config == NULL )
 		return;
 
+	if ( (*ext_config)->pool_programs != NULL )
+		p_strsplit_free(default_pool, (*ext_config)->pool_programs);
 	i_free((*ext_config)->bin_dir);
 	i_free((*ext_config)->socket_dir);
 	i_free((*ext_config));
@@ -370,11 +403,25 @@ int sieve_extprogram_command_read_operands
 
 struct sieve_extprogram {
 	struct sieve_instance *svinst;
-	const struct sieve_extprograms_config *ext_config;
+	struct sieve_extprograms_config *ext_config;
 
 	const struct sieve_script_env *scriptenv;
 	struct program_client_settings set;
 	struct program_client *program_client;
+
+	/* Asynchronous execution */
+	int async_ret;
+	bool async:1;
+
+	/* Pooled program instance used instead of the program client */
+	pool_t pool;
+	struct sieve_extprogram_worker *worker;
+	ARRAY_TYPE(const_string) env;
+	const char *const *args;
+	struct istream *input;
+	struct ostream *output;
+	struct istream *output_seekable;
+	bool output_seekable_wanted:1;
 };
 
 void sieve_extprogram_exec_error
@@ -402,6 +449,52 @@ void sieve_extprogram_exec_error
 	va_end(args);
 }
 
+static void sieve_extprogram_init_pooled
+(struct sieve_extprogram *sprog, const struct sieve_message_data *msgdata,
+	const char * const *args)
+{
+	const struct smtp_address *sender, *recipient, *orig_recipient;
+	const char *value;
+
+	sprog->pool = pool_alloconly_create("sieve extprogram", 512);
+	sprog->args = (const char *const *)p_strarray_dup(sprog->pool, args);
+	p_array_init(&sprog->env, sprog->pool, 6);
+
+	if ( sprog->svinst->username != NULL ) {
+		value = p_strconcat(sprog->pool, "USER=",
+			sprog->svinst->username, NULL);
+		array_append(&sprog->env, &value, 1);
+	}
+	if ( sprog->svinst->home_dir != NULL ) {
+		value = p_strconcat(sprog->pool, "HOME=",
+			sprog->svinst->home_dir, NULL);
+		array_append(&sprog->env, &value, 1);
+	}
+
+	sender = msgdata->envelope.mail_from;
+	recipient = msgdata->envelope.rcpt_to;
+	orig_recipient = NULL;
+	if ( msgdata->envelope.rcpt_params != NULL )
+		orig_recipient = msgdata->envelope.rcpt_params->orcpt.addr;
+
+	if ( !smtp_address_isnull(sender) ) {
+		value = p_strconcat(sprog->pool, "SENDER=",
+			smtp_address_encode(sender), NULL);
+		array_append(&sprog->env, &value, 1);
+	}
+	if ( !smtp_address_isnull(recipient) ) {
+		value = p_strconcat(sprog->pool, "RECIPIENT=",
+			smtp_address_encode(recipient), NULL);
+		array_append(&sprog->env, &value, 1);
+	}
+	if ( !smtp_address_isnull(orig_recipient) ) {
+		value = p_strconcat(sprog->pool, "ORIG_RECIPIENT=",
+			smtp_address_encode(orig_recipient), NULL);
+		array_append(&sprog->env, &value, 1);
+	}
+	array_append_zero(&sprog->env);
+}
+
 /* API */
 
 struct sieve_extprogram *sieve_extprogram_create
@@ -532,6 +625,19 @@ struct sieve_extprogram *sieve_extprogram_create
 		sprog->set.restrict_set.gid = senv->user->gid;
 	sprog->set.debug = svinst->debug;
 
+	if ( fork && ext_config->pool_programs != NULL &&
+		str_array_find((const char *const *)ext_config->pool_programs,
+			program_name) ) {
+		sprog->worker = sieve_extprograms_pool_get
+			(svinst, path, &sprog->set.restrict_set,
+				ext_config->pool_size, ext_config->pool_idle_timeout);
+	}
+
+	if ( sprog->worker != NULL ) {
+		sieve_extprogram_init_pooled(sprog, msgdata, args);
+		return sprog;
+	}
+
 	if ( fork ) {
 		sprog->program_client =
 			program_client_local_create(path, args, &sprog->set);
@@ -573,7 +679,34 @@ void sieve_extprogram_destroy(struct sieve_extprogram **_sprog)
 {
 	struct sieve_extprogram *sprog = *_sprog;
 
-	program_client_destroy(&sprog->program_client);
+	if ( sprog->worker != NULL ) {
+		/* Not run at all */
+		sieve_extprograms_pool_release(&sprog->worker, TRUE);
+	}
+	if ( sprog->pool != NULL ) {
+		if ( sprog->input != NULL )
+			i_stream_unref(&sprog->input);
+		if ( sprog->output != NULL )
+			o_stream_unref(&sprog->output);
+		if ( sprog->output_seekable != NULL )
+			i_stream_unref(&sprog->output_seekable);
+		pool_unref(&sprog->pool);
+	}
+	if ( sprog->program_client != NULL )
+		program_client_destroy(&sprog->program_client);
+	if ( sprog->async ) {
+		struct sieve_extprograms_config *ext_config = sprog->ext_config;
+
+		i_assert(ext_config->ioloop_refcount > 0);
+		if ( --ext_config->ioloop_refcount == 0 ) {
+			struct ioloop *prev_ioloop = current_ioloop;
+
+			io_loop_set_current(ext_config->ioloop);
+			io_loop_destroy(&ext_config->ioloop);
+			if ( prev_ioloop != NULL )
+				io_loop_set_current(prev_ioloop);
+		}
+	}
 	i_free(sprog);
 	*_sprog = NULL;
 }
@@ -583,6 +716,11 @@ void sieve_extprogram_destroy(struct sieve_extprogram **_sprog)
 void sieve_extprogram_set_output
 (struct sieve_extprogram *sprog, struct ostream *output)
 {
+	if ( sprog->worker != NULL ) {
+		o_stream_ref(output);
+		sprog->output = output;
+		return;
+	}
 	program_client_set_output(sprog->program_client, output);
 }
 
@@ -600,6 +738,11 @@ void sieve_extprogram_set_input
 		i_unreached();
 	}
 
+	if ( sprog->worker != NULL ) {
+		sprog->input = input;
+		return;
+	}
+
 	program_client_set_input(sprog->program_client, input);
 
 	i_stream_unref(&input);
@@ -612,12 +755,25 @@ void sieve_extprogram_set_output_seekable
 	prefix = t_str_new(128);
 	mail_user_set_get_temp_prefix(prefix, sprog->scriptenv->user->set);
 
+	if ( sprog->worker != NULL ) {
+		sprog->output = iostream_temp_create(str_c(prefix), 0);
+		sprog->output_seekable_wanted = TRUE;
+		return;
+	}
+
 	program_client_set_output_seekable(sprog->program_client, str_c(prefix));
 }
 
 struct istream *sieve_extprogram_get_output_seekable
 (struct sieve_extprogram *sprog)
 {
+	struct istream *input;
+
+	if ( sprog->pool != NULL ) {
+		input = sprog->output_seekable;
+		sprog->output_seekable = NULL;
+		return input;
+	}
 	return program_client_get_output_seekable(sprog->program_client);
 }
 
@@ -635,6 +791,79 @@ int sieve_extprogram_set_input_mail
 
 int sieve_extprogram_run(struct sieve_extprogram *sprog)
 {
-	return program_client_run(sprog->program_client);
+	int ret;
+
+	if ( sprog->worker == NULL )
+		return program_client_run(sprog->program_client);
+
+	ret = sieve_extprograms_pool_run(sprog->worker,
+		array_front(&sprog->env), sprog->args, sprog->input,
+		sprog->output, sprog->ext_config->execute_timeout);
+
+	/* A program that broke the protocol is not used again */
+	sieve_extprograms_pool_release(&sprog->worker, ret >= 0);
+
+	if ( sprog->output_seekable_wanted ) {
+		if ( ret > 0 ) {
+			sprog->output_seekable =
+				iostream_temp_finish(&sprog->output, IO_BLOCK_SIZE);
+			i_stream_seek(sprog->output_seekable, 0);
+		} else {
+			o_stream_unref(&sprog->output);
+		}
+	}
+	return ret;
+}
+
+static void
+sieve_extprogram_run_callback(int result, struct sieve_extprogram *sprog)
+{
+	sprog->async_ret = result;
+	io_loop_stop(sprog->ext_config->ioloop);
 }
 
+void sieve_extprogram_run_async(struct sieve_extprogram *sprog)
+{
+	struct sieve_extprograms_config *ext_config = sprog->ext_config;
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	i_assert(!sprog->async);
+	sprog->async = TRUE;
+
+	/* All programs run from the same I/O loop, which is only run once the
+	   caller waits for one of them. Until then, the programs proceed as far
+	   as their pipe buffers allow. */
+	if ( ext_config->ioloop == NULL )
+		ext_config->ioloop = io_loop_create();
+	else
+		io_loop_set_current(ext_config->ioloop);
+	ext_config->ioloop_refcount++;
+
+	if ( sprog->worker != NULL ) {
+		/* Pooled programs are fast to run; just do it right away */
+		sprog->async_ret = sieve_extprogram_run(sprog);
+	} else {
+		sprog->async_ret = -2;
+		program_client_run_async(sprog->program_client,
+			sieve_extprogram_run_callback, sprog);
+	}
+
+	if ( prev_ioloop != NULL )
+		io_loop_set_current(prev_ioloop);
+}
+
+int sieve_extprogram_wait(struct sieve_extprogram *sprog)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	i_assert(sprog->async);
+
+	if ( sprog->async_ret == -2 ) {
+		io_loop_set_current(sprog->ext_config->ioloop);
+		while ( sprog->async_ret == -2 )
+			io_loop_run(sprog->ext_config->ioloop);
+		if ( prev_ioloop != NULL )
+			io_loop_set_current(prev_ioloop);
+	}
+	return sprog->async_ret;
+}
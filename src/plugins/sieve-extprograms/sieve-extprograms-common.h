@@ -22,6 +22,15 @@ struct sieve_extprograms_config {
 	enum sieve_extprograms_eol default_input_eol;
 
 	unsigned int execute_timeout;
+
+	/* Programs kept running in the pool */
+	char **pool_programs;
+	unsigned int pool_size;
+	unsigned int pool_idle_timeout;
+
+	/* I/O loop shared by programs running asynchronously */
+	struct ioloop *ioloop;
+	unsigned int ioloop_refcount;
 };
 
 struct sieve_extprograms_config *sieve_extprograms_config_init
@@ -104,4 +113,35 @@ int sieve_extprogram_set_input_mail
 
 int sieve_extprogram_run(struct sieve_extprogram *sprog);
 
+/* Starts the program without waiting for it to finish, so that several
+   programs can run concurrently. The result is obtained using
+   sieve_extprogram_wait(), which returns the same as sieve_extprogram_run().
+ */
+void sieve_extprogram_run_async(struct sieve_extprogram *sprog);
+int sieve_extprogram_wait(struct sieve_extprogram *sprog);
+
+/*
+ * Program pool
+ */
+
+struct restrict_access_settings;
+struct sieve_extprogram_worker;
+
+/* Returns NULL when no instance of the program can be used right now. The
+   pool is shared by the whole process and stopped upon lib_deinit(). */
+struct sieve_extprogram_worker *
+sieve_extprograms_pool_get(struct sieve_instance *svinst, const char *path,
+			   const struct restrict_access_settings *restrict_set,
+			   unsigned int size, unsigned int idle_timeout);
+void sieve_extprograms_pool_release(struct sieve_extprogram_worker **_worker,
+				    bool reuse);
+
+/* Returns 1 on success, 0 when the program reported failure and -1 when
+   communication with the program failed */
+int sieve_extprograms_pool_run(struct sieve_extprogram_worker *worker,
+			       const char *const *env,
+			       const char *const *args,
+			       struct istream *input, struct ostream *output,
+			       unsigned int timeout_secs);
+
 #endif
@@ -0,0 +1,557 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "strnum.h"
+#include "strescape.h"
+#include "str-sanitize.h"
+#include "time-util.h"
+#include "env-util.h"
+#include "fd-set-nonblock.h"
+#include "fd-close-on-exec.h"
+#include "restrict-access.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "sieve-common.h"
+
+#include "sieve-extprograms-common.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+/*
+ * Program pool
+ *
+ * Programs listed in sieve_<extension>_pool_programs are started once and
+ * kept running to handle many requests. They communicate with a simple
+ * framed protocol over their standard input and output:
+ *
+ *   Request:  "ENV" [TAB <name>=<value>]* LF
+ *             "ARGS" [TAB <argument>]* LF
+ *             input data chunks
+ *   Response: output data chunks
+ *             "OK" LF | "FAIL" LF
+ *
+ * Data chunks are each sent as "<size>" LF followed by that many bytes and
+ * the data ends with a chunk of size 0. Fields in the ENV and ARGS lines are
+ * tab-escaped. The program must read the full request before writing its
+ * response, which must be complete within the execution timeout.
+ */
+
+#define SIEVE_EXTPROGRAMS_POOL_MAX_LINE_LEN 1024
+
+/* How long a stopped program gets to exit before it is killed */
+#define SIEVE_EXTPROGRAMS_POOL_KILL_TIMEOUT_MSECS 1000
+
+struct sieve_extprogram_worker {
+	struct sieve_extprograms_pool_entry *entry;
+
+	pid_t pid;
+	int fd;
+	struct istream *input;
+
+	time_t last_used;
+};
+
+struct sieve_extprograms_pool_entry {
+	char *key;
+	char *path;
+
+	ARRAY(struct sieve_extprogram_worker *) idle;
+	unsigned int workers;
+};
+
+/* The pool lives as long as the process rather than the Sieve instance,
+   which LDA and LMTP create anew for every delivery. Programs are kept
+   apart by path and by the credentials they were started with. */
+static HASH_TABLE(char *, struct sieve_extprograms_pool_entry *)
+	sieve_extprograms_pool_entries;
+/* Forked children inherit the pool, including the lib_atexit() handler;
+   only the process that started the programs may stop them */
+static pid_t sieve_extprograms_pool_owner_pid;
+
+static bool
+sieve_extprogram_worker_wait_exit(struct sieve_extprogram_worker *worker,
+				  unsigned int timeout_msecs)
+{
+	unsigned int waited = 0;
+	int status;
+	pid_t ret;
+
+	for (;;) {
+		ret = waitpid(worker->pid, &status, WNOHANG);
+		if (ret != 0 && !(ret < 0 && errno == EINTR))
+			return TRUE;
+		if (waited >= timeout_msecs)
+			return FALSE;
+		usleep(10*1000);
+		waited += 10;
+	}
+}
+
+static void
+sieve_extprogram_worker_destroy(struct sieve_extprogram_worker **_worker)
+{
+	struct sieve_extprogram_worker *worker = *_worker;
+	int status;
+
+	*_worker = NULL;
+
+	i_assert(worker->entry->workers > 0);
+	worker->entry->workers--;
+
+	/* Closing the connection tells the program to finish */
+	i_stream_destroy(&worker->input);
+	i_close_fd(&worker->fd);
+
+	if (!sieve_extprogram_worker_wait_exit(worker, 0) &&
+	    kill(worker->pid, SIGTERM) == 0 &&
+	    !sieve_extprogram_worker_wait_exit(
+		worker, SIEVE_EXTPROGRAMS_POOL_KILL_TIMEOUT_MSECS)) {
+		i_warning("extprograms: pooled program `%s' (pid=%s) "
+			  "ignored SIGTERM; killing it",
+			  worker->entry->path, dec2str(worker->pid));
+		if (kill(worker->pid, SIGKILL) == 0)
+			(void)waitpid(worker->pid, &status, 0);
+	}
+	i_free(worker);
+}
+
+static void sieve_extprograms_pool_deinit(void)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_extprograms_pool_entry *entry;
+	struct sieve_extprogram_worker **workerp;
+	char *key;
+
+	if (getpid() != sieve_extprograms_pool_owner_pid)
+		return;
+
+	iter = hash_table_iterate_init(sieve_extprograms_pool_entries);
+	while (hash_table_iterate(iter, sieve_extprograms_pool_entries,
+				  &key, &entry)) {
+		array_foreach_modifiable(&entry->idle, workerp)
+			sieve_extprogram_worker_destroy(workerp);
+		array_free(&entry->idle);
+		i_free(entry->path);
+		i_free(entry->key);
+		i_free(entry);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&sieve_extprograms_pool_entries);
+}
+
+static struct sieve_extprogram_worker *
+sieve_extprogram_worker_create(struct sieve_instance *svinst,
+			       struct sieve_extprograms_pool_entry *entry,
+			       const struct restrict_access_settings *restrict_set,
+			       unsigned int idle_timeout)
+{
+	struct sieve_extprogram_worker *worker;
+	const char *argv[2];
+	int fds[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		e_error(svinst->event, "socketpair() failed: %m");
+		return NULL;
+	}
+
+	if ((pid = fork()) == (pid_t)-1) {
+		e_error(svinst->event, "fork() failed: %m");
+		i_close_fd(&fds[0]);
+		i_close_fd(&fds[1]);
+		return NULL;
+	}
+
+	if (pid == 0) {
+		/* Child */
+		i_close_fd(&fds[0]);
+		if (dup2(fds[1], STDIN_FILENO) < 0 ||
+		    dup2(fds[1], STDOUT_FILENO) < 0) {
+			i_error("dup2() failed: %m");
+			_exit(EXIT_FAILURE);
+		}
+		if (fds[1] > STDOUT_FILENO)
+			i_close_fd(&fds[1]);
+
+		restrict_access(restrict_set, 0, NULL);
+
+		/* USER and HOME are sent with each request, since the program
+		   may serve several users with the same credentials */
+		env_clean();
+		if (svinst->hostname != NULL)
+			env_put(t_strconcat("HOST=", svinst->hostname, NULL));
+		env_put("SIEVE_EXTPROGRAMS_POOL=1");
+		env_put(t_strdup_printf("SIEVE_EXTPROGRAMS_IDLE_TIMEOUT=%u",
+					idle_timeout));
+
+		argv[0] = entry->path;
+		argv[1] = NULL;
+		execv(argv[0], (char **)argv);
+
+		/* Not i_fatal(): that would run the parent's lib_atexit()
+		   handlers in this child */
+		i_error("execv(%s) failed: %m", argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Parent */
+	i_close_fd(&fds[1]);
+	fd_set_nonblock(fds[0], TRUE);
+	fd_close_on_exec(fds[0], TRUE);
+
+	e_debug(svinst->event, "extprograms: "
+		"started pooled program `%s' (pid=%s)",
+		entry->path, dec2str(pid));
+
+	worker = i_new(struct sieve_extprogram_worker, 1);
+	worker->entry = entry;
+	worker->pid = pid;
+	worker->fd = fds[0];
+	worker->input = i_stream_create_fd(worker->fd,
+					   SIEVE_EXTPROGRAMS_POOL_MAX_LINE_LEN);
+	entry->workers++;
+	return worker;
+}
+
+static bool
+sieve_extprogram_worker_is_alive(struct sieve_extprogram_worker *worker)
+{
+	struct pollfd pfd;
+
+	/* An idle program has nothing to say; anything readable means that
+	   it exited or broke the protocol */
+	i_zero(&pfd);
+	pfd.fd = worker->fd;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, 0) == 0);
+}
+
+static struct sieve_extprograms_pool_entry *
+sieve_extprograms_pool_get_entry(const char *path,
+				 const struct restrict_access_settings *restrict_set,
+				 unsigned int size)
+{
+	struct sieve_extprograms_pool_entry *entry;
+	const char *key;
+
+	key = t_strdup_printf("%s\t%s\t%s\t%s", path,
+			      dec2str(restrict_set->uid),
+			      dec2str(restrict_set->gid),
+			      (restrict_set->chroot_dir == NULL ?
+			       "" : restrict_set->chroot_dir));
+
+	if (!hash_table_is_created(sieve_extprograms_pool_entries)) {
+		hash_table_create(&sieve_extprograms_pool_entries,
+				  default_pool, 0, str_hash, strcmp);
+		sieve_extprograms_pool_owner_pid = getpid();
+		lib_atexit(sieve_extprograms_pool_deinit);
+	}
+
+	entry = hash_table_lookup(sieve_extprograms_pool_entries, key);
+	if (entry == NULL) {
+		entry = i_new(struct sieve_extprograms_pool_entry, 1);
+		entry->key = i_strdup(key);
+		entry->path = i_strdup(path);
+		i_array_init(&entry->idle, size);
+		hash_table_insert(sieve_extprograms_pool_entries,
+				  entry->key, entry);
+	}
+	return entry;
+}
+
+struct sieve_extprogram_worker *
+sieve_extprograms_pool_get(struct sieve_instance *svinst, const char *path,
+			   const struct restrict_access_settings *restrict_set,
+			   unsigned int size, unsigned int idle_timeout)
+{
+	struct sieve_extprograms_pool_entry *entry;
+	struct sieve_extprogram_worker *worker, *const *workers;
+	unsigned int count, i;
+
+	entry = sieve_extprograms_pool_get_entry(path, restrict_set, size);
+
+	/* Drop programs that were idle for too long or that exited */
+	workers = array_get(&entry->idle, &count);
+	for (i = count; i > 0; i--) {
+		worker = workers[i-1];
+		if (worker->last_used + (time_t)idle_timeout > ioloop_time &&
+		    sieve_extprogram_worker_is_alive(worker))
+			continue;
+		array_delete(&entry->idle, i-1, 1);
+		sieve_extprogram_worker_destroy(&worker);
+		workers = array_get(&entry->idle, &count);
+	}
+
+	workers = array_get(&entry->idle, &count);
+	if (count > 0) {
+		worker = workers[count-1];
+		array_delete(&entry->idle, count - 1, 1);
+		return worker;
+	}
+
+	/* All instances are busy; caller falls back to a one-shot program */
+	if (entry->workers >= size)
+		return NULL;
+
+	return sieve_extprogram_worker_create(svinst, entry, restrict_set,
+					      idle_timeout);
+}
+
+void sieve_extprograms_pool_release(struct sieve_extprogram_worker **_worker,
+				    bool reuse)
+{
+	struct sieve_extprogram_worker *worker = *_worker;
+
+	*_worker = NULL;
+
+	if (!reuse) {
+		sieve_extprogram_worker_destroy(&worker);
+		return;
+	}
+	worker->last_used = ioloop_time;
+	array_append(&worker->entry->idle, &worker, 1);
+}
+
+/*
+ * Protocol
+ */
+
+static int
+sieve_extprogram_worker_wait(struct sieve_extprogram_worker *worker,
+			     short events, const struct timeval *deadline)
+{
+	struct pollfd pfd;
+	struct timeval now;
+	long long timeout_msecs;
+	int ret;
+
+	/* The timeout applies to the request as a whole */
+	i_gettimeofday(&now);
+	timeout_msecs = timeval_diff_msecs(deadline, &now);
+	if (timeout_msecs < 0)
+		timeout_msecs = 0;
+
+	i_zero(&pfd);
+	pfd.fd = worker->fd;
+	pfd.events = events;
+	ret = poll(&pfd, 1, (int)timeout_msecs);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		i_error("poll() failed: %m");
+		return -1;
+	}
+	if (ret == 0) {
+		i_error("extprograms: pooled program `%s' (pid=%s) "
+			"timed out", worker->entry->path, dec2str(worker->pid));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sieve_extprogram_worker_send(struct sieve_extprogram_worker *worker,
+			     const void *data, size_t size,
+			     const struct timeval *deadline)
+{
+	const unsigned char *p = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = send(worker->fd, p, size, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				i_error("extprograms: "
+					"send() to pooled program `%s' failed: %m",
+					worker->entry->path);
+				return -1;
+			}
+			if (sieve_extprogram_worker_wait(worker, POLLOUT,
+							 deadline) < 0)
+				return -1;
+			continue;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+static int
+sieve_extprogram_worker_read(struct sieve_extprogram_worker *worker,
+			     const struct timeval *deadline)
+{
+	ssize_t ret;
+
+	while ((ret = i_stream_read(worker->input)) == 0) {
+		if (sieve_extprogram_worker_wait(worker, POLLIN,
+						 deadline) < 0)
+			return -1;
+	}
+	if (ret == -2) {
+		i_error("extprograms: pooled program `%s' "
+			"sent an overlong line", worker->entry->path);
+		return -1;
+	}
+	if (ret < 0) {
+		i_error("extprograms: pooled program `%s' "
+			"disconnected unexpectedly", worker->entry->path);
+		return -1;
+	}
+	return 0;
+}
+
+static const char *
+sieve_extprogram_worker_read_line(struct sieve_extprogram_worker *worker,
+				  const struct timeval *deadline)
+{
+	const char *line;
+
+	while ((line = i_stream_next_line(worker->input)) == NULL) {
+		if (sieve_extprogram_worker_read(worker, deadline) < 0)
+			return NULL;
+	}
+	return line;
+}
+
+static int
+sieve_extprogram_worker_send_input(struct sieve_extprogram_worker *worker,
+				   struct istream *input,
+				   const struct timeval *deadline)
+{
+	const unsigned char *data;
+	const char *header;
+	size_t size;
+	int ret;
+
+	/* A return of 0 only means that no data is available yet; the input
+	   ends at -1 */
+	while ((ret = i_stream_read_more(input, &data, &size)) != -1) {
+		if (ret == 0)
+			continue;
+		header = t_strdup_printf("%zu\n", size);
+		if (sieve_extprogram_worker_send(worker, header, strlen(header),
+						 deadline) < 0 ||
+		    sieve_extprogram_worker_send(worker, data, size,
+						 deadline) < 0)
+			return -1;
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		i_error("extprograms: read(%s) failed: %s",
+			i_stream_get_name(input), i_stream_get_error(input));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sieve_extprogram_worker_read_output(struct sieve_extprogram_worker *worker,
+				    struct ostream *output,
+				    const struct timeval *deadline)
+{
+	const unsigned char *data;
+	const char *line;
+	size_t size, chunk, avail;
+
+	for (;;) {
+		line = sieve_extprogram_worker_read_line(worker, deadline);
+		if (line == NULL)
+			return -1;
+		if (str_to_size(line, &chunk) < 0) {
+			i_error("extprograms: pooled program `%s' "
+				"sent invalid chunk size `%s'",
+				worker->entry->path, str_sanitize(line, 64));
+			return -1;
+		}
+		if (chunk == 0)
+			return 0;
+
+		while (chunk > 0) {
+			data = i_stream_get_data(worker->input, &avail);
+			if (avail == 0) {
+				if (sieve_extprogram_worker_read(
+					worker, deadline) < 0)
+					return -1;
+				continue;
+			}
+			size = I_MIN(avail, chunk);
+			if (output != NULL &&
+			    o_stream_send(output, data, size) < 0) {
+				i_error("extprograms: write(%s) failed: %s",
+					o_stream_get_name(output),
+					o_stream_get_error(output));
+				return -1;
+			}
+			i_stream_skip(worker->input, size);
+			chunk -= size;
+		}
+	}
+}
+
+int sieve_extprograms_pool_run(struct sieve_extprogram_worker *worker,
+			       const char *const *env,
+			       const char *const *args,
+			       struct istream *input, struct ostream *output,
+			       unsigned int timeout_secs)
+{
+	struct timeval deadline_tv;
+	const struct timeval *deadline = &deadline_tv;
+	string_t *request;
+	const char *line;
+	int ret = -1;
+
+	i_gettimeofday(&deadline_tv);
+	deadline_tv.tv_sec += timeout_secs;
+
+	T_BEGIN {
+		request = t_str_new(256);
+		str_append(request, "ENV");
+		for (; env != NULL && *env != NULL; env++) {
+			str_append_c(request, '\t');
+			str_append_tabescaped(request, *env);
+		}
+		str_append(request, "\nARGS");
+		for (; args != NULL && *args != NULL; args++) {
+			str_append_c(request, '\t');
+			str_append_tabescaped(request, *args);
+		}
+		str_append_c(request, '\n');
+
+		if (sieve_extprogram_worker_send(worker, str_data(request),
+						 str_len(request),
+						 deadline) == 0 &&
+		    (input == NULL ||
+		     sieve_extprogram_worker_send_input(worker, input,
+							deadline) == 0) &&
+		    sieve_extprogram_worker_send(worker, "0\n", 2,
+						 deadline) == 0 &&
+		    sieve_extprogram_worker_read_output(worker, output,
+							deadline) == 0 &&
+		    (line = sieve_extprogram_worker_read_line(
+			worker, deadline)) != NULL) {
+			if (strcmp(line, "OK") == 0)
+				ret = 1;
+			else if (strcmp(line, "FAIL") == 0)
+				ret = 0;
+			else {
+				i_error("extprograms: pooled program `%s' "
+					"sent invalid status `%s'",
+					worker->entry->path,
+					str_sanitize(line, 64));
+			}
+		}
+	} T_END;
+	return ret;
+}
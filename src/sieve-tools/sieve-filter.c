@@ -6,16 +6,22 @@
 #include "ioloop.h"
 #include "env-util.h"
 #include "str.h"
+#include "strnum.h"
 #include "str-sanitize.h"
 #include "ostream.h"
 #include "array.h"
+#include "seq-range-array.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
 
 #include "sieve.h"
+#include "sieve-common.h"
 #include "sieve-extensions.h"
+#include "sieve-script.h"
 #include "sieve-binary.h"
+#include "sieve-message.h"
+#include "sieve-store-batch.h"
 
 #include "sieve-tool.h"
 
@@ -24,6 +30,10 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <sysexits.h>
+#include <sys/wait.h>
+
+#define SIEVE_FILTER_MAX_WORKERS 64
+#define SIEVE_FILTER_CHECKPOINT_MESSAGES 1000
 
 /*
  * Print help
@@ -33,8 +43,9 @@ static void print_help(void)
 {
 	printf(
 "Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
-"                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
-"                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
+"                    [-j <workers>] [-P <plugin>] [-q <output-mailbox>]\n"
+"                    [-Q <mail-command>] [-s <script-file>] [-u <user>] [-v]\n"
+"                    [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
 }
@@ -49,6 +60,11 @@ enum sieve_filter_discard_action {
 struct sieve_filter_data {
 	enum sieve_filter_discard_action discard_action;
 	struct mailbox *move_mailbox;
+	enum mailbox_flags open_flags;
+
+	/* Message data prefetched while iterating the source mailbox */
+	enum mail_fetch_field wanted_fields;
+	const char *const *wanted_headers;
 
 	struct sieve_script_env *senv;
 	struct sieve_binary *main_sbin;
@@ -61,9 +77,14 @@ struct sieve_filter_data {
 
 struct sieve_filter_context {
 	const struct sieve_filter_data *data;
+	const struct sieve_message_data *msgdata;
 
 	struct mailbox_transaction_context *move_trans;
 
+	/* Transactions for messages stored by the script, one per
+	   destination mailbox; committed at each checkpoint */
+	struct sieve_store_batch *stores;
+
 	struct ostream *teststream;
 };
 
@@ -71,7 +92,8 @@ static const char *
 result_amend_log_message(const struct sieve_script_env *senv,
 			 enum log_type log_type, const char *message)
 {
-	const struct sieve_message_data *msgdata = senv->script_context;
+	const struct sieve_filter_context *sfctx = senv->script_context;
+	const struct sieve_message_data *msgdata = sfctx->msgdata;
 	string_t *str;
 
 	if (log_type == LOG_TYPE_DEBUG)
@@ -86,6 +108,34 @@ result_amend_log_message(const struct sieve_script_env *senv,
 	return str_c(str);
 }
 
+/*
+ * Batched storing
+ */
+
+static struct mailbox_transaction_context *
+filter_store_get_transaction(const struct sieve_script_env *senv,
+			     struct mailbox *box)
+{
+	struct sieve_filter_context *sfctx = senv->script_context;
+
+	return sieve_store_batch_get_transaction(sfctx->stores, box);
+}
+
+static int filter_stores_commit(struct sieve_filter_context *sfctx)
+{
+	const char *error;
+
+	if (sieve_store_batch_commit(sfctx->stores, &error) < 0) {
+		sieve_error(sfctx->data->ehandler, NULL, "%s", error);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Message filtering
+ */
+
 static int filter_message(struct sieve_filter_context *sfctx, struct mail *mail)
 {
 	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
@@ -109,7 +159,8 @@ static int filter_message(struct sieve_filter_context *sfctx, struct mail *mail)
 	msgdata.mail = mail;
 	msgdata.auth_user = senv->user->username;
 	(void)mail_get_message_id(mail, &msgdata.id);
-	senv->script_context = &msgdata;
+	sfctx->msgdata = &msgdata;
+	senv->script_context = sfctx;
 
 	sieve_tool_get_envelope_data(&msgdata, mail, NULL, NULL, NULL);
 
@@ -282,40 +333,112 @@ mail_search_build_add_flags(struct mail_search_args *args,
 	args->args = arg;
 }
 
+static void
+mail_search_build_add_uidset(struct mail_search_args *args,
+			     const ARRAY_TYPE(seq_range) *uids)
+{
+	struct mail_search_arg *arg;
+
+	arg = p_new(args->pool, struct mail_search_arg, 1);
+	arg->type = SEARCH_UIDSET;
+	p_array_init(&arg->value.seqset, args->pool, array_count(uids));
+	array_append_array(&arg->value.seqset, uids);
+
+	arg->next = args->args;
+	args->args = arg;
+}
+
+/*
+ * Prefetching
+ */
+
+/* Headers used by sieve-filter itself */
+static const char *const filter_base_headers[] = {
+	"Message-ID", "Date", "Subject",
+	/* Envelope substitutes */
+	"Return-Path", "Sender", "From", "Envelope-To", "To",
+};
+
+/* Determine the message data needed by the script, so that it can be
+   prefetched for all messages. */
+static void
+filter_get_wanted(struct sieve_binary *sbin,
+		  const char *const **headers_r, enum mail_fetch_field *fields_r)
+{
+	ARRAY_TYPE(const_string) headers;
+
+	*fields_r = MAIL_FETCH_VIRTUAL_SIZE;
+
+	t_array_init(&headers, 32);
+	array_append(&headers, filter_base_headers,
+		     N_ELEMENTS(filter_base_headers));
+
+	sieve_message_get_wanted_data(sbin, &headers, fields_r);
+
+	array_append_zero(&headers);
+	*headers_r = array_front(&headers);
+}
+
+/*
+ * Mailbox filtering
+ */
+
 static int
-filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+filter_get_uids(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+		const ARRAY_TYPE(seq_range) *range, ARRAY_TYPE(uint32_t) *uids)
 {
-	struct sieve_filter_context sfctx;
-	struct mailbox *move_box = sfdata->move_mailbox;
-	struct sieve_error_handler *ehandler = sfdata->ehandler;
 	struct mail_search_args *search_args;
 	struct mailbox_transaction_context *t;
 	struct mail_search_context *search_ctx;
 	struct mail *mail;
-	int ret = 1;
-
-	/* Sync source mailbox */
+	int ret = 0;
 
 	if (mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0) {
-		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		sieve_error(sfdata->ehandler, NULL,
+			    "failed to sync source mailbox");
 		return -1;
 	}
 
-	/* Initialize */
+	search_args = mail_search_build_init();
+	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	if (range != NULL)
+		mail_search_build_add_uidset(search_args, range);
 
-	i_zero(&sfctx);
-	sfctx.data = sfdata;
+	t = mailbox_transaction_begin(src_box, 0, __func__);
+	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
 
-	/* Create test stream */
-	if (!sfdata->execute) {
-		sfctx.teststream = o_stream_create_fd(1, 0);
-		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
-	}
+	while (mailbox_search_next(search_ctx, &mail))
+		array_append(uids, &mail->uid, 1);
+
+	if (mailbox_search_deinit(&search_ctx) < 0)
+		ret = -1;
+	(void)mailbox_transaction_commit(&t);
+	return ret;
+}
+
+/* Filters the messages of one checkpoint. Messages stored by the script are
+   committed to their destination mailboxes before the changes to the source
+   mailbox are, so that an interruption can at worst duplicate messages, but
+   never lose them. */
+static int
+filter_mailbox_checkpoint(struct sieve_filter_context *sfctx,
+			  struct mailbox *src_box,
+			  const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct sieve_filter_data *sfdata = sfctx->data;
+	struct mailbox *move_box = sfdata->move_mailbox;
+	struct mail_search_args *search_args;
+	struct mailbox_header_lookup_ctx *headers_ctx = NULL;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	int ret = 1;
 
 	/* Start move mailbox transaction */
 
 	if (move_box != NULL) {
-		sfctx.move_trans = mailbox_transaction_begin(
+		sfctx->move_trans = mailbox_transaction_begin(
 			move_box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
 			"sieve_filter_data move_box");
 	}
@@ -324,29 +447,102 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 
 	search_args = mail_search_build_init();
 	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	mail_search_build_add_uidset(search_args, uids);
+
+	if (sfdata->wanted_headers != NULL) {
+		headers_ctx = mailbox_header_lookup_init(
+			src_box, sfdata->wanted_headers);
+	}
 
 	t = mailbox_transaction_begin(src_box, 0,
 				      "sieve_filter_data src_box");
-	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	search_ctx = mailbox_search_init(t, search_args, NULL,
+					 sfdata->wanted_fields, headers_ctx);
 	mail_search_args_unref(&search_args);
+	if (headers_ctx != NULL)
+		mailbox_header_lookup_unref(&headers_ctx);
 
 	/* Iterate through all requested messages */
 
 	while (ret >= 0 && mailbox_search_next(search_ctx, &mail))
-		ret = filter_message(&sfctx, mail);
-
-	/* Cleanup */
+		ret = filter_message(sfctx, mail);
 
 	if (mailbox_search_deinit(&search_ctx) < 0)
 		ret = -1;
 
-	if (sfctx.move_trans != NULL) {
-		if (mailbox_transaction_commit(&sfctx.move_trans) < 0)
-			ret = -1;
+	/* Commit stored messages first */
+
+	if (filter_stores_commit(sfctx) < 0) {
+		/* Messages were reported as stored when their actions
+		   committed; undo the expunges that relied on that */
+		sieve_error(sfctx->data->ehandler, NULL,
+			    "source mailbox left unchanged for this batch");
+		if (sfctx->move_trans != NULL)
+			mailbox_transaction_rollback(&sfctx->move_trans);
+		mailbox_transaction_rollback(&t);
+		return -1;
+	}
+
+	if (sfctx->move_trans != NULL) {
+		if (mailbox_transaction_commit(&sfctx->move_trans) < 0) {
+			mailbox_transaction_rollback(&t);
+			return -1;
+		}
 	}
 
 	if (mailbox_transaction_commit(&t) < 0)
 		ret = -1;
+	return ret;
+}
+
+static int
+filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	       const ARRAY_TYPE(seq_range) *range)
+{
+	struct sieve_filter_context sfctx;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	ARRAY_TYPE(uint32_t) uids;
+	ARRAY_TYPE(seq_range) chunk;
+	const uint32_t *uid_list;
+	unsigned int count, first, last;
+	int ret = 1;
+
+	/* Sync source mailbox and list the messages to filter */
+
+	t_array_init(&uids, 1024);
+	if (filter_get_uids(sfdata, src_box, range, &uids) < 0)
+		return -1;
+	uid_list = array_get(&uids, &count);
+
+	/* Initialize */
+
+	i_zero(&sfctx);
+	sfctx.data = sfdata;
+	sfctx.stores = sieve_store_batch_create();
+
+	/* Create test stream */
+	if (!sfdata->execute) {
+		sfctx.teststream = o_stream_create_fd(1, 0);
+		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
+	}
+
+	/* Filter the messages in checkpoints */
+
+	t_array_init(&chunk, 1);
+	for (first = 0; ret >= 0 && first < count;
+	     first += SIEVE_FILTER_CHECKPOINT_MESSAGES) {
+		last = I_MIN(first + SIEVE_FILTER_CHECKPOINT_MESSAGES,
+			     count) - 1;
+
+		array_clear(&chunk);
+		seq_range_array_add_range(&chunk, uid_list[first],
+					  uid_list[last]);
+		ret = filter_mailbox_checkpoint(&sfctx, src_box, &chunk);
+	}
+
+	/* Cleanup */
+
+	sieve_store_batch_destroy(&sfctx.stores);
 
 	if (sfctx.teststream != NULL)
 		o_stream_destroy(&sfctx.teststream);
@@ -366,6 +562,130 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 	return ret;
 }
 
+/*
+ * Parallel filtering
+ */
+
+static struct mailbox *
+filter_worker_open_mailbox(struct mailbox *box, enum mailbox_flags flags)
+{
+	struct mailbox *new_box;
+	enum mail_error error;
+
+	new_box = mailbox_alloc(mailbox_get_namespace(box)->list,
+				mailbox_get_vname(box), flags);
+	if (mailbox_open(new_box) < 0) {
+		i_error("Couldn't open mailbox '%s': %s",
+			mailbox_get_vname(box),
+			mailbox_get_last_error(new_box, &error));
+		mailbox_free(&new_box);
+		return NULL;
+	}
+	return new_box;
+}
+
+static int
+filter_worker(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	      const ARRAY_TYPE(seq_range) *uids)
+{
+	struct sieve_filter_data wdata = *sfdata;
+	struct mailbox *box, *move_box = NULL;
+	int ret;
+
+	/* Each worker uses its own mailbox instances, so that it gets its
+	   own view and file descriptors */
+	box = filter_worker_open_mailbox(src_box, sfdata->open_flags);
+	if (box == NULL)
+		return -1;
+	if (sfdata->move_mailbox != NULL) {
+		move_box = filter_worker_open_mailbox(sfdata->move_mailbox,
+						      sfdata->open_flags);
+		if (move_box == NULL) {
+			mailbox_free(&box);
+			return -1;
+		}
+	}
+	wdata.move_mailbox = move_box;
+
+	ret = filter_mailbox(&wdata, box, uids);
+
+	if (move_box != NULL)
+		mailbox_free(&move_box);
+	mailbox_free(&box);
+	return ret;
+}
+
+/* The messages are split into consecutive UID ranges, one for each worker
+   process. Each worker evaluates the script for its own range and applies
+   the resulting actions in its own transactions. */
+static int
+filter_mailbox_parallel(const struct sieve_filter_data *sfdata,
+			struct mailbox *src_box, unsigned int workers)
+{
+	ARRAY_TYPE(uint32_t) uids;
+	ARRAY_TYPE(seq_range) range;
+	pid_t pids[SIEVE_FILTER_MAX_WORKERS];
+	const uint32_t *uid_list;
+	unsigned int count, i, first, last;
+	int status, ret = 0;
+
+	t_array_init(&uids, 1024);
+	if (filter_get_uids(sfdata, src_box, NULL, &uids) < 0)
+		return -1;
+	uid_list = array_get(&uids, &count);
+	if (count == 0)
+		return 1;
+	if (workers > count)
+		workers = count;
+
+	fflush(stdout);
+	for (i = 0; i < workers; i++) {
+		first = (unsigned int)((uint64_t)count * i / workers);
+		last = (unsigned int)((uint64_t)count * (i + 1) / workers) - 1;
+
+		if ((pids[i] = fork()) == (pid_t)-1) {
+			/* Let the workers that were already started finish
+			   their ranges; the remaining messages are left
+			   untouched */
+			i_error("fork() failed: %m");
+			workers = i;
+			ret = -1;
+			break;
+		}
+		if (pids[i] == 0) {
+			/* Worker */
+			t_array_init(&range, 1);
+			seq_range_array_add_range(&range, uid_list[first],
+						  uid_list[last]);
+			ret = filter_worker(sfdata, src_box, &range);
+			fflush(stdout);
+			_exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	for (i = 0; i < workers; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			i_error("waitpid() failed: %m");
+			ret = -1;
+		} else if (!WIFEXITED(status) ||
+			   WEXITSTATUS(status) != EXIT_SUCCESS) {
+			i_error("worker %u failed", i + 1);
+			ret = -1;
+		}
+	}
+
+	/* Pick up the changes made by the workers, including those of the
+	   workers that succeeded when others failed */
+	if (sfdata->execute) {
+		if (mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_WRITE) < 0) {
+			sieve_error(sfdata->ehandler, NULL,
+				    "failed to sync source mailbox");
+			return -1;
+		}
+	}
+	return (ret < 0 ? -1 : 1);
+}
+
 /*
  * Tool implementation
  */
@@ -388,10 +708,11 @@ int main(int argc, char **argv)
 	enum mailbox_flags open_flags = MAILBOX_FLAG_IGNORE_ACLS;
 	enum mail_error error;
 	const char *errstr;
+	unsigned int workers = 1;
 	int c;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-				     "m:s:x:P:u:q:Q:DCevW", FALSE);
+				     "m:s:x:P:u:q:Q:j:DCevW", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
@@ -445,6 +766,17 @@ int main(int argc, char **argv)
 			/* enable verbose output */
 			verbose = TRUE;
 			break;
+		case 'j':
+			/* number of worker processes */
+			if (str_to_uint(optarg, &workers) < 0 ||
+			    workers == 0 || workers > SIEVE_FILTER_MAX_WORKERS) {
+				i_fatal_status(
+					EX_USAGE,
+					"Invalid number of workers: %s "
+					"(must be between 1 and %u)",
+					optarg, SIEVE_FILTER_MAX_WORKERS);
+			}
+			break;
 		default:
 			/* unrecognized option */
 			print_help();
@@ -575,20 +907,29 @@ int main(int argc, char **argv)
 	scriptenv.mailbox_autocreate = FALSE;
 	scriptenv.default_mailbox = dst_mailbox;
 	scriptenv.result_amend_log_message = result_amend_log_message;
+	scriptenv.store_get_transaction = filter_store_get_transaction;
 
 	/* Compose filter context */
 	i_zero(&sfdata);
 	sfdata.senv = &scriptenv;
 	sfdata.discard_action = discard_action;
 	sfdata.move_mailbox = move_box;
+	sfdata.open_flags = open_flags;
 	sfdata.main_sbin = main_sbin;
 	sfdata.ehandler = ehandler;
 	sfdata.execute = execute;
 	sfdata.source_write = source_write;
 	sfdata.default_move = default_move;
+	if (main_sbin != NULL) {
+		filter_get_wanted(main_sbin, &sfdata.wanted_headers,
+				  &sfdata.wanted_fields);
+	}
 
 	/* Apply Sieve filter to all messages found */
-	(void)filter_mailbox(&sfdata, src_box);
+	if (workers > 1)
+		(void)filter_mailbox_parallel(&sfdata, src_box, workers);
+	else
+		(void)filter_mailbox(&sfdata, src_box, NULL);
 
 	/* Close the source mailbox */
 	if (src_box != NULL)
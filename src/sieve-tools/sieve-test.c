@@ -17,6 +17,7 @@
 #include "sieve.h"
 #include "sieve-binary.h"
 #include "sieve-extensions.h"
+#include "sieve-runtime-profile.h"
 
 #include "sieve-tool.h"
 
@@ -43,7 +44,8 @@ static void print_help(void)
 "Usage: sieve-test [-a <orig-recipient-address] [-c <config-file>]\n"
 "                  [-C] [-D] [-d <dump-filename>] [-e]\n"
 "                  [-f <envelope-sender>] [-l <mail-location>]\n"
-"                  [-m <default-mailbox>] [-P <plugin>]\n"
+"                  [-m <default-mailbox>] [-p <profile-file>]\n"
+"                  [-P <plugin>]\n"
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
@@ -145,6 +147,36 @@ result_amend_log_message(const struct sieve_script_env *senv,
 	return str_c(str);
 }
 
+/*
+ * Profile output
+ */
+
+static void
+profile_write(struct sieve_runtime_profile *profile, const char *profilefile)
+{
+	struct ostream *output;
+	int fd;
+
+	if (strcmp(profilefile, "-") == 0)
+		fd = STDOUT_FILENO;
+	else {
+		fd = open(profilefile, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+		if (fd < 0) {
+			i_error("Failed to create profile file `%s': %m",
+				profilefile);
+			return;
+		}
+	}
+
+	output = o_stream_create_fd(fd, 0);
+	o_stream_set_no_error_handling(output, TRUE);
+	sieve_runtime_profile_write(profile, output);
+	o_stream_destroy(&output);
+
+	if (fd != STDOUT_FILENO)
+		i_close_fd(&fd);
+}
+
 /*
  * Tool implementation
  */
@@ -154,7 +186,7 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile, *mailbox, *dumpfile, *tracefile, *mailfile,
-		*mailloc, *errstr;
+		*mailloc, *profilefile, *errstr;
 	struct smtp_address *rcpt_to, *final_rcpt_to, *mail_from;
 	struct sieve_trace_config trace_config;
 	struct mail *mail;
@@ -166,18 +198,19 @@ int main(int argc, char **argv)
 	struct sieve_error_handler *ehandler;
 	struct ostream *teststream = NULL;
 	struct sieve_trace_log *trace_log = NULL;
+	struct sieve_runtime_profile *profile = NULL;
 	bool force_compile = FALSE, execute = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init("sieve-test", &argc, &argv,
-				     "r:a:f:m:d:l:s:eCt:T:DP:x:u:", FALSE);
+				     "r:a:f:m:d:l:p:s:eCt:T:DP:x:u:", FALSE);
 
 	ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
-	mailbox = dumpfile = tracefile = mailloc = NULL;
+	mailbox = dumpfile = tracefile = mailloc = profilefile = NULL;
 	mail_from = final_rcpt_to = rcpt_to = NULL;
 	i_zero(&trace_config);
 	trace_config.level = SIEVE_TRLVL_ACTIONS;
@@ -222,6 +255,10 @@ int main(int argc, char **argv)
 		case 'T':
 			sieve_tool_parse_trace_option(&trace_config, optarg);
 			break;
+		case 'p':
+			/* profile file */
+			profilefile = optarg;
+			break;
 		case 'd':
 			/* dump file */
 			dumpfile = optarg;
@@ -328,6 +365,9 @@ int main(int argc, char **argv)
 					 NULL : tracefile), &trace_log);
 		}
 
+		if (profilefile != NULL)
+			profile = sieve_runtime_profile_create();
+
 		/* Compose script environment */
 		if (sieve_script_env_init(
 			&scriptenv, sieve_tool_get_mail_user(sieve_tool),
@@ -347,6 +387,7 @@ int main(int argc, char **argv)
 		scriptenv.result_amend_log_message = result_amend_log_message;
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
+		scriptenv.profile = profile;
 		scriptenv.script_context = &msgdata;
 
 		i_zero(&estatus);
@@ -475,6 +516,10 @@ int main(int argc, char **argv)
 			o_stream_destroy(&teststream);
 		if (trace_log != NULL)
 			sieve_trace_log_free(&trace_log);
+		if (profile != NULL) {
+			profile_write(profile, profilefile);
+			sieve_runtime_profile_free(&profile);
+		}
 
 		/* Cleanup remaining binaries */
 		if (sbin != NULL)
@@ -3,6 +3,10 @@
 
 #include "lib.h"
 #include "array.h"
+#include "istream.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "time-util.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "mail-storage-service.h"
@@ -21,6 +25,9 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <sysexits.h>
+#include <sys/wait.h>
+
+#define SIEVEC_MAX_WORKERS 256
 
 /*
  * Print help
@@ -31,9 +38,300 @@ static void print_help(void)
 	printf(
 "Usage: sievec  [-c <config-file>] [-d] [-D] [-P <plugin>] [-x <extensions>] \n"
 "              <script-file> [<out-file>]\n"
+"       sievec  [-c <config-file>] [-D] [-P <plugin>] [-x <extensions>] \n"
+"              [-j <workers>] [-l <list-file>] [-s] [-v] [<script-path> ...]\n"
 	);
 }
 
+/*
+ * Bulk compile
+ */
+
+struct sievec_stats {
+	unsigned int compiled;
+	unsigned int up_to_date;
+	unsigned int failed;
+
+	unsigned long long compile_usecs;
+	unsigned long long slowest_usecs;
+	unsigned int slowest_idx;
+};
+
+static void
+sievec_bulk_add_path(pool_t pool, ARRAY_TYPE(const_string) *scripts,
+		     const char *path)
+{
+	struct stat st;
+	DIR *dirp;
+	struct dirent *dp;
+	const char *file;
+
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		/* Script file; stat errors are reported by the compiler */
+		file = p_strdup(pool, path);
+		array_append(scripts, &file, 1);
+		return;
+	}
+
+	/* Script directory */
+	if ((dirp = opendir(path)) == NULL)
+		i_fatal("opendir(%s) failed: %m", path);
+
+	for (;;) {
+		errno = 0;
+		if ((dp = readdir(dirp)) == NULL) {
+			if (errno != 0)
+				i_fatal("readdir(%s) failed: %m", path);
+			break;
+		}
+
+		if (!sieve_script_file_has_extension(dp->d_name))
+			continue;
+
+		if (path[strlen(path)-1] == '/')
+			file = p_strconcat(pool, path, dp->d_name, NULL);
+		else
+			file = p_strconcat(pool, path, "/", dp->d_name, NULL);
+		array_append(scripts, &file, 1);
+	}
+
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", path);
+}
+
+static void
+sievec_bulk_read_list(pool_t pool, ARRAY_TYPE(const_string) *scripts,
+		      const char *listfile)
+{
+	struct istream *input;
+	const char *line;
+
+	if (strcmp(listfile, "-") == 0)
+		input = i_stream_create_fd(STDIN_FILENO, SIZE_MAX);
+	else
+		input = i_stream_create_file(listfile, SIZE_MAX);
+
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (*line == '\0' || *line == '#')
+			continue;
+		sievec_bulk_add_path(pool, scripts, line);
+	}
+
+	if (input->stream_errno != 0) {
+		i_fatal("read(%s) failed: %s", listfile,
+			i_stream_get_error(input));
+	}
+	i_stream_unref(&input);
+}
+
+static void
+sievec_bulk_compile_script(struct sieve_instance *svinst,
+			   struct sieve_error_handler *ehandler,
+			   const char *file, unsigned int idx,
+			   bool skip_up_to_date, bool verbose,
+			   struct sievec_stats *stats)
+{
+	struct sieve_binary *sbin;
+	struct timeval start, end;
+	enum sieve_error error;
+	unsigned long long usecs;
+
+	i_gettimeofday(&start);
+
+	/* Opening the script loads the existing binary when it is still up to
+	   date; otherwise, the script is compiled */
+	if (skip_up_to_date)
+		sbin = sieve_open(svinst, file, NULL, ehandler, 0, &error);
+	else
+		sbin = sieve_compile(svinst, file, NULL, ehandler, 0, &error);
+	if (sbin == NULL) {
+		i_error("failed to compile sieve script '%s'", file);
+		stats->failed++;
+		return;
+	}
+
+	if (skip_up_to_date && sieve_is_loaded(sbin)) {
+		sieve_close(&sbin);
+		if (verbose)
+			printf("%s: up to date\n", file);
+		stats->up_to_date++;
+		return;
+	}
+
+	if (sieve_save(sbin, TRUE, NULL) < 0) {
+		sieve_close(&sbin);
+		i_error("failed to save binary for sieve script '%s'", file);
+		stats->failed++;
+		return;
+	}
+	sieve_close(&sbin);
+
+	i_gettimeofday(&end);
+	usecs = (unsigned long long)timeval_diff_usecs(&end, &start);
+
+	if (verbose) {
+		printf("%s: compiled in %llu.%03llu msecs\n",
+		       file, usecs / 1000, usecs % 1000);
+	}
+
+	stats->compiled++;
+	stats->compile_usecs += usecs;
+	if (usecs >= stats->slowest_usecs) {
+		stats->slowest_usecs = usecs;
+		stats->slowest_idx = idx;
+	}
+}
+
+static void
+sievec_bulk_compile(struct sieve_instance *svinst,
+		    const char *const *scripts, unsigned int count,
+		    unsigned int worker, unsigned int workers,
+		    bool skip_up_to_date, bool verbose,
+		    struct sievec_stats *stats)
+{
+	struct sieve_error_handler *ehandler;
+	unsigned int i;
+
+	ehandler = sieve_stderr_ehandler_create(svinst, 0);
+	sieve_error_handler_accept_infolog(ehandler, TRUE);
+	sieve_error_handler_accept_debuglog(ehandler, svinst->debug);
+
+	i_zero(stats);
+	for (i = worker; i < count; i += workers) T_BEGIN {
+		sievec_bulk_compile_script(svinst, ehandler, scripts[i], i,
+					   skip_up_to_date, verbose, stats);
+	} T_END;
+
+	sieve_error_handler_unref(&ehandler);
+}
+
+static void
+sievec_stats_merge(struct sievec_stats *dest, const struct sievec_stats *src)
+{
+	dest->compiled += src->compiled;
+	dest->up_to_date += src->up_to_date;
+	dest->failed += src->failed;
+	dest->compile_usecs += src->compile_usecs;
+	if (src->compiled > 0 && src->slowest_usecs >= dest->slowest_usecs) {
+		dest->slowest_usecs = src->slowest_usecs;
+		dest->slowest_idx = src->slowest_idx;
+	}
+}
+
+static void
+sievec_bulk_run_workers(struct sieve_instance *svinst,
+			const char *const *scripts, unsigned int count,
+			unsigned int workers, bool skip_up_to_date,
+			bool verbose, struct sievec_stats *stats_r)
+{
+	struct sievec_stats wstats;
+	pid_t pids[SIEVEC_MAX_WORKERS];
+	int fds[SIEVEC_MAX_WORKERS];
+	unsigned int i, started;
+	int fd[2], status, ret;
+
+	/* Scripts are distributed round-robin over the worker processes. Each
+	   worker continues with its own copy of the Sieve instance and reports
+	   its statistics back to the parent through a pipe. */
+	fflush(stdout);
+	for (i = 0; i < workers; i++) {
+		if (pipe(fd) < 0) {
+			i_error("pipe() failed: %m");
+			break;
+		}
+		if ((pids[i] = fork()) == (pid_t)-1) {
+			i_error("fork() failed: %m");
+			i_close_fd(&fd[0]);
+			i_close_fd(&fd[1]);
+			break;
+		}
+		if (pids[i] == 0) {
+			/* Worker */
+			i_close_fd(&fd[0]);
+			sievec_bulk_compile(svinst, scripts, count, i, workers,
+					    skip_up_to_date, verbose, &wstats);
+			fflush(stdout);
+			if (write_full(fd[1], &wstats, sizeof(wstats)) < 0) {
+				i_error("write(worker pipe) failed: %m");
+				_exit(EXIT_FAILURE);
+			}
+			_exit(EXIT_SUCCESS);
+		}
+		i_close_fd(&fd[1]);
+		fds[i] = fd[0];
+	}
+
+	/* When not all workers could be started, let the others finish and
+	   count the scripts of the missing workers as failed */
+	started = i;
+	i_zero(stats_r);
+	for (; i < workers; i++)
+		stats_r->failed += (count - i + workers - 1) / workers;
+
+	for (i = 0; i < started; i++) {
+		ret = read_full(fds[i], &wstats, sizeof(wstats));
+		if (ret < 0)
+			i_error("read(worker pipe) failed: %m");
+		i_close_fd(&fds[i]);
+
+		if (waitpid(pids[i], &status, 0) < 0)
+			i_error("waitpid() failed: %m");
+		if (ret <= 0) {
+			/* Worker died before reporting; count all of its
+			   scripts as failed */
+			i_error("worker %u did not finish", i + 1);
+			i_zero(&wstats);
+			wstats.failed = (count - i + workers - 1) / workers;
+		}
+		sievec_stats_merge(stats_r, &wstats);
+	}
+}
+
+static int
+sievec_bulk(struct sieve_instance *svinst,
+	    const ARRAY_TYPE(const_string) *scripts, unsigned int workers,
+	    bool skip_up_to_date, bool verbose)
+{
+	const char *const *files;
+	struct sievec_stats stats;
+	struct timeval start, end;
+	unsigned long long usecs;
+	unsigned int count, total;
+
+	files = array_get(scripts, &count);
+	if (workers > count)
+		workers = (count > 0 ? count : 1);
+
+	i_gettimeofday(&start);
+	if (workers <= 1) {
+		sievec_bulk_compile(svinst, files, count, 0, 1,
+				    skip_up_to_date, verbose, &stats);
+	} else {
+		sievec_bulk_run_workers(svinst, files, count, workers,
+					skip_up_to_date, verbose, &stats);
+	}
+	i_gettimeofday(&end);
+	usecs = (unsigned long long)timeval_diff_usecs(&end, &start);
+
+	total = stats.compiled + stats.up_to_date + stats.failed;
+	printf("%u scripts: %u compiled, %u up to date, %u failed "
+	       "in %llu.%03llu secs using %u worker(s) (%llu scripts/sec)\n",
+	       total, stats.compiled, stats.up_to_date, stats.failed,
+	       usecs / 1000000, (usecs / 1000) % 1000, workers,
+	       (usecs > 0 ? (unsigned long long)total * 1000000 / usecs :
+		(unsigned long long)total));
+	if (stats.compiled > 0) {
+		printf("compile time: average %llu.%03llu msecs, "
+		       "slowest %llu.%03llu msecs (%s)\n",
+		       (stats.compile_usecs / stats.compiled) / 1000,
+		       (stats.compile_usecs / stats.compiled) % 1000,
+		       stats.slowest_usecs / 1000, stats.slowest_usecs % 1000,
+		       files[stats.slowest_idx]);
+	}
+
+	return (stats.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
 /*
  * Tool implementation
  */
@@ -43,12 +341,17 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	struct stat st;
 	struct sieve_binary *sbin;
-	bool dump = FALSE;
-	const char *scriptfile, *outfile;
+	ARRAY_TYPE(const_string) scripts;
+	pool_t pool;
+	bool dump = FALSE, verbose = FALSE, bulk = FALSE, directory = FALSE;
+	bool skip_up_to_date = FALSE;
+	const char *scriptfile, *outfile, *listfile = NULL;
+	unsigned int workers = 1;
 	int exit_status = EXIT_SUCCESS;
 	int c;
 
-	sieve_tool = sieve_tool_init("sievec", &argc, &argv, "DdP:x:u:", FALSE);
+	sieve_tool = sieve_tool_init("sievec", &argc, &argv, "DdP:x:u:j:l:sv",
+				     FALSE);
 
 	outfile = NULL;
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -57,6 +360,31 @@ int main(int argc, char **argv)
 			/* dump file */
 			dump = TRUE;
 			break;
+		case 'j':
+			/* number of worker processes */
+			if (str_to_uint(optarg, &workers) < 0 ||
+			    workers == 0 || workers > SIEVEC_MAX_WORKERS) {
+				i_fatal_status(EX_USAGE,
+					"Invalid number of workers: %s "
+					"(must be between 1 and %u)",
+					optarg, SIEVEC_MAX_WORKERS);
+			}
+			bulk = TRUE;
+			break;
+		case 'l':
+			/* list of script paths */
+			listfile = optarg;
+			bulk = TRUE;
+			break;
+		case 's':
+			/* skip scripts with an up-to-date binary */
+			skip_up_to_date = TRUE;
+			bulk = TRUE;
+			break;
+		case 'v':
+			/* report each script */
+			verbose = TRUE;
+			break;
 		default:
 			print_help();
 			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
@@ -64,6 +392,51 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if ( !bulk && optind < argc &&
+		stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode) ) {
+		/* Script directory */
+		bulk = directory = TRUE;
+	}
+
+	if ( bulk ) {
+		/* Sanity checks on some of the arguments */
+
+		if ( dump )
+			i_fatal_status(EX_USAGE,
+				"the -d option is not allowed when compiling "
+				"a script directory or list.");
+
+		if ( directory && (optind + 1) < argc )
+			i_fatal_status(EX_USAGE,
+				"the outfile argument is not allowed when scriptfile is a directory.");
+
+		if ( listfile == NULL && optind >= argc ) {
+			print_help();
+			i_fatal_status(EX_USAGE, "Missing <script-path> argument");
+		}
+
+		svinst = sieve_tool_init_finish(sieve_tool, FALSE, TRUE);
+
+		/* Enable debug extension */
+		sieve_enable_debug_extension(svinst);
+
+		/* Collect all scripts */
+		pool = pool_alloconly_create("sievec scripts", 4096);
+		p_array_init(&scripts, pool, 64);
+
+		if ( listfile != NULL )
+			sievec_bulk_read_list(pool, &scripts, listfile);
+		for (; optind < argc; optind++)
+			sievec_bulk_add_path(pool, &scripts, argv[optind]);
+
+		exit_status = sievec_bulk(svinst, &scripts, workers,
+					  skip_up_to_date, verbose);
+
+		pool_unref(&pool);
+		sieve_tool_deinit(&sieve_tool);
+		return exit_status;
+	}
+
 	if ( optind < argc ) {
 		scriptfile = argv[optind++];
 	} else {
@@ -82,73 +455,22 @@ int main(int argc, char **argv)
 	/* Enable debug extension */
 	sieve_enable_debug_extension(svinst);
 
-	if ( stat(scriptfile, &st) == 0 && S_ISDIR(st.st_mode) ) {
-		/* Script directory */
-		DIR *dirp;
-		struct dirent *dp;
-
-		/* Sanity checks on some of the arguments */
+	/* Script file (i.e. not a directory)
+	 *
+	 *   NOTE: For consistency, stat errors are handled here as well
+	 */
+	sbin = sieve_tool_script_compile(svinst, scriptfile, NULL);
 
+	if ( sbin != NULL ) {
 		if ( dump )
-			i_fatal_status(EX_USAGE,
-				"the -d option is not allowed when scriptfile is a directory.");
-
-		if ( outfile != NULL )
-			i_fatal_status(EX_USAGE,
-				"the outfile argument is not allowed when scriptfile is a directory.");
-
-		/* Open the directory */
-		if ( (dirp = opendir(scriptfile)) == NULL )
-			i_fatal("opendir(%s) failed: %m", scriptfile);
-
-		/* Compile each sieve file */
-		for (;;) {
-
-			errno = 0;
-			if ( (dp = readdir(dirp)) == NULL ) {
-				if ( errno != 0 )
-					i_fatal("readdir(%s) failed: %m", scriptfile);
-				break;
-			}
-
-			if ( sieve_script_file_has_extension(dp->d_name) ) {
-				const char *file;
-
-				if ( scriptfile[strlen(scriptfile)-1] == '/' )
-					file = t_strconcat(scriptfile, dp->d_name, NULL);
-				else
-					file = t_strconcat(scriptfile, "/", dp->d_name, NULL);
-
-				sbin = sieve_tool_script_compile(svinst, file, NULL);
-
-				if ( sbin != NULL ) {
-					sieve_save(sbin, TRUE, NULL);
-					sieve_close(&sbin);
-				}
-			}
+			sieve_tool_dump_binary_to(sbin, outfile, FALSE);
+		else {
+			sieve_save_as(sbin, outfile, TRUE, 0600, NULL);
 		}
 
-		/* Close the directory */
-		if ( closedir(dirp) < 0 )
-			i_fatal("closedir(%s) failed: %m", scriptfile);
+		sieve_close(&sbin);
 	} else {
-		/* Script file (i.e. not a directory)
-		 *
-		 *   NOTE: For consistency, stat errors are handled here as well
-		 */
-		sbin = sieve_tool_script_compile(svinst, scriptfile, NULL);
-
-		if ( sbin != NULL ) {
-			if ( dump )
-				sieve_tool_dump_binary_to(sbin, outfile, FALSE);
-			else {	
-				sieve_save_as(sbin, outfile, TRUE, 0600, NULL);
-			}
-
-			sieve_close(&sbin);
-		} else {
-			exit_status = EXIT_FAILURE;
-		}
+		exit_status = EXIT_FAILURE;
 	}
 
 	sieve_tool_deinit(&sieve_tool);
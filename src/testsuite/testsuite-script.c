@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "write-full.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -19,6 +20,9 @@
 
 #include "testsuite-script.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+
 /*
  * Tested script environment
  */
@@ -33,7 +37,7 @@ void testsuite_script_deinit(void)
 
 static struct sieve_binary *
 _testsuite_script_compile(const struct sieve_runtime_env *renv,
-			  const char *script)
+			  const char *script, enum sieve_compile_flags flags)
 {
 	struct sieve_instance *svinst = testsuite_sieve_instance;
 	struct sieve_binary *sbin;
@@ -48,14 +52,50 @@ _testsuite_script_compile(const struct sieve_runtime_env *renv,
 
 	script_path = t_strconcat(script_path, "/", script, NULL);
 	if ((sbin = sieve_compile(svinst, script_path, NULL,
-				  testsuite_log_ehandler, 0, NULL)) == NULL)
+				  testsuite_log_ehandler, flags, NULL)) == NULL)
 		return NULL;
 
 	return sbin;
 }
 
+/* The source is written to a file, so that it is read like any other
+   script (in blocks of limited size) */
+static struct sieve_binary *
+_testsuite_script_compile_source(const struct sieve_runtime_env *renv,
+				 const char *source,
+				 enum sieve_compile_flags flags)
+{
+	struct sieve_instance *svinst = testsuite_sieve_instance;
+	const char *script_path;
+	int fd;
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS,
+			    "compile generated script (%zu bytes)",
+			    strlen(source));
+
+	script_path = t_strconcat(testsuite_tmp_dir_get(),
+				  "/generated.sieve", NULL);
+	fd = open(script_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		sieve_runtime_error(renv, NULL, "testsuite: "
+			"open(%s) failed: %m", script_path);
+		return NULL;
+	}
+	if (write_full(fd, source, strlen(source)) < 0) {
+		sieve_runtime_error(renv, NULL, "testsuite: "
+			"write(%s) failed: %m", script_path);
+		i_close_fd(&fd);
+		return NULL;
+	}
+	i_close_fd(&fd);
+
+	return sieve_compile(svinst, script_path, NULL,
+			     testsuite_log_ehandler, flags, NULL);
+}
+
 bool testsuite_script_compile(const struct sieve_runtime_env *renv,
-			      const char *script)
+			      const char *script, bool source,
+			      enum sieve_compile_flags flags)
 {
 	struct testsuite_interpreter_context *ictx =
 		testsuite_interpreter_context_get(renv->interp, testsuite_ext);
@@ -64,7 +104,11 @@ bool testsuite_script_compile(const struct sieve_runtime_env *renv,
 	i_assert(ictx != NULL);
 	testsuite_log_clear_messages();
 
-	if ((sbin = _testsuite_script_compile(renv, script)) == NULL)
+	if (source)
+		sbin = _testsuite_script_compile_source(renv, script, flags);
+	else
+		sbin = _testsuite_script_compile(renv, script, flags);
+	if (sbin == NULL)
 		return FALSE;
 
 	if (ictx->compiled_script != NULL)
@@ -235,7 +279,7 @@ bool testsuite_script_multiscript(const struct sieve_runtime_env *renv,
 		const char *script = scripts[i];
 
 		/* Open */
-		if ((sbin = _testsuite_script_compile(renv, script)) == NULL) {
+		if ((sbin = _testsuite_script_compile(renv, script, 0)) == NULL) {
 			result = FALSE;
 			break;
 		}
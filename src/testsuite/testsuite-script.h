@@ -8,8 +8,11 @@ void testsuite_script_deinit(void);
 
 bool testsuite_script_is_subtest(const struct sieve_runtime_env *renv);
 
+/* Compiles the script at the given path (relative to the test), or the
+   given script source when source is TRUE */
 bool testsuite_script_compile(const struct sieve_runtime_env *renv,
-			      const char *script);
+			      const char *script, bool source,
+			      enum sieve_compile_flags flags);
 bool testsuite_script_run(const struct sieve_runtime_env *renv);
 bool testsuite_script_multiscript(const struct sieve_runtime_env *renv,
 				  ARRAY_TYPE (const_string) *scriptfiles);
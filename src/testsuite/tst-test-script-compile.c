@@ -7,6 +7,7 @@
 #include "sieve-validator.h"
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
+#include "sieve-stringlist.h"
 #include "sieve-code.h"
 #include "sieve-binary.h"
 #include "sieve-dump.h"
@@ -19,9 +20,15 @@
  * Test_script_compile command
  *
  * Syntax:
- *   test_script_compile <scriptpath: string>
+ *   test_script_compile [:upload] [:source] <script: string-list>
+ *
+ * The items of the script argument are concatenated. This way, a generated
+ * :source script can contain strings up to the maximum length.
  */
 
+static bool tst_test_script_compile_registered
+	(struct sieve_validator *valdtr, const struct sieve_extension *ext,
+		struct sieve_command_registration *cmd_reg);
 static bool tst_test_script_compile_validate
 	(struct sieve_validator *valdtr, struct sieve_command *cmd);
 static bool tst_test_script_compile_generate
@@ -34,6 +41,7 @@ const struct sieve_command_def tst_test_script_compile = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.registered = tst_test_script_compile_registered,
 	.validate = tst_test_script_compile_validate,
 	.generate = tst_test_script_compile_generate
 };
@@ -55,6 +63,43 @@ const struct sieve_operation_def test_script_compile_operation = {
 	.execute = tst_test_script_compile_operation_execute
 };
 
+/*
+ * Tagged arguments
+ */
+
+/* Codes for optional arguments */
+
+enum tst_test_script_compile_optional {
+	OPT_END,
+	OPT_UPLOAD,
+	OPT_SOURCE
+};
+
+/* Tags */
+
+static const struct sieve_argument_def upload_tag = {
+	.identifier = "upload"
+};
+
+static const struct sieve_argument_def source_tag = {
+	.identifier = "source"
+};
+
+static bool tst_test_script_compile_registered
+(struct sieve_validator *valdtr, const struct sieve_extension *ext,
+	struct sieve_command_registration *cmd_reg)
+{
+	/* Compile the script as if it were uploaded by the user */
+	sieve_validator_register_tag
+		(valdtr, cmd_reg, ext, &upload_tag, OPT_UPLOAD);
+	/* The argument is the script source rather than its path (used for
+	   scripts generated by the test) */
+	sieve_validator_register_tag
+		(valdtr, cmd_reg, ext, &source_tag, OPT_SOURCE);
+
+	return TRUE;
+}
+
 /*
  * Validation
  */
@@ -65,7 +110,7 @@ static bool tst_test_script_compile_validate
 	struct sieve_ast_argument *arg = tst->first_positional;
 
 	if ( !sieve_validate_positional_argument
-		(valdtr, tst, arg, "script", 1, SAAT_STRING) ) {
+		(valdtr, tst, arg, "script", 1, SAAT_STRING_LIST) ) {
 		return FALSE;
 	}
 
@@ -92,10 +137,33 @@ static bool tst_test_script_compile_generate
 static bool tst_test_script_compile_operation_dump
 (const struct sieve_dumptime_env *denv, sieve_size_t *address)
 {
+	int opt_code = 0;
+
 	sieve_code_dumpf(denv, "TEST_SCRIPT_COMPILE:");
 	sieve_code_descend(denv);
 
-	if ( !sieve_opr_string_dump(denv, address, "script-name") )
+	/* Dump optional operands */
+	for (;;) {
+		int opt;
+
+		if ( (opt=sieve_opr_optional_dump(denv, address, &opt_code)) < 0 )
+			return FALSE;
+
+		if ( opt == 0 ) break;
+
+		switch ( opt_code ) {
+		case OPT_UPLOAD:
+			sieve_code_dumpf(denv, "upload");
+			break;
+		case OPT_SOURCE:
+			sieve_code_dumpf(denv, "source");
+			break;
+		default:
+			return FALSE;
+		}
+	}
+
+	if ( !sieve_opr_stringlist_dump(denv, address, "script") )
 		return FALSE;
 
 	return TRUE;
@@ -108,18 +176,51 @@ static bool tst_test_script_compile_operation_dump
 static int tst_test_script_compile_operation_execute
 (const struct sieve_runtime_env *renv, sieve_size_t *address)
 {
-	string_t *script_name;
-	bool result = TRUE;
+	enum sieve_compile_flags cpflags = 0;
+	struct sieve_stringlist *script_list;
+	string_t *script, *item;
+	int opt_code = 0;
+	bool source = FALSE, result = TRUE;
 	int ret;
 
 	/*
 	 * Read operands
 	 */
 
-	if ( (ret=sieve_opr_string_read(renv, address, "script-name", &script_name))
+	/* Optional operands */
+	for (;;) {
+		int opt;
+
+		if ( (opt=sieve_opr_optional_read(renv, address, &opt_code)) < 0 )
+			return SIEVE_EXEC_BIN_CORRUPT;
+
+		if ( opt == 0 ) break;
+
+		switch ( opt_code ) {
+		case OPT_UPLOAD:
+			cpflags |= SIEVE_COMPILE_FLAG_UPLOADED;
+			break;
+		case OPT_SOURCE:
+			source = TRUE;
+			break;
+		default:
+			sieve_runtime_trace_error(renv,
+				"unknown optional operand");
+			return SIEVE_EXEC_BIN_CORRUPT;
+		}
+	}
+
+	if ( (ret=sieve_opr_stringlist_read(renv, address, "script", &script_list))
 		<= 0 )
 		return ret;
 
+	script = t_str_new(256);
+	item = NULL;
+	while ( (ret=sieve_stringlist_next_item(script_list, &item)) > 0 )
+		str_append_str(script, item);
+	if ( ret < 0 )
+		return script_list->exec_status;
+
 	/*
 	 * Perform operation
 	 */
@@ -131,7 +232,7 @@ static int tst_test_script_compile_operation_execute
 
 	/* Attempt script compile */
 
-	result = testsuite_script_compile(renv, str_c(script_name));
+	result = testsuite_script_compile(renv, str_c(script), source, cpflags);
 
 	/* Set result */
 	sieve_interpreter_set_test_result(renv->interp, result);